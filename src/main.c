@@ -17,9 +17,9 @@
  */
 
 #include "deepin-network-displays-config.h"
-#include "nd-window.h"
 #include <glib/gi18n.h>
 #include <gst/gst.h>
+#include <locale.h>
 
 #include "nd-dbus-manager.h"
 
@@ -33,42 +33,27 @@ start_deepin_process ()
 }
 
 static void
-on_activate (GtkApplication *app)
+on_activate (GApplication *app)
 {
-  GtkWindow *window;
+  g_assert (G_IS_APPLICATION (app));
 
-  /* It's good practice to check your parameters at the beginning of the
-   * function. It helps catch errors early and in development instead of
-   * by your users.
-   */
-  g_assert (GTK_IS_APPLICATION (app));
-  if (g_strcmp0 (g_getenv ("NETWORK_DISPLAYS_GUI"), "enable") != 0)
-    {
-      start_deepin_process ();
-      return;
-    }
-  /* Get the current window or create one if necessary. */
-  window = gtk_application_get_active_window (app);
-  if (window == NULL)
-    {
-      window = g_object_new (ND_TYPE_WINDOW,
-                             "application", app,
-                             "default-width", 600,
-                             "default-height", 300,
-                             NULL);
-    }
+  /* The window lives in deepin-network-display-gui, which is only built
+   * with -Dgui=true. The daemon itself never loads GTK. */
+  if (g_strcmp0 (g_getenv ("NETWORK_DISPLAYS_GUI"), "enable") == 0)
+    g_warning ("NETWORK_DISPLAYS_GUI is not supported by the daemon, run deepin-network-display-gui instead");
 
-  /* Ask the window manager/compositor to present the window. */
-  gtk_window_present (window);
+  start_deepin_process ();
 }
 
 int
 main (int   argc,
       char *argv[])
 {
-  g_autoptr (GtkApplication) app = NULL;
+  g_autoptr (GApplication) app = NULL;
   int ret;
-  /* Set up gettext translations */
+  /* Set up gettext translations. Without GTK nothing else picks up the
+   * locale from the environment. */
+  setlocale (LC_ALL, "");
   bindtextdomain (GETTEXT_PACKAGE, LOCALEDIR);
   bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
   textdomain (GETTEXT_PACKAGE);
@@ -76,33 +61,14 @@ main (int   argc,
   gst_init (&argc, &argv);
 
   /*
-   * Create a new GtkApplication. The application manages our main loop,
-   * application windows, integration with the window manager/compositor, and
-   * desktop features such as file opening and single-instance applications.
-   */
-  app = gtk_application_new ("com.deepin.Cooperation.Application", G_APPLICATION_FLAGS_NONE);
-  /*
-   * We connect to the activate signal to create a window when the application
-   * has been launched. Additionally, this signal notifies us when the user
-   * tries to launch a "second instance" of the application. When they try
-   * to do that, we'll just present any existing window.
-   *
-   * Because we can't pass a pointer to any function type, we have to cast
-   * our "on_activate" function to a GCallback.
+   * A plain GApplication is enough for a D-Bus service: it still makes the
+   * daemon single-instance, but does not pull in GTK/GDK or open a display
+   * connection, which keeps D-Bus activation fast and the daemon small.
    */
+  app = g_application_new ("com.deepin.Cooperation.Application", G_APPLICATION_FLAGS_NONE);
   g_signal_connect (app, "activate", G_CALLBACK (on_activate), NULL);
 
-  /*
-   * Run the application. This function will block until the application
-   * exits. Upon return, we have our exit code to return to the shell. (This
-   * is the code you see when you do `echo $?` after running a command in a
-   * terminal.
-   *
-   * Since GtkApplication inherits from GApplication, we use the parent class
-   * method "run". But we need to cast, which is what the "G_APPLICATION()"
-   * macro does.
-   */
-  ret = g_application_run (G_APPLICATION (app), argc, argv);
+  ret = g_application_run (app, argc, argv);
 
   return ret;
 }
@@ -8,6 +8,7 @@
 #include "nd-meta-provider.h"
 #include "nd-nm-device-registry.h"
 #include "nd-sink.h"
+#include "nd-watchdog.h"
 #include "wfd/wfd-media-factory.h"
 
 static void handle_provider_signal (NdDbusManager *self);
@@ -32,8 +33,10 @@ static void add_dbus_missing_capabilities (NdDbusManager *self,
 static void delete_dbus_missing_capabilities (NdDbusManager *self,
                                               const gchar *capability);
 static GVariant *get_sink_list (NdDbusManager *self);
-static void set_deepin_audio_auto_switch (gboolean enable);
-static gboolean get_deepin_audio_auto_switch ();
+static void schedule_sink_list_changed (NdDbusManager *self);
+static void emit_sink_list_signal (NdDbusManager *self,
+                                   const gchar *signal_name,
+                                   NdDbusSink *dbus_sink);
 static gboolean idle_auto_quit_check (gpointer user_data);
 static void handle_manager_quit (NdDbusManager *self);
 
@@ -43,10 +46,17 @@ static const gchar *no_video_encoder = "NoVideoEncoder";
 
 static GMainLoop *loop;
 
+// 所有 dbus sink 共享的代理,在 manager 初始化时异步创建,创建完成前为 NULL
+static GDBusProxy *notify_proxy = NULL;
+static GDBusProxy *display_proxy = NULL;
+
 #define DEEPIN_ND_DBUS_PATH "/com/deepin/Cooperation/NetworkDisplay"
 #define DEEPIN_ND_DBUS_INTERFACE "com.deepin.Cooperation.NetworkDisplay"
 #define DEEPIN_ND_DBUS_NAME "com.deepin.Cooperation.NetworkDisplay"
 
+// SinkList 改变的合并窗口(一帧的时间),窗口内的多次增减只发送一次 PropertiesChanged
+#define SINK_LIST_CHANGED_WINDOW_MS 16
+
 // 闲时退出时间
 static const uint idle_quit_sec = 60;
 static const uint idle_check_sec = 10;
@@ -66,6 +76,7 @@ struct _NdDbusManager
   gboolean discover;
   GCancellable *cancellable;
   GMutex sink_list_mu;
+  guint sink_list_changed_id; // 等待发送的 SinkList 属性改变信号
 
   GTimeVal busy_time; // 每次 dbus method 调用会更新该时间
 };
@@ -81,10 +92,11 @@ static void
 nd_dbus_manager_finalize (GObject *object)
 {
   D_ND_INFO ("nd dbus manager finalize");
-  G_OBJECT_CLASS (nd_dbus_manager_parent_class)->finalize (object);
 
   NdDbusManager *self = ND_DBUS_MANAGER (object);
 
+  if (self->sink_list_changed_id)
+    g_source_remove (self->sink_list_changed_id);
   g_dbus_connection_unregister_object (self->bus, self->reg_id);
   g_dbus_node_info_unref (self->network_display_info);
   g_ptr_array_free (self->sink_list, TRUE);
@@ -96,6 +108,10 @@ nd_dbus_manager_finalize (GObject *object)
   g_cancellable_cancel (self->cancellable);
   g_clear_object (&self->cancellable);
   g_mutex_clear (&self->sink_list_mu);
+  g_clear_object (&notify_proxy);
+  g_clear_object (&display_proxy);
+
+  G_OBJECT_CLASS (nd_dbus_manager_parent_class)->finalize (object);
 }
 
 static void
@@ -106,6 +122,38 @@ nd_dbus_manager_class_init (NdDbusManagerClass *klass)
   object_class->finalize = nd_dbus_manager_finalize;
 }
 
+static void
+on_shared_proxy_ready (GObject *source_object,
+                       GAsyncResult *res,
+                       gpointer user_data)
+{
+  GDBusProxy **proxy = user_data;
+  g_autoptr (GError) error = NULL;
+  GDBusProxy *result = g_dbus_proxy_new_for_bus_finish (res, &error);
+  if (!result)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        D_ND_WARNING ("Unable to create proxy: %s", error->message);
+      return;
+    }
+  g_clear_object (proxy);
+  *proxy = result;
+}
+
+// 获取共享的通知代理,尚未创建完成时返回 NULL
+GDBusProxy *
+nd_dbus_manager_get_notify_proxy (void)
+{
+  return notify_proxy;
+}
+
+// 获取共享的显示代理,尚未创建完成时返回 NULL
+GDBusProxy *
+nd_dbus_manager_get_display_proxy (void)
+{
+  return display_proxy;
+}
+
 static void
 nd_dbus_manager_init (NdDbusManager *self)
 {
@@ -125,6 +173,27 @@ nd_dbus_manager_init (NdDbusManager *self)
   // 解析dbus xml
   gen_node_info_by_xml (self);
 
+  // 每个 sink 都同步创建代理会阻塞主循环,改为在这里异步创建一次供所有 sink 共享
+  self->cancellable = g_cancellable_new ();
+  g_dbus_proxy_new_for_bus (G_BUS_TYPE_SESSION,
+                            G_DBUS_PROXY_FLAGS_NONE,
+                            NULL,
+                            "org.freedesktop.Notifications",
+                            "/org/freedesktop/Notifications",
+                            "org.freedesktop.Notifications",
+                            self->cancellable,
+                            on_shared_proxy_ready,
+                            &notify_proxy);
+  g_dbus_proxy_new_for_bus (G_BUS_TYPE_SESSION,
+                            G_DBUS_PROXY_FLAGS_NONE,
+                            NULL,
+                            "com.deepin.daemon.Display",
+                            "/com/deepin/daemon/Display",
+                            "com.deepin.daemon.Display",
+                            self->cancellable,
+                            on_shared_proxy_ready,
+                            &display_proxy);
+
   self->meta_provider = nd_meta_provider_new ();
   // 监听meta_provider信号,has-providers代表是否有设备可以进行P2P连接
   g_signal_connect_object (self->meta_provider,
@@ -166,7 +235,6 @@ on_meta_provider_has_provider_changed_cb (NdDbusManager *self,
 static void
 nd_dbus_sink_cancel_cb (void *user_data)
 {
-//  set_deepin_audio_auto_switch (TRUE);
 }
 
 static void
@@ -202,7 +270,8 @@ sink_added_cb (NdDbusManager *self,
   nd_sink_dbus_set_cancel_cb (dbus_sink, nd_dbus_sink_cancel_cb, self);
   g_ptr_array_add (self->sink_list, g_object_ref (dbus_sink));
   nd_sink_dbus_export (dbus_sink);
-  emit_nd_manager_dbus_value_changed (self, "SinkList", get_sink_list (self));
+  emit_sink_list_signal (self, "SinkAdded", dbus_sink);
+  schedule_sink_list_changed (self);
   g_mutex_unlock (&self->sink_list_mu);
 }
 
@@ -223,9 +292,9 @@ sink_removed_cb (NdDbusManager *self,
       NdDbusSink *dbus_sink = g_ptr_array_index (self->sink_list, index);
       D_ND_INFO ("Remove a exist sink: %s %s", nd_sink_dbus_get_name (dbus_sink), nd_sink_dbus_get_hw_address (dbus_sink));
       nd_sink_dbus_stop_export (dbus_sink);
+      emit_sink_list_signal (self, "SinkRemoved", dbus_sink);
       g_ptr_array_remove_index (self->sink_list, index); // https://docs.gtk.org/glib/type_func.PtrArray.remove_index.html 返回的元素内存可能已经释放
-      GVariant *sink_list = get_sink_list (self);
-      emit_nd_manager_dbus_value_changed (self, "SinkList", sink_list);
+      schedule_sink_list_changed (self);
     }
   else
     {
@@ -308,8 +377,10 @@ sink_list_free_element (gpointer data, gpointer user_data)
 {
   // 释放成员内存的函数，可以根据实际情况来实现
   NdDbusSink *dbus_sink = ND_DBUS_SINK (data);
+  NdDbusManager *self = user_data;
   D_ND_INFO ("free sink list element");
   nd_sink_dbus_stop_export (dbus_sink);
+  emit_sink_list_signal (self, "SinkRemoved", dbus_sink);
   g_object_unref (dbus_sink);
 }
 
@@ -320,12 +391,9 @@ free_sink_list (NdDbusManager *self)
   // 先遍历所有sink停止导出，再重置GPtrArray的内存;
   g_ptr_array_foreach (self->sink_list,
                        sink_list_free_element,
-                       NULL);
+                       self);
   self->sink_list = g_ptr_array_new_full (0, g_object_unref);
-  GVariant *sink_list = get_sink_list (self);
-  emit_nd_manager_dbus_value_changed (self,
-                                      "SinkList",
-                                      sink_list);
+  schedule_sink_list_changed (self);
   g_mutex_unlock (&self->sink_list_mu);
 }
 
@@ -345,42 +413,6 @@ handle_manager_quit (NdDbusManager *self)
   manager_real_quit (self);
 }
 
-static gboolean
-get_deepin_audio_auto_switch ()
-{
-  const gchar *command = "dde-dconfig --get -a org.deepin.dde.daemon -r org.deepin.dde.daemon.audio -k autoSwitchPort";
-  g_autofree gchar *stdout_text = NULL;
-  g_autofree gchar *stderr_text = NULL;
-  gint exit_status;
-  g_autoptr (GError) error = NULL;
-  gboolean result = g_spawn_command_line_sync (command, &stdout_text, &stderr_text, &exit_status, &error);
-  if (error)
-    D_ND_WARNING ("Failed to run '%s': %s", command, error->message);
-  else if (exit_status != 0)
-    D_ND_WARNING ("Failed to run, '%s' returned %d", command, exit_status);
-  else if (result)
-    {
-      g_autofree gchar *res = g_strstrip (stdout_text);
-      return (g_strcmp0 ("true", res) == 0);
-    }
-}
-
-static void
-set_deepin_audio_auto_switch (gboolean enable)
-{
-  gchar *auto_string = enable ? "true" : "false";
-  g_autofree gchar *command = g_strdup_printf ("dde-dconfig --set -a org.deepin.dde.daemon -r org.deepin.dde.daemon.audio -k autoSwitchPort -v %s", auto_string);
-  g_autofree gchar *stdout_text = NULL;
-  g_autofree gchar *stderr_text = NULL;
-  gint exit_status = 0;
-  g_autoptr (GError) error = NULL;
-  g_spawn_command_line_sync (command, &stdout_text, &stderr_text, &exit_status, &error);
-  if (error)
-    D_ND_WARNING ("Failed to run '%s': %s", command, error->message);
-  else if (exit_status != 0)
-    D_ND_WARNING ("Failed to run, '%s' returned %d", command, exit_status);
-}
-
 // dbus method 处理
 static void
 handle_manager_method_call (GDBusConnection *connection,
@@ -480,15 +512,64 @@ get_sink_list (NdDbusManager *self)
   for (gint i = 0; i < self->sink_list->len; i++)
     {
       NdDbusSink *sink = (NdDbusSink *) self->sink_list->pdata[i];
-      g_autofree gchar *path = NULL;
-      path = g_strdup_printf ("/com/deepin/Cooperation/NetworkDisplay/Sink%s",
-                              g_strdelimit (g_strdup (nd_sink_dbus_get_hw_address (sink)), ":", '_'));
+      const gchar *path = nd_sink_dbus_get_path (sink);
       g_variant_builder_add_value (&builder, g_variant_new_object_path (path));
       D_ND_INFO ("SinkList: get a sink mac: %s", path);
     }
   return g_variant_builder_end (&builder);
 }
 
+static gboolean
+sink_list_changed_cb (gpointer user_data)
+{
+  NdDbusManager *self = user_data;
+
+  g_mutex_lock (&self->sink_list_mu);
+  self->sink_list_changed_id = 0;
+  emit_nd_manager_dbus_value_changed (self, "SinkList", get_sink_list (self));
+  g_mutex_unlock (&self->sink_list_mu);
+
+  return G_SOURCE_REMOVE;
+}
+
+// 调用需要加锁
+// 发现设备时 sink 会成批地增减,合并为一次 SinkList 属性改变信号;
+// 单个 sink 的增减通过 SinkAdded/SinkRemoved 信号立即通知
+static void
+schedule_sink_list_changed (NdDbusManager *self)
+{
+  if (self->sink_list_changed_id)
+    return;
+
+  self->sink_list_changed_id = g_timeout_add (SINK_LIST_CHANGED_WINDOW_MS,
+                                              sink_list_changed_cb,
+                                              self);
+}
+
+static void
+emit_sink_list_signal (NdDbusManager *self,
+                       const gchar *signal_name,
+                       NdDbusSink *dbus_sink)
+{
+  const gchar *path = nd_sink_dbus_get_path (dbus_sink);
+  g_autoptr (GError) error = NULL;
+
+  if (!self->bus || !path)
+    return;
+
+  D_ND_INFO ("emit %s: %s", signal_name, path);
+  if (!g_dbus_connection_emit_signal (self->bus,
+                                      NULL,
+                                      DEEPIN_ND_DBUS_PATH,
+                                      DEEPIN_ND_DBUS_INTERFACE,
+                                      signal_name,
+                                      g_variant_new ("(o)", path),
+                                      &error))
+    {
+      D_ND_WARNING ("Failed to emit %s signal: %s", signal_name, error->message);
+    }
+}
+
 static GVariant *
 get_missing_capabilities (NdDbusManager *self)
 {
@@ -516,7 +597,7 @@ set_dbus_prop_sink_list (NdDbusManager *self, GPtrArray *sink_list)
 {
   g_mutex_lock (&self->sink_list_mu);
   self->sink_list = sink_list;
-  emit_nd_manager_dbus_value_changed (self, "SinkList", get_sink_list (self));
+  schedule_sink_list_changed (self);
   g_mutex_unlock (&self->sink_list_mu);
 }
 
@@ -578,9 +659,22 @@ emit_object_dbus_value_changed (GDBusConnection *bus,
                                 GVariant *property_value)
 {
   GVariantBuilder builder;
-  g_variant_builder_init (&builder, G_VARIANT_TYPE_ARRAY);
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
   g_variant_builder_add (&builder, "{sv}", property_name, property_value);
   D_ND_INFO ("emit property changed:%s", property_name);
+  emit_object_dbus_properties_changed (bus,
+                                       path,
+                                       interface_name,
+                                       g_variant_builder_end (&builder));
+}
+
+// changed_properties 为 a{sv},多个属性的改变合并在一个信号中发送
+void
+emit_object_dbus_properties_changed (GDBusConnection *bus,
+                                     const gchar *path,
+                                     const gchar *interface_name,
+                                     GVariant *changed_properties)
+{
   g_autoptr (GError) error = NULL;
   if (!g_dbus_connection_emit_signal (
           bus,
@@ -588,7 +682,7 @@ emit_object_dbus_value_changed (GDBusConnection *bus,
           path,
           "org.freedesktop.DBus.Properties",
           "PropertiesChanged",
-          g_variant_new ("(sa{sv}as)", interface_name, &builder, NULL),
+          g_variant_new ("(s@a{sv}as)", interface_name, changed_properties, NULL),
           &error))
     {
       D_ND_WARNING ("Failed to emit PropertiesChanged signal: %s", error->message);
@@ -633,6 +727,12 @@ gen_node_info_by_xml (NdDbusManager *self)
                                            "    <property name='Enabled' type='b' access='read'/>"
                                            "    <property name='MissingCapabilities' type='as' access='read'/>"
                                            "    <method name='Refresh'></method>"
+                                           "    <signal name='SinkAdded'>"
+                                           "      <arg name='sink' type='o'/>"
+                                           "    </signal>"
+                                           "    <signal name='SinkRemoved'>"
+                                           "      <arg name='sink' type='o'/>"
+                                           "    </signal>"
                                            "    <method name='Enable'>"
                                            "      <arg name='enable' direction='in' type='b'/>"
                                            "    </method>"
@@ -688,7 +788,10 @@ dbus_export (NdDbusManager *self)
       self,
       NULL);
   loop = g_main_loop_new (NULL, FALSE);
+  // 监控主循环,单次阻塞超过阈值时输出日志
+  NdWatchdog *watchdog = nd_watchdog_new (NULL);
   g_main_loop_run (loop);
+  nd_watchdog_free (watchdog);
   g_bus_unown_name (owner_id);
   g_main_loop_unref (loop);
 }
@@ -15,10 +15,16 @@ G_BEGIN_DECLS
 G_DECLARE_FINAL_TYPE (NdDbusManager, nd_dbus_manager, ND, DBUS_MANAGER, GObject)
 
 NdDbusManager *nd_dbus_manager_new (void);
+GDBusProxy *nd_dbus_manager_get_notify_proxy (void);
+GDBusProxy *nd_dbus_manager_get_display_proxy (void);
 void dbus_export (NdDbusManager *self);
 void emit_object_dbus_value_changed (GDBusConnection *bus,
                                      const gchar *path,
                                      const gchar *interface_name,
                                      const gchar *property_name,
                                      GVariant *property_value);
+void emit_object_dbus_properties_changed (GDBusConnection *bus,
+                                          const gchar *path,
+                                          const gchar *interface_name,
+                                          GVariant *changed_properties);
 G_END_DECLS
@@ -5,6 +5,8 @@
 #include "nd-dbus-sink.h"
 
 #include "nd-dbus-manager.h"
+#include "wfd/wfd-media-factory.h"
+#include "wfd/wfd-server.h"
 
 #include <gio/gio.h>
 #include <glib/gi18n.h>
@@ -16,8 +18,6 @@ struct _NdDbusSink
   guint registration_id;
   GCancellable *cancellable;
   gboolean is_portal_init_running;
-  GDBusProxy *notify_proxy;
-  GDBusProxy *display_proxy;
   // 需要在初始化时完成以下变量的初始化
   GDBusConnection *bus;
   NdMetaProvider *provider;
@@ -25,6 +25,7 @@ struct _NdDbusSink
   NdPulseaudio *pulse;
   gboolean x11;
   NdSink *sink; // meta_sink
+  NdSink *stream_sink; // 目前一定是 p2p sink
   gchar *dbus_path;
   // 初始化sink时完成以下dbus属性初始化
   gchar *name;
@@ -33,10 +34,20 @@ struct _NdDbusSink
   gchar *hw_address;
   // 目前nm的机制,peer的属性不会改变,只有创建新的peer会更新属性
 
+  // 等待合并发送的属性改变(属性名 -> 值)
+  GHashTable *pending_props;
+  guint flush_props_source_id;
+
   nd_handle_cancel_cb_t nd_handle_cancel_cb;
   void *nd_handle_cancel_cb_user_data;
 
   guint unload_pa_module_source_id;
+
+  // 并行启动(portal、pulseaudio、防火墙和P2P同时进行)的状态
+  gint64 bringup_start_time; // 单调时间,用于记录每一步的耗时
+  guint bringup_pending;     // 必须在 SETUP 之前完成的步骤数
+  gboolean setup_held;       // 是否正在阻止 WFD 客户端触发 SETUP
+  gpointer setup_key;        // SETUP 门控的键,即 stream_sink,只阻止该 sink 的客户端
 };
 
 enum
@@ -86,7 +97,7 @@ static GVariant *handle_sink_get_property (GDBusConnection *connection,
                                            GError **error,
                                            gpointer user_data);
 
-static void emit_nd_manager_value_changed (const NdDbusSink *self,
+static void emit_nd_manager_value_changed (NdDbusSink *self,
                                            const gchar *property_name,
                                            GVariant *property_value);
 static void set_prop_status (NdDbusSink *self, gint32 status);
@@ -94,8 +105,22 @@ static void send_notify (NdDbusSink *self, const gchar *body);
 static void handle_cancel (NdDbusSink *self);
 static void set_prop_name (NdDbusSink *self, const gchar *name);
 static void init_pulse_async (NdDbusSink *self);
+static void save_restore_token (const gchar *token);
+static void bringup_step_done (NdDbusSink *self, const gchar *step);
+static void bringup_release_setup (NdDbusSink *self);
+
+// 正在投屏(或正在准备投屏)的所有 dbus sink,它们共享同一路采集和编码
+static GList *streaming_sinks = NULL;
 
-static NdSink *stream_sink = NULL; // 目前一定是 p2p sink
+// 属性改变信号的合并窗口(一帧的时间),窗口内同一 sink 的所有改变只发送一次 PropertiesChanged
+#define PROPERTIES_CHANGED_WINDOW_MS 16
+// 信号强度的滞回阈值,与上次通知的值相差小于该值时不发送改变信号
+#define STRENGTH_HYSTERESIS 5
+
+// 断开后保留 portal 会话的时间,短时间内重连可以直接复用,不需要重新选择屏幕
+#define PORTAL_GRACE_SECONDS 10
+static NdScreencastPortal *lingering_portal = NULL;
+static guint lingering_portal_timeout_id = 0;
 
 NdDbusSink *
 nd_dbus_sink_new (NdMetaProvider *provider,
@@ -121,6 +146,13 @@ nd_sink_dbus_get_name (NdDbusSink *self)
   return g_strdup (self->name);
 }
 
+// 导出前为 NULL
+const gchar *
+nd_sink_dbus_get_path (NdDbusSink *self)
+{
+  return self->dbus_path;
+}
+
 void
 nd_sink_dbus_set_cancel_cb (NdDbusSink *self, nd_handle_cancel_cb_t cb, void *user_data)
 {
@@ -138,9 +170,11 @@ static void
 nd_dbus_sink_finalize (GObject *object)
 {
   D_ND_DEBUG ("dbus sink finalize");
-  G_OBJECT_CLASS (nd_dbus_sink_parent_class)->finalize (object);
 
   NdDbusSink *self = ND_DBUS_SINK (object);
+  if (self->flush_props_source_id)
+    g_source_remove (self->flush_props_source_id);
+  g_hash_table_unref (self->pending_props);
   g_dbus_connection_unregister_object (self->bus, self->registration_id);
   g_dbus_node_info_unref (self->network_display_sink_info);
 
@@ -148,10 +182,14 @@ nd_dbus_sink_finalize (GObject *object)
   g_clear_object (&self->portal);
   g_clear_object (&self->pulse);
   g_clear_object (&self->sink);
+  g_clear_object (&self->stream_sink);
+  streaming_sinks = g_list_remove (streaming_sinks, self);
   g_cancellable_cancel (self->cancellable);
   g_clear_object (&self->cancellable);
-  g_clear_object (&self->display_proxy);
-  g_clear_object (&self->notify_proxy);
+  bringup_release_setup (self);
+
+  // 最后再释放父类,之前还会访问 self 的成员
+  G_OBJECT_CLASS (nd_dbus_sink_parent_class)->finalize (object);
 }
 
 static void
@@ -176,13 +214,33 @@ nd_dbus_sink_get_property (GObject *object, guint prop_id, GValue *value, GParam
     }
 }
 
+static void
+set_prop_strength (NdDbusSink *self, guint32 strength)
+{
+  // 信号强度会不停地小幅波动,只有变化足够大时才通知
+  if (ABS ((gint) strength - (gint) self->strength) < STRENGTH_HYSTERESIS)
+    return;
+
+  self->strength = strength;
+  emit_nd_manager_value_changed (self, "Strength", g_variant_new_uint32 (strength));
+}
+
 static void
 nd_dbus_sink_handle_property_changed (NdDbusSink *self, GParamSpec *pspec, NdSink *sink)
 {
-  g_autofree gchar *sink_name = NULL;
-  g_object_get (self->sink, "display-name", &sink_name, NULL);
-  if (sink_name)
-    set_prop_name (self, g_strdup (sink_name));
+  if (g_str_equal (pspec->name, "display-name"))
+    {
+      g_autofree gchar *sink_name = NULL;
+      g_object_get (self->sink, "display-name", &sink_name, NULL);
+      if (sink_name && g_strcmp0 (sink_name, self->name) != 0)
+        set_prop_name (self, sink_name);
+    }
+  else if (g_str_equal (pspec->name, "strength"))
+    {
+      gint sink_strength = 0;
+      g_object_get (self->sink, "strength", &sink_strength, NULL);
+      set_prop_strength (self, MAX (sink_strength, 0));
+    }
 }
 
 static void
@@ -339,73 +397,48 @@ nd_dbus_sink_init (NdDbusSink *self)
                                                 "  </interface>"
                                                 "</node>";
   self->network_display_sink_info = g_dbus_node_info_new_for_xml (network_display_sink_interface, NULL);
+  self->pending_props = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_variant_unref);
   g_assert (self->network_display_sink_info != NULL);
-
-  g_autoptr (GError) error = NULL;
-  self->notify_proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-                                                      G_DBUS_PROXY_FLAGS_NONE,
-                                                      NULL,
-                                                      "org.freedesktop.Notifications",
-                                                      "/org/freedesktop/Notifications",
-                                                      "org.freedesktop.Notifications",
-                                                      NULL,
-                                                      &error);
-  if (!self->notify_proxy)
-    {
-      D_ND_WARNING ("Unable to connect Notifications: %s\n", error->message);
-    }
-
-  self->display_proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-                                                       G_DBUS_PROXY_FLAGS_NONE,
-                                                       NULL,
-                                                       "com.deepin.daemon.Display",
-                                                       "/com/deepin/daemon/Display",
-                                                       "com.deepin.daemon.Display",
-                                                       NULL,
-                                                       &error);
-  if (!self->display_proxy)
-    {
-      D_ND_WARNING ("Unable to connect display: %s\n", error->message);
-    }
 }
 
 static void
 nd_sink_start_stream_real (NdDbusSink *self)
 {
-  if (!self->portal && !self->x11)
+  // 并行启动时 portal 可能还在初始化,SETUP 会一直等到采集准备好
+  if (!self->portal && !self->x11 && !self->is_portal_init_running)
     {
       D_ND_WARNING ("Cannot start streaming right now as we don't have a portal!");
       return;
     }
 
   // 正常返回的是P2P sink
-  stream_sink = g_object_ref (nd_sink_start_stream (self->sink));
+  self->stream_sink = nd_sink_start_stream (self->sink);
 
   // 返回的stream_sink是p2p sink
-  if (!stream_sink)
+  if (!self->stream_sink)
     {
       D_ND_WARNING ("NdWindow: Could not start streaming!");
       return;
     }
-  g_signal_connect_object (stream_sink,
+  g_signal_connect_object (self->stream_sink,
                            "create-source",
                            (GCallback) sink_create_video_source_cb,
                            self,
                            G_CONNECT_SWAPPED);
 
-  g_signal_connect_object (stream_sink,
+  g_signal_connect_object (self->stream_sink,
                            "create-audio-source",
                            (GCallback) sink_create_audio_source_cb,
                            self,
                            G_CONNECT_SWAPPED);
 
-  g_signal_connect_object (stream_sink,
+  g_signal_connect_object (self->stream_sink,
                            "notify::state",
                            (GCallback) sink_notify_state_cb,
                            self,
                            G_CONNECT_SWAPPED);
   /* We might have moved into the error state in the meantime. */
-  sink_notify_state_cb (self, NULL, stream_sink);
+  sink_notify_state_cb (self, NULL, self->stream_sink);
   // TODO 使用 g_object_bind_property 进行单项数据绑定或者监听属性变化
   /*
   g_ptr_array_add (self->sink_property_bindings,
@@ -454,7 +487,7 @@ nd_dbus_screencast_portal_init_async_cb (GObject *source_object,
             }
           D_ND_WARNING ("Falling back to X11! You need to fix your setup to avoid issues (XDG Portals and/or mutter screencast support)!");
           self->x11 = TRUE;
-          init_pulse_async (self);
+          bringup_step_done (self, "portal");
         }
       g_object_unref (source_object);
       return;
@@ -462,9 +495,99 @@ nd_dbus_screencast_portal_init_async_cb (GObject *source_object,
 
   self = ND_DBUS_SINK (user_data);
   self->x11 = FALSE;
-  self->is_portal_init_running = FALSE;
   self->portal = ND_SCREENCAST_PORTAL (source_object);
-  init_pulse_async (self);
+  save_restore_token (nd_screencast_portal_get_restore_token (self->portal));
+  bringup_step_done (self, "portal");
+}
+
+static gchar *
+get_portal_state_path (void)
+{
+  return g_build_filename (g_get_user_config_dir (), "deepin-network-displays", "portal.ini", NULL);
+}
+
+// 读取上次保存的 portal restore token,选择的屏幕属于用户而不是某个 sink,所以只保存一个
+static gchar *
+load_restore_token (void)
+{
+  g_autoptr (GKeyFile) key_file = g_key_file_new ();
+  g_autofree gchar *path = get_portal_state_path ();
+  if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, NULL))
+    return NULL;
+  return g_key_file_get_string (key_file, "ScreenCast", "RestoreToken", NULL);
+}
+
+// token 只能使用一次,每次会话开始后都需要保存新的 token
+static void
+save_restore_token (const gchar *token)
+{
+  g_autoptr (GKeyFile) key_file = g_key_file_new ();
+  g_autofree gchar *path = get_portal_state_path ();
+  g_autofree gchar *dir = g_path_get_dirname (path);
+  g_autoptr (GError) error = NULL;
+  g_key_file_load_from_file (key_file, path, G_KEY_FILE_KEEP_COMMENTS, NULL);
+  if (token)
+    g_key_file_set_string (key_file, "ScreenCast", "RestoreToken", token);
+  else
+    g_key_file_remove_key (key_file, "ScreenCast", "RestoreToken", NULL);
+  g_mkdir_with_parents (dir, 0700);
+  if (!g_key_file_save_to_file (key_file, path, &error))
+    D_ND_WARNING ("Unable to save portal restore token: %s", error->message);
+}
+
+static void
+drop_lingering_portal (void)
+{
+  g_signal_handlers_disconnect_by_data (lingering_portal, &lingering_portal);
+  g_clear_object (&lingering_portal);
+}
+
+static gboolean
+lingering_portal_expired_cb (gpointer user_data)
+{
+  D_ND_INFO ("Closing unused portal session");
+  lingering_portal_timeout_id = 0;
+  nd_screencast_portal_close (lingering_portal);
+  drop_lingering_portal ();
+  return G_SOURCE_REMOVE;
+}
+
+// 保留期间 portal 会话被关闭(例如用户撤销了共享),不能再复用
+static void
+lingering_portal_closed_cb (NdScreencastPortal *portal, gpointer user_data)
+{
+  D_ND_INFO ("Unused portal session was closed");
+  g_source_remove (lingering_portal_timeout_id);
+  lingering_portal_timeout_id = 0;
+  drop_lingering_portal ();
+}
+
+// 最后一个使用者断开后,portal 会话再保留一段时间
+static void
+linger_portal (NdScreencastPortal *portal)
+{
+  if (lingering_portal)
+    {
+      g_source_remove (lingering_portal_timeout_id);
+      lingering_portal_expired_cb (NULL);
+    }
+  // 会话已经被关闭的 portal 没有保留的意义
+  if (!nd_screencast_portal_is_open (portal))
+    return;
+  lingering_portal = g_object_ref (portal);
+  g_signal_connect (lingering_portal, "closed", G_CALLBACK (lingering_portal_closed_cb), &lingering_portal);
+  lingering_portal_timeout_id = g_timeout_add_seconds (PORTAL_GRACE_SECONDS, lingering_portal_expired_cb, NULL);
+}
+
+static NdScreencastPortal *
+take_lingering_portal (void)
+{
+  if (!lingering_portal)
+    return NULL;
+  g_source_remove (lingering_portal_timeout_id);
+  lingering_portal_timeout_id = 0;
+  g_signal_handlers_disconnect_by_data (lingering_portal, &lingering_portal);
+  return g_steal_pointer (&lingering_portal);
 }
 
 // from find_sink_list_row_activated_cb 连接设备
@@ -472,8 +595,9 @@ static void
 init_portal_async (NdDbusSink *self)
 {
   NdScreencastPortal *portal = NULL;
-  self->cancellable = g_cancellable_new ();
+  g_autofree gchar *restore_token = load_restore_token ();
   portal = nd_screencast_portal_new ();
+  nd_screencast_portal_set_restore_token (portal, restore_token);
 //  self->portal = portal;
   g_async_initable_init_async (G_ASYNC_INITABLE (portal),
                                G_PRIORITY_LOW,
@@ -492,22 +616,25 @@ nd_dbus_pulseaudio_init_async_cb (GObject *source_object,
   if (!g_async_initable_init_finish (G_ASYNC_INITABLE (source_object), res, &error))
     {
       if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-        D_ND_WARNING ("Error initializing pulse audio sink: %s", error->message);
+        {
+          // 没有音频也继续投屏
+          D_ND_WARNING ("Error initializing pulse audio sink: %s", error->message);
+          bringup_step_done (ND_DBUS_SINK (user_data), "pulseaudio");
+        }
       g_object_unref (source_object);
       return;
     }
 
   self = ND_DBUS_SINK (user_data);
   self->pulse = ND_PULSEAUDIO (source_object);
-  D_ND_INFO ("Nd pulseaudio module init succeed, start stream real");
-  nd_sink_start_stream_real (self);
+  D_ND_INFO ("Nd pulseaudio module init succeed");
+  bringup_step_done (self, "pulseaudio");
 }
 
 static void
 init_pulse_async (NdDbusSink *self)
 {
   NdPulseaudio *pulse = NULL;
-  self->cancellable = g_cancellable_new ();
   pulse = nd_pulseaudio_new ();
   g_async_initable_init_async (G_ASYNC_INITABLE (pulse),
                                G_PRIORITY_LOW,
@@ -516,14 +643,129 @@ init_pulse_async (NdDbusSink *self)
                                self);
 }
 
+static gint64
+bringup_elapsed_ms (NdDbusSink *self)
+{
+  return (g_get_monotonic_time () - self->bringup_start_time) / G_TIME_SPAN_MILLISECOND;
+}
+
+// 放开 SETUP,允许 WFD 客户端开始创建媒体
+static void
+bringup_release_setup (NdDbusSink *self)
+{
+  self->is_portal_init_running = FALSE;
+  self->bringup_pending = 0;
+  if (!self->setup_held)
+    return;
+  self->setup_held = FALSE;
+  wfd_server_release_setup (self->setup_key);
+  self->setup_key = NULL;
+}
+
+// portal 和 pulseaudio 各自完成后调用,两者都完成后采集才可用
+static void
+bringup_step_done (NdDbusSink *self, const gchar *step)
+{
+  D_ND_INFO ("Bring-up step %s done after %" G_GINT64_FORMAT " ms", step, bringup_elapsed_ms (self));
+  if (self->bringup_pending == 0 || --self->bringup_pending > 0)
+    return;
+  D_ND_INFO ("Capture ready after %" G_GINT64_FORMAT " ms", bringup_elapsed_ms (self));
+  bringup_release_setup (self);
+}
+
+// 同时启动 portal、pulseaudio 和 P2P 连接(防火墙、NM、WFD 服务),
+// 只有采集相关的步骤需要在 SETUP 之前完成,由 wfd 服务端的 SETUP 门控保证。
+// 所有步骤共用 self->cancellable,取消时一起取消。
+static void
+start_bringup (NdDbusSink *self)
+{
+  g_clear_object (&self->cancellable);
+  self->cancellable = g_cancellable_new ();
+  self->bringup_start_time = g_get_monotonic_time ();
+  self->bringup_pending = 2;
+  self->is_portal_init_running = TRUE;
+
+  self->portal = take_lingering_portal ();
+  if (self->portal)
+    {
+      D_ND_INFO ("Reusing the portal session of the previous connection");
+      self->x11 = FALSE;
+      self->bringup_pending--;
+    }
+  else
+    {
+      init_portal_async (self);
+    }
+  init_pulse_async (self);
+  nd_sink_start_stream_real (self);
+
+  // 客户端只有在 P2P 连接建立之后才会连上来,此时 stream_sink 已经确定;
+  // 只阻止这个 sink 的客户端,其他正在投屏或恢复的 sink 不受影响
+  if (self->stream_sink && self->bringup_pending > 0)
+    {
+      self->setup_key = self->stream_sink;
+      self->setup_held = TRUE;
+      wfd_server_hold_setup (self->setup_key);
+    }
+}
+
+// 查找另一个已经完成采集初始化的 dbus sink,新的连接可以直接复用它的采集源
+static NdDbusSink *
+find_capturing_sink (NdDbusSink *self)
+{
+  GList *l;
+
+  for (l = streaming_sinks; l; l = l->next)
+    {
+      NdDbusSink *other = l->data;
+
+      if (other != self && other->pulse && (other->portal || other->x11))
+        return other;
+    }
+
+  return NULL;
+}
+
+// 查找另一个仍在使用同一个 portal 会话的 dbus sink
+static NdDbusSink *
+find_portal_user (NdDbusSink *self)
+{
+  GList *l;
+
+  for (l = streaming_sinks; l; l = l->next)
+    {
+      NdDbusSink *other = l->data;
+
+      if (other != self && other->portal == self->portal)
+        return other;
+    }
+
+  return NULL;
+}
+
+static gboolean
+has_other_streaming_sinks (NdDbusSink *self)
+{
+  GList *l;
+
+  for (l = streaming_sinks; l; l = l->next)
+    {
+      if (l->data != self)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 static void
 stop_stream (NdDbusSink *self)
 {
-  if (!stream_sink)
+  if (!self->stream_sink)
     return;
-  nd_sink_stop_stream (stream_sink);
-  // 关闭串流之后,重新开启扫描
-  g_object_set (self->provider, "discover", TRUE, NULL);
+  nd_sink_stop_stream (self->stream_sink);
+  // 所有串流都关闭之后,重新开启扫描
+  if (!has_other_streaming_sinks (self))
+    g_object_set (self->provider, "discover", TRUE, NULL);
 }
 
 static gboolean
@@ -532,28 +774,35 @@ sink_real_cancel (gpointer user_data)
   NdDbusSink *self = ND_DBUS_SINK (user_data);
   D_ND_INFO("start real cancel screen cast");
   stop_stream (self);
-  if (stream_sink)
+  if (self->stream_sink)
     {
-      g_signal_handlers_disconnect_by_data (stream_sink, self);
-      g_object_unref (stream_sink);
-      stream_sink = NULL;
+      g_signal_handlers_disconnect_by_data (self->stream_sink, self);
+      g_clear_object (&self->stream_sink);
     }
+  streaming_sinks = g_list_remove (streaming_sinks, self);
   if (self->cancellable)
     g_cancellable_cancel (self->cancellable);
+  bringup_release_setup (self);
+  self->bringup_start_time = 0;
   if (self->portal)
-    g_clear_object (&self->portal);
+    {
+      if (!find_portal_user (self))
+        linger_portal (self->portal);
+      g_clear_object (&self->portal);
+    }
+  g_clear_object (&self->pulse);
   if (self->nd_handle_cancel_cb)
     self->nd_handle_cancel_cb (self->nd_handle_cancel_cb_user_data);
   return G_SOURCE_REMOVE;
 }
 
-// pa模块卸载完成后继续其他退出操作
+// pa模块卸载完成,释放卸载期间持有的引用
 static void
 nd_pulseaudio_unload_module_cb (pa_context *c, int success, void *userdata)
 {
-  NdDbusSink *self = ND_DBUS_SINK (userdata);
-  D_ND_INFO ("unload pa module end, continue cancel");
-  sink_real_cancel (self);
+  NdPulseaudio *pulse = ND_PULSEAUDIO (userdata);
+  D_ND_INFO ("unload pa module end, success: %d", success);
+  g_object_unref (pulse);
 //  gboolean removed = g_source_remove (self->unload_pa_module_source_id);
 //  self->unload_pa_module_source_id = 0;
 //  D_ND_WARNING ("unload_pa_module_source_id is %d",removed);
@@ -576,7 +825,15 @@ handle_cancel (NdDbusSink *self)
   // 暂时移除25s超时处理。原因：handle_cancel会在断开连接后多次触发，导致最后一次的超时处理任务没有被正常取消，导致投屏断开。
   // 后续考虑缩短时间或者修改相关流程
 //  self->unload_pa_module_source_id = g_timeout_add_seconds (quit_timeout, sink_real_cancel_wrapper, self);
-  nd_pulseaudio_unload_module (self->pulse, nd_pulseaudio_unload_module_cb, self);
+  // 其他设备仍在使用共享的音频模块时不能卸载
+  if (!self->pulse || has_other_streaming_sinks (self))
+    {
+      sink_real_cancel (self);
+      return;
+    }
+  // 卸载pa模块和其余退出操作并行进行,不再等待卸载完成
+  nd_pulseaudio_unload_module (self->pulse, nd_pulseaudio_unload_module_cb, g_object_ref (self->pulse));
+  sink_real_cancel (self);
 }
 
 static GstElement *
@@ -586,6 +843,7 @@ sink_create_video_source_cb (NdDbusSink *self, NdSink *sink)
   GstElement *res = NULL;
   GstElement *dst = NULL;
   GstElement *src = NULL;
+  GstElement *governor = NULL;
 
   bin = GST_BIN (gst_bin_new ("screencast source bin"));
   D_ND_DEBUG ("use x11: %d", self->x11);
@@ -599,9 +857,10 @@ sink_create_video_source_cb (NdDbusSink *self, NdSink *sink)
       guint16 height = 0;
       guint end_x = 0;
       guint end_y = 0;
-      if (self->display_proxy)
+      GDBusProxy *display_proxy = nd_dbus_manager_get_display_proxy ();
+      if (display_proxy)
         {
-          g_autoptr (GVariant) property_value = g_dbus_proxy_get_cached_property (self->display_proxy, "Monitors");
+          g_autoptr (GVariant) property_value = g_dbus_proxy_get_cached_property (display_proxy, "Monitors");
           if (property_value)
             {
               g_autoptr (GVariantIter) monitor_iter = NULL;
@@ -614,7 +873,7 @@ sink_create_video_source_cb (NdDbusSink *self, NdSink *sink)
 
           if (screen_count >= 2)
             {
-              property_value = g_dbus_proxy_get_cached_property (self->display_proxy, "PrimaryRect");
+              property_value = g_dbus_proxy_get_cached_property (display_proxy, "PrimaryRect");
               if (property_value)
                 {
                   g_variant_get (property_value, "(nnqq)", &start_x, &start_y, &width, &height);
@@ -642,6 +901,10 @@ sink_create_video_source_cb (NdDbusSink *self, NdSink *sink)
 
   gst_bin_add (bin, src);
 
+  // 在采集端限制帧率，避免采集后又被丢弃的帧（高刷屏上尤其明显）。pipewire 只支持设置最大帧率，ximagesrc 按固定帧率采集。
+  governor = wfd_source_governor_new (!self->x11);
+  gst_bin_add (bin, governor);
+
   dst = gst_element_factory_make ("intervideosink", "inter video sink");
   if (!dst)
     D_ND_WARNING ("Error creating intervideosink, missing dependency!");
@@ -652,7 +915,7 @@ sink_create_video_source_cb (NdDbusSink *self, NdSink *sink)
                 NULL);
   gst_bin_add (bin, dst);
 
-  gst_element_link_many (src, dst, NULL);
+  gst_element_link_many (src, governor, dst, NULL);
 
   res = gst_element_factory_make ("intervideosrc", "screencastsrc");
   g_object_set (res,
@@ -690,6 +953,10 @@ sink_notify_state_cb (NdDbusSink *self, GParamSpec *pspec, NdSink *sink)
   gchar *msg = NULL;
   g_object_get (sink, "state", &state, NULL);
   D_ND_INFO ("Got state change notification from streaming sink to state %s", g_enum_to_string (ND_TYPE_SINK_STATE, state));
+  if (self->bringup_start_time)
+    D_ND_INFO ("Bring-up reached state %s after %" G_GINT64_FORMAT " ms",
+               g_enum_to_string (ND_TYPE_SINK_STATE, state),
+               bringup_elapsed_ms (self));
   set_prop_status (self, state);
   switch (state)
     {
@@ -710,6 +977,7 @@ sink_notify_state_cb (NdDbusSink *self, GParamSpec *pspec, NdSink *sink)
     case ND_SINK_STATE_WAIT_STREAMING:
       break;
     case ND_SINK_STATE_STREAMING:
+      self->bringup_start_time = 0;
       msg = g_strdup_printf (_("Successfully cast the screen to %s"), self->name);
       send_notify (self, msg);
       break;
@@ -761,6 +1029,15 @@ nd_sink_dbus_stop_export (NdDbusSink *self)
   D_ND_INFO ("stop export nd sink:%s", self->hw_address);
   if (self->registration_id > 0)
     g_dbus_connection_unregister_object (self->bus, self->registration_id);
+  self->registration_id = 0;
+
+  // 对象已经不在总线上,丢弃还未发送的属性改变
+  if (self->flush_props_source_id)
+    {
+      g_source_remove (self->flush_props_source_id);
+      self->flush_props_source_id = 0;
+    }
+  g_hash_table_remove_all (self->pending_props);
 }
 
 static void
@@ -780,20 +1057,35 @@ handle_sink_method_call (GDBusConnection *connection,
   NdDbusSink *self = user_data;
   if (g_strcmp0 (method_name, "Connect") == 0)
     {
-      if (stream_sink || self->is_portal_init_running)
+      NdDbusSink *capturing;
+
+      if (self->stream_sink || self->is_portal_init_running)
         {
           g_dbus_method_invocation_return_error (invocation,
                                                  G_DBUS_ERROR,
                                                  G_DBUS_ERROR_LIMITS_EXCEEDED,
-                                                 "Don't allow connect multiple sink");
+                                                 "Sink is already connected");
           return;
         }
-      self->is_portal_init_running = TRUE;
-      init_portal_async (self);
+      capturing = find_capturing_sink (self);
+      streaming_sinks = g_list_prepend (streaming_sinks, self);
+      if (capturing)
+        {
+          // 已经有设备在投屏,共享同一路采集和编码,不需要再次选择屏幕
+          D_ND_INFO ("Sharing the running screencast with another sink");
+          g_set_object (&self->portal, capturing->portal);
+          g_set_object (&self->pulse, capturing->pulse);
+          self->x11 = capturing->x11;
+          nd_sink_start_stream_real (self);
+        }
+      else
+        {
+          start_bringup (self);
+        }
     }
   else if (g_strcmp0 (method_name, "Cancel") == 0)
     {
-      if (!stream_sink && !self->is_portal_init_running)
+      if (!self->stream_sink && !self->is_portal_init_running)
         {
           g_dbus_method_invocation_return_error (invocation,
                                                  G_DBUS_ERROR,
@@ -849,6 +1141,7 @@ handle_sink_get_property (GDBusConnection *connection,
 static void
 set_prop_name (NdDbusSink *self, const gchar *name)
 {
+  g_free (self->name);
   self->name = g_strdup (name);
   emit_nd_manager_value_changed (self, "Name", g_variant_new_string (self->name));
 }
@@ -860,17 +1153,62 @@ set_prop_status (NdDbusSink *self, gint32 status)
   emit_nd_manager_value_changed (self, "Status", g_variant_new_int32 (status));
 }
 
+static gboolean
+flush_props_cb (gpointer user_data)
+{
+  NdDbusSink *self = user_data;
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  const gchar *property_name;
+  GVariant *property_value;
+
+  self->flush_props_source_id = 0;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_hash_table_iter_init (&iter, self->pending_props);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &property_name, (gpointer *) &property_value))
+    {
+      D_ND_INFO ("emit property changed:%s", property_name);
+      g_variant_builder_add (&builder, "{sv}", property_name, property_value);
+    }
+  g_hash_table_remove_all (self->pending_props);
+
+  emit_object_dbus_properties_changed (self->bus,
+                                       self->dbus_path,
+                                       DEEPIN_ND_SINK_DBUS_INTERFACE,
+                                       g_variant_builder_end (&builder));
+
+  return G_SOURCE_REMOVE;
+}
+
+// Name 和 Strength 的改变不会立即发送,而是在合并窗口结束时一起发送;
+// Status 的每次改变都要让客户端看到(例如 ERROR 之后的 DISCONNECTED),立即和待发送的改变一起发送
 static void
-emit_nd_manager_value_changed (const NdDbusSink *self,
+emit_nd_manager_value_changed (NdDbusSink *self,
                                const gchar *property_name,
                                GVariant *property_value)
 {
-  if (self->bus)
-    emit_object_dbus_value_changed (self->bus,
-                                    self->dbus_path,
-                                    DEEPIN_ND_SINK_DBUS_INTERFACE,
-                                    property_name,
-                                    property_value);
+  g_variant_ref_sink (property_value);
+  if (!self->bus || !self->dbus_path || self->registration_id == 0)
+    {
+      g_variant_unref (property_value);
+      return;
+    }
+
+  g_hash_table_replace (self->pending_props, g_strdup (property_name), property_value);
+  if (g_str_equal (property_name, "Status"))
+    {
+      if (self->flush_props_source_id)
+        {
+          g_source_remove (self->flush_props_source_id);
+          self->flush_props_source_id = 0;
+        }
+      flush_props_cb (self);
+      return;
+    }
+
+  if (!self->flush_props_source_id)
+    self->flush_props_source_id = g_timeout_add (PROPERTIES_CHANGED_WINDOW_MS, flush_props_cb, self);
 }
 
 static void
@@ -892,6 +1230,12 @@ notify_callback (GObject *source_object,
 static void
 send_notify (NdDbusSink *self, const gchar *body)
 {
+  GDBusProxy *notify_proxy = nd_dbus_manager_get_notify_proxy ();
+  if (!notify_proxy)
+    {
+      D_ND_WARNING ("Notifications is not available, drop notify: %s", body);
+      return;
+    }
   GVariant *notification_params = g_variant_new ("(susssasa{sv}i)",
                                                  _("Screen Casting"),
                                                  0,
@@ -901,7 +1245,7 @@ send_notify (NdDbusSink *self, const gchar *body)
                                                  NULL,
                                                  NULL,
                                                  5000);
-  g_dbus_proxy_call (self->notify_proxy,
+  g_dbus_proxy_call (notify_proxy,
                      "Notify",
                      notification_params,
                      G_DBUS_CALL_FLAGS_NONE,
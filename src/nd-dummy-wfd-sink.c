@@ -32,7 +32,7 @@ struct _NdDummyWFDSink
   GStrv       missing_audio_codec;
 
   WfdServer  *server;
-  guint       server_source_id;
+  WfdClient  *client;
 };
 
 enum {
@@ -179,27 +179,59 @@ closed_cb (NdDummyWFDSink *sink, WfdClient *client)
   nd_dummy_wfd_sink_sink_stop_stream (ND_SINK (sink));
 }
 
+/* The dummy sink is for local testing. The server is shared with the
+ * real sinks, so only take clients that connected from this machine. */
+static gboolean
+client_is_local (WfdClient *client)
+{
+  g_autoptr(GInetAddress) address = NULL;
+  GstRTSPConnection *connection;
+
+  connection = gst_rtsp_client_get_connection (GST_RTSP_CLIENT (client));
+  if (!connection)
+    return FALSE;
+
+  address = g_inet_address_new_from_string (gst_rtsp_connection_get_ip (connection));
+
+  return address && g_inet_address_get_is_loopback (address);
+}
+
 static void
 client_connected_cb (NdDummyWFDSink *sink, WfdClient *client, WfdServer *server)
 {
+  if (g_object_get_data (G_OBJECT (client), "nd-sink"))
+    return;
+
+  if (!client_is_local (client))
+    return;
+
   g_debug ("NdWfdP2PSink: Got client connection");
 
-  g_signal_handlers_disconnect_by_func (sink->server, client_connected_cb, sink);
+  g_signal_handlers_disconnect_matched (sink->server,
+                                        G_SIGNAL_MATCH_ID | G_SIGNAL_MATCH_DATA,
+                                        g_signal_lookup ("client-connected", GST_TYPE_RTSP_SERVER),
+                                        0, NULL, NULL, sink);
+  g_object_set_data (G_OBJECT (client), "nd-sink", sink);
+  sink->client = g_object_ref (client);
+  wfd_server_assign_setup (client, sink);
   sink->state = ND_SINK_STATE_WAIT_STREAMING;
   g_object_notify (G_OBJECT (sink), "state");
 
   /* XXX: connect to further events. */
-  g_signal_connect_object (client,
-                           "play-request",
-                           (GCallback) play_request_cb,
-                           sink,
-                           G_CONNECT_SWAPPED);
-
-  g_signal_connect_object (client,
-                           "closed",
-                           (GCallback) closed_cb,
-                           sink,
-                           G_CONNECT_SWAPPED);
+  wfd_signal_connect_main_context (client,
+                                   "play-request",
+                                   (GCallback) play_request_cb,
+                                   sink);
+
+  wfd_signal_connect_main_context (client,
+                                   "closed",
+                                   (GCallback) closed_cb,
+                                   sink);
+
+  /* The client lives on the server thread and might have gone away
+   * before we got to see it. */
+  if (wfd_client_is_closed (client))
+    closed_cb (sink, client);
 }
 
 static GstElement *
@@ -247,19 +279,17 @@ nd_dummy_wfd_sink_sink_start_stream (NdSink *sink)
   if (!have_basic_codecs)
     goto error;
 
-  self->server = wfd_server_new ();
-  self->server_source_id = gst_rtsp_server_attach (GST_RTSP_SERVER (self->server), NULL);
+  self->server = wfd_server_acquire_shared ();
 
-  if (self->server_source_id == 0)
+  if (self->server == NULL)
     goto error;
 
   g_debug ("NdDummyWFDSink: You should now be able to connect to rtsp://localhost:7236/wfd1.0");
 
-  g_signal_connect_object (self->server,
-                           "client-connected",
-                           (GCallback) client_connected_cb,
-                           self,
-                           G_CONNECT_SWAPPED);
+  wfd_signal_connect_main_context (self->server,
+                                   "client-connected",
+                                   (GCallback) client_connected_cb,
+                                   self);
 
   g_signal_connect_object (self->server,
                            "create-source",
@@ -282,7 +312,6 @@ error:
   g_warning ("Error starting stream!");
   self->state = ND_SINK_STATE_ERROR;
   g_object_notify (G_OBJECT (self), "state");
-  g_clear_object (&self->server);
 
   return g_object_ref (sink);
 }
@@ -292,12 +321,6 @@ nd_dummy_wfd_sink_sink_stop_stream (NdSink *sink)
 {
   NdDummyWFDSink *self = ND_DUMMY_WFD_SINK (sink);
 
-  if (self->server_source_id)
-    {
-      g_source_remove (self->server_source_id);
-      self->server_source_id = 0;
-    }
-
   /* Needs to protect against recursion. */
   if (self->server)
     {
@@ -305,7 +328,17 @@ nd_dummy_wfd_sink_sink_stop_stream (NdSink *sink)
 
       server = g_steal_pointer (&self->server);
       g_signal_handlers_disconnect_by_data (server, self);
-      wfd_server_purge (server);
+
+      if (self->client)
+        {
+          g_autoptr(WfdClient) client = NULL;
+
+          client = g_steal_pointer (&self->client);
+          g_signal_handlers_disconnect_by_data (client, self);
+          gst_rtsp_client_close (GST_RTSP_CLIENT (client));
+        }
+
+      wfd_server_release_shared (server);
     }
 
   self->state = ND_SINK_STATE_DISCONNECTED;
@@ -28,6 +28,11 @@ struct _NdMetaProvider
 
   GPtrArray *sinks;  // meta_sink
   GPtrArray *providers;
+
+  // 索引,用于快速查找: match字段 -> meta_sink, 子sink -> meta_sink, meta_sink -> 已索引的match字段
+  GHashTable *match_index;
+  GHashTable *sink_index;
+  GHashTable *indexed_matches;
 };
 
 enum {
@@ -48,6 +53,77 @@ G_DEFINE_TYPE_EXTENDED (NdMetaProvider, nd_meta_provider, G_TYPE_OBJECT, 0,
                        )
 
 
+// 从索引中移除meta_sink的所有match字段
+static void
+unindex_meta_sink (NdMetaProvider *meta_provider, NdMetaSink *meta_sink)
+{
+  GPtrArray *matches;
+
+  matches = g_hash_table_lookup (meta_provider->indexed_matches, meta_sink);
+  if (!matches)
+    return;
+
+  for (gint i = 0; i < matches->len; i++)
+    {
+      const gchar *match = g_ptr_array_index (matches, i);
+
+      // 其他meta_sink可能已经占用了该字段
+      if (g_hash_table_lookup (meta_provider->match_index, match) == meta_sink)
+        g_hash_table_remove (meta_provider->match_index, match);
+    }
+
+  g_hash_table_remove (meta_provider->indexed_matches, meta_sink);
+}
+
+// meta_sink的match字段随子sink变化,每次变化后重新建立索引
+static void
+index_meta_sink (NdMetaProvider *meta_provider, NdMetaSink *meta_sink)
+{
+  g_autoptr(GPtrArray) matches = NULL;
+
+  unindex_meta_sink (meta_provider, meta_sink);
+
+  g_object_get (meta_sink, "matches", &matches, NULL);
+  if (!matches)
+    return;
+
+  for (gint i = 0; i < matches->len; i++)
+    g_hash_table_insert (meta_provider->match_index,
+                         g_strdup (g_ptr_array_index (matches, i)),
+                         meta_sink);
+
+  g_hash_table_insert (meta_provider->indexed_matches, meta_sink, g_steal_pointer (&matches));
+}
+
+static void
+meta_sink_notify_matches_cb (NdMetaProvider *meta_provider, GParamSpec *pspec, NdMetaSink *meta_sink)
+{
+  index_meta_sink (meta_provider, meta_sink);
+}
+
+static void
+add_meta_sink (NdMetaProvider *meta_provider, NdMetaSink *meta_sink)
+{
+  g_ptr_array_add (meta_provider->sinks, meta_sink);
+  index_meta_sink (meta_provider, meta_sink);
+
+  g_signal_connect_object (meta_sink,
+                           "notify::matches",
+                           (GCallback) meta_sink_notify_matches_cb,
+                           meta_provider,
+                           G_CONNECT_SWAPPED);
+}
+
+// 返回FALSE表示meta_sink不在列表中
+static gboolean
+remove_meta_sink (NdMetaProvider *meta_provider, NdMetaSink *meta_sink)
+{
+  g_signal_handlers_disconnect_by_func (meta_sink, meta_sink_notify_matches_cb, meta_provider);
+  unindex_meta_sink (meta_provider, meta_sink);
+
+  return g_ptr_array_remove (meta_provider->sinks, meta_sink);
+}
+
 static void
 provider_sink_added_cb (NdMetaProvider *meta_provider, NdSink *sink, NdProvider *provider)
 {
@@ -59,10 +135,15 @@ provider_sink_added_cb (NdMetaProvider *meta_provider, NdSink *sink, NdProvider
   g_assert (sink_matches != NULL);
 
   meta_sinks = g_ptr_array_new ();
-  // sink 为 p2p-sink
-  for (gint i = 0; i < meta_provider->sinks->len; i++)
-    if (nd_meta_sink_matches_sink (g_ptr_array_index (meta_provider->sinks, i), sink)) // 通过matches字段(实际是数组)的内容判断是否为同一个设备
-      g_ptr_array_add (meta_sinks, g_ptr_array_index (meta_provider->sinks, i));
+  // sink 为 p2p-sink, 通过matches字段(实际是数组)的内容在索引中查找是否为同一个设备
+  for (gint i = 0; i < sink_matches->len; i++)
+    {
+      NdMetaSink *match = g_hash_table_lookup (meta_provider->match_index,
+                                               g_ptr_array_index (sink_matches, i));
+
+      if (match && !g_ptr_array_find (meta_sinks, match, NULL))
+        g_ptr_array_add (meta_sinks, match);
+    }
 
   if (meta_sinks->len > 1)
     g_warning ("MetaProvider: Found two meta sinks that belong to the same sink. This should not happen!\n");
@@ -76,8 +157,8 @@ provider_sink_added_cb (NdMetaProvider *meta_provider, NdSink *sink, NdProvider
         {
           NdMetaSink *merge_meta;
           NdSink *merge_sink;
-          merge_meta = g_ptr_array_remove_index_fast (meta_sinks, 0);
-          if (!g_ptr_array_remove (meta_provider->sinks, merge_meta))
+          merge_meta = g_object_ref (g_ptr_array_remove_index_fast (meta_sinks, 0));
+          if (!remove_meta_sink (meta_provider, merge_meta))
             g_warning ("Could not remove sink from internal list!");
           g_signal_emit_by_name (meta_provider, "sink-removed", merge_meta);
 
@@ -85,7 +166,9 @@ provider_sink_added_cb (NdMetaProvider *meta_provider, NdSink *sink, NdProvider
             {
               nd_meta_sink_remove_sink (merge_meta, merge_sink);
               nd_meta_sink_add_sink (meta_sink, merge_sink);
+              g_hash_table_insert (meta_provider->sink_index, merge_sink, meta_sink);
             }
+          g_object_unref (merge_meta);
         }
 
       // 重复sink无需再次添加
@@ -95,7 +178,8 @@ provider_sink_added_cb (NdMetaProvider *meta_provider, NdSink *sink, NdProvider
     {
       g_info("matched sink num == 0");
       meta_sink = nd_meta_sink_new (sink);
-      g_ptr_array_add (meta_provider->sinks, meta_sink);
+      add_meta_sink (meta_provider, meta_sink);
+      g_hash_table_insert (meta_provider->sink_index, sink, meta_sink);
       g_signal_emit_by_name (meta_provider, "sink-added", meta_sink);
     }
 }
@@ -112,28 +196,26 @@ provider_sink_removed_cb (NdMetaProvider *meta_provider, NdSink *sink, NdProvide
   g_autofree gchar *t_sink_name = NULL;
   g_object_get (sink, "display-name", &t_sink_name, NULL);
   g_debug ("sink name is %s", t_sink_name);
-  /* Search all known meta sinks for the matching one.
-   * Note that we really need to search for it rather than doing
-   * a faster lookup, as sink that is removed may not be reporting
-   * its matches correctly anymore. */
+  /* Look up the meta sink by the sink itself rather than by its matches,
+   * as sink that is removed may not be reporting its matches correctly
+   * anymore. */
   // 先找到对应的meta_sink
   g_debug ("meta_provider sinks num is %d", meta_provider->sinks->len);
-  for (gint i = 0; i < meta_provider->sinks->len; i++)
+  meta_sink = g_hash_table_lookup (meta_provider->sink_index, sink);
+  if (meta_sink)
     {
-      NdMetaSink *s = g_ptr_array_index (meta_provider->sinks, i);
-      gboolean has = nd_meta_sink_has_sink (s, sink);
-      g_debug ("meta_sink has sink %d", has);
-      gchar *hw_address = NULL;
-      g_object_get (nd_meta_sink_get_sink (s), "hw-address", &hw_address, NULL);
-      g_debug ("meta_sink current sink %s", hw_address);
+      g_object_ref (meta_sink);
+    }
+  else
+    {
+      g_assert (g_ptr_array_find_with_equal_func (meta_provider->sinks,
+                                                  sink,
+                                                  (GEqualFunc) nd_meta_sink_has_sink,
+                                                  &idx));
+      meta_sink = g_object_ref (g_ptr_array_index (meta_provider->sinks, idx));
     }
-  g_assert (g_ptr_array_find_with_equal_func (meta_provider->sinks,
-                                              sink,
-                                              (GEqualFunc) nd_meta_sink_has_sink,
-                                              &idx));
-
-  meta_sink = g_object_ref (g_ptr_array_index (meta_provider->sinks, idx));
   g_assert (meta_sink != NULL);
+  g_hash_table_remove (meta_provider->sink_index, sink);
 
   gchar *sink_name = NULL;
   g_object_get (meta_sink, "display-name", &sink_name, NULL);
@@ -145,7 +227,7 @@ provider_sink_removed_cb (NdMetaProvider *meta_provider, NdSink *sink, NdProvide
     {
       g_debug ("meta sink is empty, remove it and we are done ");
       /* meta sink is empty, remove it and we are done */
-      g_ptr_array_remove (meta_provider->sinks, meta_sink);
+      remove_meta_sink (meta_provider, meta_sink);
       g_signal_emit_by_name (meta_provider, "sink-removed", meta_sink);
 
       return;
@@ -206,6 +288,12 @@ nd_meta_provider_finalize (GObject *object)
 {
   NdMetaProvider *meta_provider = ND_META_PROVIDER (object);
 
+  g_clear_pointer (&meta_provider->match_index, g_hash_table_unref);
+  g_clear_pointer (&meta_provider->sink_index, g_hash_table_unref);
+  g_clear_pointer (&meta_provider->indexed_matches, g_hash_table_unref);
+
+  for (gint i = 0; i < meta_provider->sinks->len; i++)
+    g_signal_handlers_disconnect_by_data (g_ptr_array_index (meta_provider->sinks, i), meta_provider);
   g_ptr_array_free (meta_provider->sinks, TRUE);
   meta_provider->sinks = NULL;
   g_ptr_array_free (meta_provider->providers, TRUE);
@@ -244,6 +332,10 @@ nd_meta_provider_init (NdMetaProvider *meta_provider)
 
   meta_provider->sinks = g_ptr_array_new_with_free_func (g_object_unref);
   meta_provider->providers = g_ptr_array_new_with_free_func (g_object_unref);
+
+  meta_provider->match_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  meta_provider->sink_index = g_hash_table_new (NULL, NULL);
+  meta_provider->indexed_matches = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) g_ptr_array_unref);
 }
 
 /******************************************************************
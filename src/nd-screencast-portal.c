@@ -1,6 +1,7 @@
 #include "nd-screencast-portal.h"
 #include <gio/gunixfdlist.h>
 #include <gst/base/base.h>
+#include <unistd.h>
 
 #define SCREEN_CAST_IFACE "org.freedesktop.portal.ScreenCast"
 
@@ -10,14 +11,30 @@ struct _NdScreencastPortal
   GObject       parent_instance;
 
   gchar        *session_handle;
+  guint         session_closed_signal_id;
 
   gint          portal_signal_id;
   GDBusProxy   *screencast;
   guint32       stream_node_id;
 
+  /* A PipeWire remote opened ahead of time, so that creating the source
+   * does not need to wait for the portal. */
+  gint          pipewire_fd;
+  gboolean      opening_remote;
+
+  /* Lets the portal skip the selection dialog, see persist_mode. */
+  gchar        *restore_token;
+
   GCancellable *cancellable;
 };
 
+enum {
+  SIGNAL_CLOSED,
+  N_SIGNALS
+};
+
+static guint signals[N_SIGNALS];
+
 static void      nd_screencast_portal_async_initable_iface_init (GAsyncInitableIface *iface);
 static void      nd_screencast_portal_async_initable_init_async (GAsyncInitable     *initable,
                                                                  int                 io_priority,
@@ -28,7 +45,8 @@ static gboolean nd_screencast_portal_async_initable_init_finish (GAsyncInitable
                                                                  GAsyncResult   *res,
                                                                  GError        **error);
 
-static void nd_screencast_portal_close (NdScreencastPortal *self);
+static void nd_screencast_portal_open_remote (NdScreencastPortal *self,
+                                              GTask              *task);
 
 G_DEFINE_TYPE_EXTENDED (NdScreencastPortal, nd_screencast_portal, G_TYPE_OBJECT, 0,
                         G_IMPLEMENT_INTERFACE (G_TYPE_ASYNC_INITABLE,
@@ -105,6 +123,39 @@ init_check_dbus_error (GObject      *source_object,
     }
 }
 
+static void
+unsubscribe_session_closed (NdScreencastPortal *self)
+{
+  if (self->session_closed_signal_id)
+    {
+      g_dbus_connection_signal_unsubscribe (g_dbus_proxy_get_connection (self->screencast),
+                                            self->session_closed_signal_id);
+      self->session_closed_signal_id = 0;
+    }
+}
+
+/* The session was closed by the portal, e.g. because the user revoked
+ * the screen sharing or the compositor restarted. */
+static void
+portal_session_closed_received (GDBusConnection *connection,
+                                const char      *sender_name,
+                                const char      *object_path,
+                                const char      *interface_name,
+                                const char      *signal_name,
+                                GVariant        *parameters,
+                                gpointer         user_data)
+{
+  NdScreencastPortal *self = ND_SCREENCAST_PORTAL (user_data);
+
+  g_debug ("NdScreencastPortal: Session %s was closed", object_path);
+
+  unsubscribe_session_closed (self);
+  /* Nothing left to close */
+  g_clear_pointer (&self->session_handle, g_free);
+
+  g_signal_emit (self, signals[SIGNAL_CLOSED], 0);
+}
+
 static void
 portal_start_response_received (GDBusConnection *connection,
                                 const char      *sender_name,
@@ -157,11 +208,15 @@ portal_start_response_received (GDBusConnection *connection,
 
   g_variant_get_child (streams, 0, "(ua{sv})", &node_id, NULL);
 
+  /* Tokens are single use, the portal hands out a new one every time. */
+  g_clear_pointer (&self->restore_token, g_free);
+  g_variant_lookup (ret, "restore_token", "s", &self->restore_token);
+
   g_debug ("Got a stream with node ID: %d", node_id);
   self->stream_node_id = node_id;
 
-  g_task_return_boolean (task, TRUE);
-  g_object_unref (task);
+  /* Initialization finishes once the first remote is open. */
+  nd_screencast_portal_open_remote (self, task);
 }
 
 static void
@@ -272,6 +327,17 @@ portal_create_session_response_received (GDBusConnection *connection,
   g_variant_lookup (ret, "session_handle", "s", &self->session_handle);
   g_debug ("simple variant lookup: %s", self->session_handle);
 
+  self->session_closed_signal_id = g_dbus_connection_signal_subscribe (g_dbus_proxy_get_connection (self->screencast),
+                                                                       "org.freedesktop.portal.Desktop",
+                                                                       "org.freedesktop.portal.Session",
+                                                                       "Closed",
+                                                                       self->session_handle,
+                                                                       NULL,
+                                                                       G_DBUS_SIGNAL_FLAGS_NO_MATCH_RULE,
+                                                                       portal_session_closed_received,
+                                                                       self,
+                                                                       NULL);
+
   handle = get_portal_request_path (g_dbus_proxy_get_connection (self->screencast), &token);
   g_debug ("portal request path: %s", handle);
   self->portal_signal_id = g_dbus_connection_signal_subscribe (g_dbus_proxy_get_connection (self->screencast),
@@ -292,6 +358,10 @@ portal_create_session_response_received (GDBusConnection *connection,
   g_variant_builder_add (&builder, "{sv}", "handle_token", g_variant_new_string (token));
   g_variant_builder_add (&builder, "{sv}", "multiple", g_variant_new_boolean (FALSE));
   g_variant_builder_add (&builder, "{sv}", "types", g_variant_new_uint32 (0x1));
+  /* Persist the selection until it is revoked, older portals ignore this. */
+  g_variant_builder_add (&builder, "{sv}", "persist_mode", g_variant_new_uint32 (2));
+  if (self->restore_token)
+    g_variant_builder_add (&builder, "{sv}", "restore_token", g_variant_new_string (self->restore_token));
   g_variant_builder_close (&builder);
 
   g_dbus_proxy_call (self->screencast,
@@ -477,6 +547,13 @@ nd_screencast_portal_finalize (GObject *object)
   g_cancellable_cancel (self->cancellable);
   g_clear_object (&self->cancellable);
 
+  nd_screencast_portal_close (self);
+  g_clear_pointer (&self->restore_token, g_free);
+
+  if (self->pipewire_fd >= 0)
+    close (self->pipewire_fd);
+  self->pipewire_fd = -1;
+
   g_clear_pointer (&self->session_handle, g_free);
   if (self->portal_signal_id)
     {
@@ -496,51 +573,161 @@ nd_screencast_portal_class_init (NdScreencastPortalClass *klass)
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
   object_class->finalize = nd_screencast_portal_finalize;
+
+  /**
+   * NdScreencastPortal::closed:
+   *
+   * Emitted when the portal closed the session on its own. The portal
+   * cannot be used to create sources anymore.
+   */
+  signals[SIGNAL_CLOSED] =
+    g_signal_new ("closed",
+                  ND_TYPE_SCREENCAST_PORTAL,
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL,
+                  NULL,
+                  NULL,
+                  G_TYPE_NONE,
+                  0);
 }
 
 static void
 nd_screencast_portal_init (NdScreencastPortal *self)
 {
+  self->pipewire_fd = -1;
 }
 
-GstElement *
-nd_screencast_portal_get_source (NdScreencastPortal *self)
+static void
+open_remote_done (GObject      *source_object,
+                  GAsyncResult *res,
+                  gpointer      user_data)
 {
-  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("(oa{sv})"));
-  g_autoptr(GVariant) res = NULL;
-  GUnixFDList *out_fd_list = NULL;
+  GTask *task = G_TASK (user_data);
+  NdScreencastPortal *self = g_task_get_source_object (task);
 
+  g_autoptr(GVariant) result = NULL;
+  g_autoptr(GUnixFDList) out_fd_list = NULL;
   g_autoptr(GError) error = NULL;
-  g_autoptr(GstElement) src = NULL;
   g_autofree gint *fds = NULL;
+
+  self->opening_remote = FALSE;
+
+  result = g_dbus_proxy_call_with_unix_fd_list_finish (G_DBUS_PROXY (source_object),
+                                                       &out_fd_list,
+                                                       res,
+                                                       &error);
+  if (result && (!out_fd_list || g_unix_fd_list_get_length (out_fd_list) != 1))
+    error = g_error_new (G_IO_ERROR, G_IO_ERROR_INVAL, "Expected exactly one file descriptor");
+
+  if (error)
+    {
+      /* A cancelled initialization has been returned already. */
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_warning ("Error opening pipewire remote: %s", error->message);
+          g_task_return_error (task, g_steal_pointer (&error));
+        }
+      g_object_unref (task);
+      return;
+    }
+
+  fds = g_unix_fd_list_steal_fds (out_fd_list, NULL);
+  if (self->pipewire_fd >= 0)
+    close (self->pipewire_fd);
+  self->pipewire_fd = fds[0];
+
+  g_debug ("NdScreencastPortal: PipeWire remote is ready");
+
+  g_task_return_boolean (task, TRUE);
+  g_object_unref (task);
+}
+
+/* Open a PipeWire remote for the next source. When @task is %NULL, this
+ * refills the remote in the background after one was handed out. */
+static void
+nd_screencast_portal_open_remote (NdScreencastPortal *self,
+                                  GTask              *task)
+{
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("(oa{sv})"));
+
+  if (task == NULL)
+    {
+      if (self->opening_remote || self->pipewire_fd >= 0)
+        return;
+      task = g_task_new (self, NULL, NULL, NULL);
+    }
+
+  self->opening_remote = TRUE;
+
+  g_variant_builder_add_value (&builder, g_variant_new_object_path (self->session_handle));
+  g_variant_builder_open (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_close (&builder);
+
+  g_dbus_proxy_call_with_unix_fd_list (self->screencast,
+                                       "OpenPipeWireRemote",
+                                       g_variant_builder_end (&builder),
+                                       G_DBUS_CALL_FLAGS_NONE,
+                                       1000,
+                                       NULL,
+                                       self->cancellable,
+                                       open_remote_done,
+                                       task);
+}
+
+GstElement *
+nd_screencast_portal_get_source (NdScreencastPortal *self)
+{
+  g_autoptr(GstElement) src = NULL;
   g_autofree gchar *path = NULL;
+  gint fd;
 
   g_assert (self->screencast);
   g_assert (self->session_handle);
   g_assert (self->stream_node_id != 0);
 
-  g_variant_builder_add_value (&builder, g_variant_new_object_path (self->session_handle));
-  g_variant_builder_open (&builder, G_VARIANT_TYPE_VARDICT);
-  g_variant_builder_close (&builder);
+  fd = self->pipewire_fd;
+  self->pipewire_fd = -1;
 
-  /* The sync call here is not nice, but not a big deal either */
-  res = g_dbus_proxy_call_with_unix_fd_list_sync (self->screencast,
-                                                  "OpenPipeWireRemote",
-                                                  g_variant_builder_end (&builder),
-                                                  G_DBUS_CALL_FLAGS_NONE,
-                                                  500,
-                                                  NULL,
-                                                  &out_fd_list,
-                                                  NULL,
-                                                  &error);
-
-  if (!res || !out_fd_list || g_unix_fd_list_get_length (out_fd_list) != 1)
+  if (fd < 0)
     {
-      g_warning ("Error opening pipewire remote: %s", error->message);
-      return NULL;
+      g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("(oa{sv})"));
+      g_autoptr(GVariant) res = NULL;
+      g_autoptr(GUnixFDList) out_fd_list = NULL;
+      g_autoptr(GError) error = NULL;
+      g_autofree gint *fds = NULL;
+
+      /* Only happens if the source is recreated before the remote was
+       * refilled in the background. */
+      g_warning ("NdScreencastPortal: No PipeWire remote ready, opening one synchronously");
+
+      g_variant_builder_add_value (&builder, g_variant_new_object_path (self->session_handle));
+      g_variant_builder_open (&builder, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_close (&builder);
+
+      res = g_dbus_proxy_call_with_unix_fd_list_sync (self->screencast,
+                                                      "OpenPipeWireRemote",
+                                                      g_variant_builder_end (&builder),
+                                                      G_DBUS_CALL_FLAGS_NONE,
+                                                      500,
+                                                      NULL,
+                                                      &out_fd_list,
+                                                      NULL,
+                                                      &error);
+
+      if (!res || !out_fd_list || g_unix_fd_list_get_length (out_fd_list) != 1)
+        {
+          g_warning ("Error opening pipewire remote: %s", error ? error->message : "unexpected reply");
+          return NULL;
+        }
+
+      fds = g_unix_fd_list_steal_fds (out_fd_list, NULL);
+      fd = fds[0];
     }
 
-  fds = g_unix_fd_list_steal_fds (out_fd_list, NULL);
+  /* PipeWire takes ownership of the remote, prepare the next one. */
+  nd_screencast_portal_open_remote (self, NULL);
+
   path = g_strdup_printf ("%u", self->stream_node_id);
 
   src = gst_element_factory_make ("pipewiresrc", "portal-pipewire-source");
@@ -549,39 +736,76 @@ nd_screencast_portal_get_source (NdScreencastPortal *self)
 
   gst_base_src_set_live (GST_BASE_SRC (src), TRUE);
   g_object_set (src,
-                "fd", fds[0],
+                "fd", fd,
                 "path", path,
                 "do-timestamp", TRUE,
                 NULL);
 
-  g_object_unref (out_fd_list);
-
   return g_steal_pointer (&src);
 }
 
-static void
+/**
+ * nd_screencast_portal_set_restore_token
+ * @self: a #NdScreencastPortal
+ * @token: (nullable): a token from a previous session
+ *
+ * Must be called before initialization. If the portal accepts the token,
+ * the previous selection is restored without asking the user.
+ */
+void
+nd_screencast_portal_set_restore_token (NdScreencastPortal *self,
+                                        const gchar        *token)
+{
+  g_free (self->restore_token);
+  self->restore_token = g_strdup (token);
+}
+
+/**
+ * nd_screencast_portal_get_restore_token
+ * @self: a #NdScreencastPortal
+ *
+ * Returns: (nullable): the token to restore this session's selection later
+ */
+const gchar *
+nd_screencast_portal_get_restore_token (NdScreencastPortal *self)
+{
+  return self->restore_token;
+}
+
+/**
+ * nd_screencast_portal_is_open
+ * @self: a #NdScreencastPortal
+ *
+ * Returns: %TRUE until the session is closed by either side
+ */
+gboolean
+nd_screencast_portal_is_open (NdScreencastPortal *self)
+{
+  return self->session_handle != NULL;
+}
+
+void
 nd_screencast_portal_close (NdScreencastPortal *self)
 {
-  if (self->session_handle)
+  if (self->session_handle && self->screencast)
     {
+      unsubscribe_session_closed (self);
+
       g_debug ("session_handle is %s", self->session_handle);
-      GDBusProxy *screencast_session = NULL;
-      screencast_session = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-                                                          G_DBUS_PROXY_FLAGS_NONE,
-                                                          NULL,
-                                                          "org.freedesktop.portal.Desktop",
-                                                          self->session_handle,
-                                                          "org.freedesktop.portal.Session",
-                                                          NULL,
-                                                          NULL);
-      g_dbus_proxy_call_sync (G_DBUS_PROXY (screencast_session),
+
+      /* Fire and forget, nothing is waiting for the session to go away. */
+      g_dbus_connection_call (g_dbus_proxy_get_connection (self->screencast),
+                              "org.freedesktop.portal.Desktop",
+                              self->session_handle,
+                              "org.freedesktop.portal.Session",
                               "Close",
                               g_variant_new ("()"),
+                              NULL,
                               G_DBUS_CALL_FLAGS_NONE,
                               -1,
                               NULL,
+                              NULL,
                               NULL);
-
-      g_object_unref (screencast_session);
+      g_clear_pointer (&self->session_handle, g_free);
     }
-}
\ No newline at end of file
+}
@@ -13,5 +13,11 @@ G_DECLARE_FINAL_TYPE (NdScreencastPortal, nd_screencast_portal, ND, SCREENCAST_P
 NdScreencastPortal * nd_screencast_portal_new (void);
 
 GstElement *nd_screencast_portal_get_source (NdScreencastPortal *self);
+void nd_screencast_portal_close (NdScreencastPortal *self);
+gboolean nd_screencast_portal_is_open (NdScreencastPortal *self);
+
+void nd_screencast_portal_set_restore_token (NdScreencastPortal *self,
+                                             const gchar        *token);
+const gchar *nd_screencast_portal_get_restore_token (NdScreencastPortal *self);
 
 G_END_DECLS
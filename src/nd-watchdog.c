@@ -0,0 +1,136 @@
+// SPDX-FileCopyrightText: 2023 - 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+#include "nd-watchdog.h"
+
+/* Anything blocking the main loop for longer than this is logged. */
+#define DEFAULT_THRESHOLD_MS 200
+
+struct _NdWatchdog
+{
+  GMainContext *context;
+  GSource *heartbeat;
+  GThread *thread;
+
+  GMutex lock;
+  GCond cond;
+  gboolean stop;
+  gboolean reported;
+
+  gint64 threshold;
+  gint64 interval;
+  gint64 last_beat;
+};
+
+/* Runs on the watched context. A late heartbeat means that a dispatch in
+ * between took that much longer. */
+static gboolean
+heartbeat_cb (gpointer user_data)
+{
+  NdWatchdog *self = user_data;
+  gint64 now = g_get_monotonic_time ();
+  gint64 blocked;
+
+  g_mutex_lock (&self->lock);
+  blocked = now - self->last_beat - self->interval;
+  if (blocked > self->threshold)
+    g_warning ("NdWatchdog: Main loop was blocked for %" G_GINT64_FORMAT " ms",
+               blocked / G_TIME_SPAN_MILLISECOND);
+  self->last_beat = now;
+  self->reported = FALSE;
+  g_mutex_unlock (&self->lock);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Reports a main loop that is stuck right now, the heartbeat can only
+ * tell once it got to run again. */
+static gpointer
+watchdog_thread (gpointer user_data)
+{
+  NdWatchdog *self = user_data;
+
+  g_mutex_lock (&self->lock);
+  while (!self->stop)
+    {
+      gint64 now;
+
+      g_cond_wait_until (&self->cond, &self->lock, g_get_monotonic_time () + self->threshold);
+      if (self->stop)
+        break;
+
+      now = g_get_monotonic_time ();
+      if (!self->reported && now - self->last_beat > self->interval + self->threshold)
+        {
+          g_warning ("NdWatchdog: Main loop has been blocked for %" G_GINT64_FORMAT " ms so far",
+                     (now - self->last_beat - self->interval) / G_TIME_SPAN_MILLISECOND);
+          self->reported = TRUE;
+        }
+    }
+  g_mutex_unlock (&self->lock);
+
+  return NULL;
+}
+
+/**
+ * nd_watchdog_new
+ * @context: (nullable): the #GMainContext to watch, %NULL for the default one
+ *
+ * Start logging dispatches on @context that take longer than 200 ms, or the
+ * value of NETWORK_DISPLAYS_WATCHDOG_MS. Setting it to 0 disables the
+ * watchdog and %NULL is returned.
+ */
+NdWatchdog *
+nd_watchdog_new (GMainContext *context)
+{
+  NdWatchdog *self;
+  const gchar *env;
+  gint64 threshold_ms = DEFAULT_THRESHOLD_MS;
+
+  env = g_getenv ("NETWORK_DISPLAYS_WATCHDOG_MS");
+  if (env)
+    threshold_ms = g_ascii_strtoll (env, NULL, 10);
+  if (threshold_ms <= 0)
+    return NULL;
+
+  self = g_new0 (NdWatchdog, 1);
+  self->context = context ? g_main_context_ref (context) : g_main_context_ref (g_main_context_default ());
+  self->threshold = threshold_ms * G_TIME_SPAN_MILLISECOND;
+  self->interval = MAX (threshold_ms / 2, 10) * G_TIME_SPAN_MILLISECOND;
+  self->last_beat = g_get_monotonic_time ();
+  g_mutex_init (&self->lock);
+  g_cond_init (&self->cond);
+
+  self->heartbeat = g_timeout_source_new (self->interval / G_TIME_SPAN_MILLISECOND);
+  g_source_set_priority (self->heartbeat, G_PRIORITY_HIGH);
+  g_source_set_callback (self->heartbeat, heartbeat_cb, self, NULL);
+  g_source_attach (self->heartbeat, self->context);
+
+  self->thread = g_thread_new ("nd-watchdog", watchdog_thread, self);
+
+  g_debug ("NdWatchdog: Watching main loop with a threshold of %" G_GINT64_FORMAT " ms", threshold_ms);
+
+  return self;
+}
+
+void
+nd_watchdog_free (NdWatchdog *self)
+{
+  if (!self)
+    return;
+
+  g_mutex_lock (&self->lock);
+  self->stop = TRUE;
+  g_cond_signal (&self->cond);
+  g_mutex_unlock (&self->lock);
+  g_thread_join (self->thread);
+
+  g_source_destroy (self->heartbeat);
+  g_source_unref (self->heartbeat);
+  g_main_context_unref (self->context);
+
+  g_mutex_clear (&self->lock);
+  g_cond_clear (&self->cond);
+  g_free (self);
+}
@@ -0,0 +1,18 @@
+// SPDX-FileCopyrightText: 2023 - 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _NdWatchdog NdWatchdog;
+
+NdWatchdog *nd_watchdog_new (GMainContext *context);
+void nd_watchdog_free (NdWatchdog *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (NdWatchdog, nd_watchdog_free)
+
+G_END_DECLS
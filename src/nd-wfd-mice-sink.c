@@ -41,7 +41,7 @@ struct _NdWFDMiceSink
   GSocketConnection *signalling_client_conn;
 
   WfdServer         *server;
-  guint              server_source_id;
+  WfdClient         *client;
 };
 
 enum {
@@ -350,24 +350,44 @@ closed_cb (NdWFDMiceSink *sink, WfdClient *client)
 static void
 client_connected_cb (NdWFDMiceSink *sink, WfdClient *client, WfdServer *server)
 {
+  GstRTSPConnection *connection;
+
+  if (g_object_get_data (G_OBJECT (client), "nd-sink"))
+    return;
+
+  /* The server is shared with other sinks, only take the connection
+   * coming from the sink we signalled. */
+  connection = gst_rtsp_client_get_connection (GST_RTSP_CLIENT (client));
+  if (connection && g_strcmp0 (gst_rtsp_connection_get_ip (connection), sink->remote_address) != 0)
+    return;
+
   g_debug ("NdWFDMiceSink: Got client connection");
 
-  g_signal_handlers_disconnect_by_func (sink->server, client_connected_cb, sink);
+  g_signal_handlers_disconnect_matched (sink->server,
+                                        G_SIGNAL_MATCH_ID | G_SIGNAL_MATCH_DATA,
+                                        g_signal_lookup ("client-connected", GST_TYPE_RTSP_SERVER),
+                                        0, NULL, NULL, sink);
+  g_object_set_data (G_OBJECT (client), "nd-sink", sink);
+  sink->client = g_object_ref (client);
+  wfd_server_assign_setup (client, sink);
   sink->state = ND_SINK_STATE_WAIT_STREAMING;
   g_object_notify (G_OBJECT (sink), "state");
 
   /* XXX: connect to further events. */
-  g_signal_connect_object (client,
-                           "play-request",
-                           (GCallback) play_request_cb,
-                           sink,
-                           G_CONNECT_SWAPPED);
-
-  g_signal_connect_object (client,
-                           "closed",
-                           (GCallback) closed_cb,
-                           sink,
-                           G_CONNECT_SWAPPED);
+  wfd_signal_connect_main_context (client,
+                                   "play-request",
+                                   (GCallback) play_request_cb,
+                                   sink);
+
+  wfd_signal_connect_main_context (client,
+                                   "closed",
+                                   (GCallback) closed_cb,
+                                   sink);
+
+  /* The client lives on the server thread and might have gone away
+   * before we got to see it. */
+  if (wfd_client_is_closed (client))
+    closed_cb (sink, client);
 }
 
 static GstElement *
@@ -423,24 +443,29 @@ nd_wfd_mice_sink_sink_start_stream (NdSink *sink)
       return g_object_ref (sink);
     }
 
+  if (self->remote_address == NULL)
+    {
+      self->state = ND_SINK_STATE_ERROR;
+      g_object_notify (G_OBJECT (self), "state");
+
+      return g_object_ref (sink);
+    }
+
   g_assert (self->server == NULL);
-  self->server = wfd_server_new ();
-  self->server_source_id = gst_rtsp_server_attach (GST_RTSP_SERVER (self->server), NULL);
+  self->server = wfd_server_acquire_shared ();
 
-  if (self->server_source_id == 0 || self->remote_address == NULL)
+  if (self->server == NULL)
     {
       self->state = ND_SINK_STATE_ERROR;
       g_object_notify (G_OBJECT (self), "state");
-      g_clear_object (&self->server);
 
       return g_object_ref (sink);
     }
 
-  g_signal_connect_object (self->server,
-                           "client-connected",
-                           (GCallback) client_connected_cb,
-                           self,
-                           G_CONNECT_SWAPPED);
+  wfd_signal_connect_main_context (self->server,
+                                   "client-connected",
+                                   (GCallback) client_connected_cb,
+                                   self);
 
   g_signal_connect_object (self->server,
                            "create-source",
@@ -469,9 +494,9 @@ nd_wfd_mice_sink_sink_start_stream (NdSink *sink)
       else
         g_warning ("NdWFDMiceSink: Failed to create MICE client");
 
+      nd_wfd_mice_sink_sink_stop_stream_int (self);
       self->state = ND_SINK_STATE_ERROR;
       g_object_notify (G_OBJECT (self), "state");
-      g_clear_object (&self->server);
     }
 
   return g_object_ref (sink);
@@ -501,21 +526,25 @@ nd_wfd_mice_sink_sink_stop_stream_int (NdWFDMiceSink *self)
       g_debug ("NdWFDMiceSink: Client connection removed");
     }
 
-  /* Destroy the server that is streaming. */
-  if (self->server_source_id)
-    {
-      g_source_remove (self->server_source_id);
-      self->server_source_id = 0;
-    }
-
-  /* Needs to protect against recursion. */
+  /* Close our client and stop using the shared server.
+   * Needs to protect against recursion. */
   if (self->server)
     {
       g_autoptr(WfdServer) server = NULL;
 
       server = g_steal_pointer (&self->server);
       g_signal_handlers_disconnect_by_data (server, self);
-      wfd_server_purge (server);
+
+      if (self->client)
+        {
+          g_autoptr(WfdClient) client = NULL;
+
+          client = g_steal_pointer (&self->client);
+          g_signal_handlers_disconnect_by_data (client, self);
+          gst_rtsp_client_close (GST_RTSP_CLIENT (client));
+        }
+
+      wfd_server_release_shared (server);
     }
 }
 
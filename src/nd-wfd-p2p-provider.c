@@ -19,6 +19,8 @@
 #include "nd-wfd-p2p-provider.h"
 #include "deepin-network-displays-config.h"
 #include "nd-wfd-p2p-sink.h"
+#include "wfd/wfd-ie.h"
+#include "wfd/wfd-media-factory.h"
 
 struct _NdWFDP2PProvider
 {
@@ -75,15 +77,29 @@ peer_added_cb (NdWFDP2PProvider *provider, NMWifiP2PPeer *peer, NMDevice *device
 {
   NdWFDP2PSink *sink = NULL;
   GBytes *wfd_ies;
+  WfdIE ie;
+  const gchar *ignore_reason = NULL;
 
   wfd_ies = nm_wifi_p2p_peer_get_wfd_ies (peer);
 
   /* Assume this is not a WFD Peer if there are no WFDIEs set. */
   if (!wfd_ies || g_bytes_get_size (wfd_ies) == 0)
+    ignore_reason = "it has no WFDIEs set";
+  /* Peers without a device information are still tried */
+  else if (wfd_ie_parse (g_bytes_get_data (wfd_ies, NULL), g_bytes_get_size (wfd_ies), &ie))
     {
-      g_debug ("WFDP2PProvider: Ignoring peer \"%s\" (%s) for now as it has no WFDIEs set",
+      if (!wfd_ie_is_sink (&ie))
+        ignore_reason = "it is not a sink";
+      else if (!ie.session_available)
+        ignore_reason = "it does not accept a session";
+    }
+
+  if (ignore_reason)
+    {
+      g_debug ("WFDP2PProvider: Ignoring peer \"%s\" (%s) for now as %s",
                nm_wifi_p2p_peer_get_name (peer),
-               nm_wifi_p2p_peer_get_hw_address (peer));
+               nm_wifi_p2p_peer_get_hw_address (peer),
+               ignore_reason);
 
       g_signal_connect_object (peer, "notify::" NM_WIFI_P2P_PEER_WFD_IES,
                                G_CALLBACK (on_peer_wfd_ie_notify_cb),
@@ -111,6 +127,9 @@ peer_added_cb (NdWFDP2PProvider *provider, NMWifiP2PPeer *peer, NMDevice *device
         return;
     }
 
+  /* The user is likely to connect to it soon, get the encoders ready */
+  wfd_media_factory_preload ();
+
   sink = nd_wfd_p2p_sink_new (provider->nm_client, provider->nm_device, peer);
 
   g_ptr_array_add (provider->sinks, sink);
@@ -276,6 +295,8 @@ nd_wfd_p2p_provider_set_property (GObject *object,
     case PROP_CLIENT:
       /* Construct only */
       provider->nm_client = g_value_dup_object (value);
+      if (provider->nm_client)
+        nd_wfd_p2p_sink_prune_saved_connections (provider->nm_client);
       break;
 
     case PROP_DEVICE:
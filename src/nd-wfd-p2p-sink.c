@@ -20,6 +20,7 @@
 #include "nd-wfd-p2p-sink.h"
 #include "wfd/wfd-server.h"
 #include "wfd/wfd-client.h"
+#include "wfd/wfd-ie.h"
 #include "wfd/wfd-media-factory.h"
 #include "nd-firewalld.h"
 
@@ -42,7 +43,11 @@ struct _NdWFDP2PSink
   gchar              *hw_address;
 
   WfdServer          *server;
-  guint               server_source_id;
+  WfdClient          *client;
+
+  guint               resume_timeout_id;
+  /* The client that dropped off, it keeps the media prepared for us */
+  WfdClient          *grace_client;
 };
 
 enum {
@@ -68,6 +73,26 @@ static NdSink * nd_wfd_p2p_sink_sink_start_stream (NdSink *sink);
 static void nd_wfd_p2p_sink_sink_stop_stream (NdSink *sink);
 
 static void nd_wfd_p2p_sink_sink_stop_stream_int (NdWFDP2PSink *self);
+static void start_p2p_connection (NdWFDP2PSink *self,
+                                  gboolean      use_saved);
+static void add_p2p_connection (NdWFDP2PSink *self);
+
+static void client_connected_cb (NdWFDP2PSink *sink,
+                                 WfdClient    *client,
+                                 WfdServer    *server);
+
+/* How long to keep everything running for a sink that dropped off. */
+#define DEFAULT_RESUME_GRACE_MS 5000
+
+/* Profiles we saved for a sink are found again by their name. */
+#define SAVED_CONNECTION_PREFIX "Network Displays "
+
+/* Saved profiles not used for this long are deleted, in seconds. */
+#define SAVED_CONNECTION_MAX_AGE (30 * 24 * 60 * 60)
+
+/* Static WFD IEs describing a source with the RTSP server on port 7236. */
+// 1c44 就是 7236
+#define WFD_SOURCE_IES "\x00\x00\x06\x00\x90\x1c\x44\x00\xc8"
 
 
 G_DEFINE_TYPE_EXTENDED (NdWFDP2PSink, nd_wfd_p2p_sink, G_TYPE_OBJECT, 0,
@@ -81,12 +106,107 @@ static GParamSpec * props[PROP_LAST] = { NULL, };
 static void
 peer_notify_cb (NdWFDP2PSink *self, GParamSpec *pspec, NMWifiP2PPeer *peer)
 {
+  /* Signal strength changes constantly, don't make every one of them
+   * look like a name change to the D-Bus side. */
+  if (g_str_equal (pspec->name, NM_WIFI_P2P_PEER_STRENGTH))
+    {
+      g_object_notify (G_OBJECT (self), "strength");
+      return;
+    }
+
   /* TODO: Assumes the display name may have changed.
    *       This is obviously overly aggressive, on the other hand
    *       not really an issue. */
   g_object_notify (G_OBJECT (self), "display-name");
 }
 
+static guint
+get_resume_grace_ms (void)
+{
+  const gchar *env = g_getenv ("NETWORK_DISPLAYS_RESUME_GRACE_MS");
+
+  if (env)
+    return g_ascii_strtoull (env, NULL, 10);
+
+  return DEFAULT_RESUME_GRACE_MS;
+}
+
+static gboolean
+resume_timeout_cb (gpointer user_data)
+{
+  NdWFDP2PSink *self = ND_WFD_P2P_SINK (user_data);
+
+  g_debug ("NdWfdP2PSink: Sink did not come back, shutting down");
+  self->resume_timeout_id = 0;
+  nd_wfd_p2p_sink_sink_stop_stream (ND_SINK (self));
+
+  return G_SOURCE_REMOVE;
+}
+
+/* The sink dropped off while streaming. Instead of tearing everything
+ * down, keep the server running for a short while and wait for the sink
+ * to come back. The old client is kept around until the new one plays,
+ * it holds a prepare count on the media, so the pipeline and the encoders
+ * survive and the new client is set up on them. The capture and audio
+ * setup stay alive as the state never goes to disconnected.
+ * Returns FALSE if a full stop is needed instead. */
+static gboolean
+start_resume_grace (NdWFDP2PSink *self, gboolean link_lost)
+{
+  guint grace_ms = get_resume_grace_ms ();
+
+  /* The sink closed the RTSP connection first and now left the group as
+   * well. Keep waiting for it within the running grace period, but the
+   * link has to be brought up again. */
+  if (link_lost && self->server && self->resume_timeout_id)
+    {
+      g_debug ("NdWfdP2PSink: Lost the P2P link during the grace period, reconnecting");
+      self->state = ND_SINK_STATE_WAIT_P2P;
+      g_object_notify (G_OBJECT (self), "state");
+      start_p2p_connection (self, TRUE);
+
+      return TRUE;
+    }
+
+  if (grace_ms == 0 || !self->server || self->resume_timeout_id)
+    return FALSE;
+
+  if (self->state != ND_SINK_STATE_STREAMING && self->state != ND_SINK_STATE_WAIT_STREAMING)
+    return FALSE;
+
+  g_debug ("NdWfdP2PSink: Lost the %s, waiting %u ms for the sink to come back",
+           link_lost ? "P2P link" : "RTSP connection", grace_ms);
+
+  if (self->client)
+    {
+      g_clear_object (&self->grace_client);
+      self->grace_client = g_steal_pointer (&self->client);
+
+      g_signal_handlers_disconnect_by_data (self->grace_client, self);
+      gst_rtsp_client_close (GST_RTSP_CLIENT (self->grace_client));
+    }
+
+  wfd_signal_connect_main_context (self->server,
+                                   "client-connected",
+                                   (GCallback) client_connected_cb,
+                                   self);
+
+  self->resume_timeout_id = g_timeout_add (grace_ms, resume_timeout_cb, self);
+
+  if (link_lost)
+    {
+      self->state = ND_SINK_STATE_WAIT_P2P;
+      start_p2p_connection (self, TRUE);
+    }
+  else
+    {
+      self->state = ND_SINK_STATE_WAIT_SOCKET;
+    }
+  g_object_notify (G_OBJECT (self), "state");
+
+  return TRUE;
+}
+
 static void
 notify_active_connection_cb (NdWFDP2PSink *self, GParamSpec *pspec, NMDevice *device)
 {
@@ -100,6 +220,9 @@ notify_active_connection_cb (NdWFDP2PSink *self, GParamSpec *pspec, NMDevice *de
   /* Our active connection is not active anymore ... */
   g_clear_object (&self->nm_ac);
 
+  if (start_resume_grace (self, TRUE))
+    return;
+
   nd_wfd_p2p_sink_sink_stop_stream_int (self);
   self->state = ND_SINK_STATE_ERROR;
   g_object_notify (G_OBJECT (self), "state");
@@ -221,12 +344,6 @@ nd_wfd_p2p_sink_set_property (GObject      *object,
                                (GCallback) peer_notify_cb,
                                sink,
                                G_CONNECT_SWAPPED);
-      // TODO 监听某一个属性
-      g_signal_connect_object (sink->nm_peer,
-                              "notify::" NM_WIFI_P2P_PEER_STRENGTH,
-                              (GCallback) peer_notify_cb,
-                              sink,
-                              G_CONNECT_SWAPPED);
       break;
 
     default:
@@ -319,6 +436,9 @@ play_request_cb (NdWFDP2PSink *sink, GstRTSPContext *ctx, WfdClient *client)
 {
   g_debug ("NdWfdP2PSink: Got play request from client");
 
+  /* The new client uses the media now, the old one can let go of it */
+  g_clear_object (&sink->grace_client);
+
   sink->state = ND_SINK_STATE_STREAMING;
   g_object_notify (G_OBJECT (sink), "state");
 }
@@ -326,31 +446,117 @@ play_request_cb (NdWFDP2PSink *sink, GstRTSPContext *ctx, WfdClient *client)
 static void
 closed_cb (NdWFDP2PSink *sink, WfdClient *client)
 {
+  if (start_resume_grace (sink, FALSE))
+    return;
+
   /* Connection was closed, do a clean shutdown*/
   nd_wfd_p2p_sink_sink_stop_stream (ND_SINK (sink));
 }
 
+static gboolean
+client_is_on_p2p_link (NdWFDP2PSink *sink, WfdClient *client)
+{
+  g_autoptr(GSocketAddress) sock_addr = NULL;
+  g_autofree gchar *local_addr = NULL;
+  GstRTSPConnection *connection;
+  NMIPConfig *ip4_config;
+  GPtrArray *addresses;
+  guint i;
+
+  /* The server is shared with other sinks, so only accept clients that
+   * connected through the address we got on our P2P link. Without a link
+   * the client cannot be ours. If the link has no address configuration
+   * or the local address is unknown, we cannot tell, then assume the
+   * connection is for us. */
+  if (!sink->nm_ac)
+    return FALSE;
+
+  ip4_config = nm_active_connection_get_ip4_config (sink->nm_ac);
+  connection = gst_rtsp_client_get_connection (GST_RTSP_CLIENT (client));
+  if (!ip4_config || !connection)
+    return TRUE;
+
+  sock_addr = g_socket_get_local_address (gst_rtsp_connection_get_read_socket (connection), NULL);
+  if (!G_IS_INET_SOCKET_ADDRESS (sock_addr))
+    return TRUE;
+
+  local_addr = g_inet_address_to_string (g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (sock_addr)));
+
+  addresses = nm_ip_config_get_addresses (ip4_config);
+  for (i = 0; i < addresses->len; i++)
+    {
+      if (g_strcmp0 (nm_ip_address_get_address (g_ptr_array_index (addresses, i)), local_addr) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Seed the negotiation with what the peer announced during discovery */
+static void
+apply_peer_ies (NdWFDP2PSink *self, WfdClient *client)
+{
+  GBytes *wfd_ies = nm_wifi_p2p_peer_get_wfd_ies (self->nm_peer);
+  WfdIE ie;
+
+  if (!wfd_ies || !wfd_ie_parse (g_bytes_get_data (wfd_ies, NULL), g_bytes_get_size (wfd_ies), &ie))
+    return;
+
+  g_debug ("NdWfdP2PSink: Peer announced RTSP port %u and up to %u Mbit/s",
+           ie.rtsp_port, ie.max_throughput_mbit);
+
+  if (ie.max_throughput_mbit > 0)
+    wfd_client_set_link_capacity (client, ie.max_throughput_mbit * 1000);
+}
+
 static void
 client_connected_cb (NdWFDP2PSink *sink, WfdClient *client, WfdServer *server)
 {
+  if (g_object_get_data (G_OBJECT (client), "nd-sink"))
+    return;
+
+  if (!client_is_on_p2p_link (sink, client))
+    return;
+
   g_debug ("NdWfdP2PSink: Got client connection");
 
-  g_signal_handlers_disconnect_by_func (sink->server, client_connected_cb, sink);
+  if (sink->resume_timeout_id)
+    {
+      /* The old client still holds the media prepared until this one
+       * plays, configuring it for the new client requests a keyframe,
+       * so the picture is back right away. */
+      g_debug ("NdWfdP2PSink: Sink came back, resuming");
+      g_source_remove (sink->resume_timeout_id);
+      sink->resume_timeout_id = 0;
+    }
+
+  g_signal_handlers_disconnect_matched (sink->server,
+                                        G_SIGNAL_MATCH_ID | G_SIGNAL_MATCH_DATA,
+                                        g_signal_lookup ("client-connected", GST_TYPE_RTSP_SERVER),
+                                        0, NULL, NULL, sink);
+  g_object_set_data (G_OBJECT (client), "nd-sink", sink);
+  sink->client = g_object_ref (client);
+  wfd_server_assign_setup (client, sink);
+  wfd_client_set_keep_media_on_close (client, get_resume_grace_ms () > 0);
+  apply_peer_ies (sink, client);
   sink->state = ND_SINK_STATE_WAIT_STREAMING;
   g_object_notify (G_OBJECT (sink), "state");
 
   /* XXX: connect to further events. */
-  g_signal_connect_object (client,
-                           "play-request",
-                           (GCallback) play_request_cb,
-                           sink,
-                           G_CONNECT_SWAPPED);
-
-  g_signal_connect_object (client,
-                           "closed",
-                           (GCallback) closed_cb,
-                           sink,
-                           G_CONNECT_SWAPPED);
+  wfd_signal_connect_main_context (client,
+                                   "play-request",
+                                   (GCallback) play_request_cb,
+                                   sink);
+
+  wfd_signal_connect_main_context (client,
+                                   "closed",
+                                   (GCallback) closed_cb,
+                                   sink);
+
+  /* The client lives on the server thread and might have gone away
+   * before we got to see it. */
+  if (wfd_client_is_closed (client))
+    closed_cb (sink, client);
 }
 
 static GstElement *
@@ -374,56 +580,46 @@ server_create_audio_source_cb (NdWFDP2PSink *sink, WfdServer *server)
 }
 
 static void
-p2p_connected (GObject      *source_object,
-               GAsyncResult *res,
-               gpointer      user_data)
+p2p_connection_failed (NdWFDP2PSink *sink, GError *error)
 {
-  g_autoptr(GError) error = NULL;
-  NdWFDP2PSink *sink = NULL;
-  NMActiveConnection *ac = NULL;
+  g_warning ("Error activating connection: %s", error->message);
+  nd_wfd_p2p_sink_sink_stop_stream_int (sink);
+  sink->state = ND_SINK_STATE_ERROR;
+  g_object_notify (G_OBJECT (sink), "state");
+}
 
-  g_debug ("NdWfdP2PSink: Got P2P connection");
+static void
+p2p_connection_ready (NdWFDP2PSink *sink, NMActiveConnection *ac)
+{
+  sink->nm_ac = ac;
 
-  ac = nm_client_add_and_activate_connection2_finish (NM_CLIENT (source_object), res, NULL, &error);
-  if (!ac)
+  /* Resuming, the server was kept running. */
+  if (sink->server)
     {
-      /* Operation was aborted */
-      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-        return;
-
-      g_warning ("Error activating connection: %s", error->message);
-      sink = ND_WFD_P2P_SINK (user_data);
-      nd_wfd_p2p_sink_sink_stop_stream_int (sink);
-      sink->state = ND_SINK_STATE_ERROR;
+      sink->state = ND_SINK_STATE_WAIT_SOCKET;
       g_object_notify (G_OBJECT (sink), "state");
       return;
     }
 
-  sink = ND_WFD_P2P_SINK (user_data);
-  sink->nm_ac = ac;
-
-  g_assert (sink->server == NULL);
-  sink->server = wfd_server_new ();
   /*
-   * XXX: Not yet implemented, but we should only bind on the P2P device
-   * wfd_server_set_interface (GST_RTSP_SERVER (sink->server), nm_device_get_ip_iface (sink->nm_device));
+   * The server is bound to all interfaces and shared with any other sink
+   * that is streaming at the same time. Clients are assigned to us based
+   * on the local address they connected to.
    */
-  sink->server_source_id = gst_rtsp_server_attach (GST_RTSP_SERVER (sink->server), NULL);
+  sink->server = wfd_server_acquire_shared ();
 
-  if (sink->server_source_id == 0)
+  if (sink->server == NULL)
     {
       sink->state = ND_SINK_STATE_ERROR;
       g_object_notify (G_OBJECT (sink), "state");
-      g_clear_object (&sink->server);
 
       return;
     }
 
-  g_signal_connect_object (sink->server,
-                           "client-connected",
-                           (GCallback) client_connected_cb,
-                           sink,
-                           G_CONNECT_SWAPPED);
+  wfd_signal_connect_main_context (sink->server,
+                                   "client-connected",
+                                   (GCallback) client_connected_cb,
+                                   sink);
 
   g_signal_connect_object (sink->server,
                            "create-source",
@@ -441,21 +637,155 @@ p2p_connected (GObject      *source_object,
   g_object_notify (G_OBJECT (sink), "state");
 }
 
+static void
+p2p_connected (GObject      *source_object,
+               GAsyncResult *res,
+               gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  NMActiveConnection *ac = NULL;
+
+  g_debug ("NdWfdP2PSink: Got P2P connection");
+
+  ac = nm_client_add_and_activate_connection2_finish (NM_CLIENT (source_object), res, NULL, &error);
+  if (!ac)
+    {
+      /* Operation was aborted */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      p2p_connection_failed (ND_WFD_P2P_SINK (user_data), error);
+      return;
+    }
+
+  p2p_connection_ready (ND_WFD_P2P_SINK (user_data), ac);
+}
+
+static void
+p2p_saved_connection_activated (GObject      *source_object,
+                                GAsyncResult *res,
+                                gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  NdWFDP2PSink *sink = NULL;
+  NMActiveConnection *ac = NULL;
+
+  ac = nm_client_activate_connection_finish (NM_CLIENT (source_object), res, &error);
+  if (!ac)
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      /* The saved profile might be stale, start over with a new one. */
+      g_debug ("NdWfdP2PSink: Saved P2P profile failed (%s), creating a new one", error->message);
+      sink = ND_WFD_P2P_SINK (user_data);
+      start_p2p_connection (sink, FALSE);
+      return;
+    }
+
+  g_debug ("NdWfdP2PSink: Got P2P connection from saved profile");
+  p2p_connection_ready (ND_WFD_P2P_SINK (user_data), ac);
+}
+
+static NMRemoteConnection *
+find_saved_connection (NdWFDP2PSink *self)
+{
+  const GPtrArray *connections;
+  const char *hw_address;
+  guint i;
+
+  hw_address = nm_wifi_p2p_peer_get_hw_address (self->nm_peer);
+  if (!hw_address)
+    return NULL;
+
+  connections = nm_client_get_connections (self->nm_client);
+  for (i = 0; i < connections->len; i++)
+    {
+      NMConnection *connection = g_ptr_array_index (connections, i);
+      NMSettingWifiP2P *p2p_setting;
+
+      if (!g_str_has_prefix (nm_connection_get_id (connection), SAVED_CONNECTION_PREFIX))
+        continue;
+
+      p2p_setting = nm_connection_get_setting_wifi_p2p (connection);
+      if (p2p_setting && g_ascii_strcasecmp (nm_setting_wifi_p2p_get_peer (p2p_setting), hw_address) == 0)
+        return NM_REMOTE_CONNECTION (connection);
+    }
+
+  return NULL;
+}
+
+static void
+saved_connection_deleted (GObject      *source_object,
+                          GAsyncResult *res,
+                          gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!nm_remote_connection_delete_finish (NM_REMOTE_CONNECTION (source_object), res, &error))
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      /* Not fatal, the new profile is still added and found first
+       * next time, as the old one is likely gone already. */
+      g_warning ("NdWfdP2PSink: Could not delete saved P2P profile: %s", error->message);
+    }
+
+  add_p2p_connection (ND_WFD_P2P_SINK (user_data));
+}
+
+/**
+ * nd_wfd_p2p_sink_prune_saved_connections:
+ * @client: a #NMClient
+ *
+ * Deletes the profiles saved for sinks that were not connected to for a
+ * long time, so that they do not pile up in NetworkManager.
+ */
+void
+nd_wfd_p2p_sink_prune_saved_connections (NMClient *client)
+{
+  const GPtrArray *connections;
+  const GPtrArray *active;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  guint i, j;
+
+  connections = nm_client_get_connections (client);
+  active = nm_client_get_active_connections (client);
+  for (i = 0; i < connections->len; i++)
+    {
+      NMConnection *connection = g_ptr_array_index (connections, i);
+      NMSettingConnection *s_con;
+      gboolean in_use = FALSE;
+      guint64 timestamp;
+
+      if (!g_str_has_prefix (nm_connection_get_id (connection), SAVED_CONNECTION_PREFIX))
+        continue;
+
+      for (j = 0; j < active->len; j++)
+        if (nm_active_connection_get_connection (g_ptr_array_index (active, j)) == NM_REMOTE_CONNECTION (connection))
+          in_use = TRUE;
+      if (in_use)
+        continue;
+
+      /* The timestamp is the last successful activation, 0 if never */
+      s_con = nm_connection_get_setting_connection (connection);
+      timestamp = nm_setting_connection_get_timestamp (s_con);
+      if (timestamp + SAVED_CONNECTION_MAX_AGE > (guint64) now)
+        continue;
+
+      g_debug ("NdWfdP2PSink: Deleting unused P2P profile %s", nm_connection_get_id (connection));
+      nm_remote_connection_delete_async (NM_REMOTE_CONNECTION (connection), NULL, NULL, NULL);
+    }
+}
+
 static void
 firewall_ready (GObject      *source_object,
                 GAsyncResult *res,
                 gpointer      user_data)
 {
   g_autoptr(GError) error = NULL;
-  g_autoptr(NMConnection) connection = NULL;
-  g_autoptr(GVariantBuilder) builder = NULL;
-  g_autoptr(GBytes) wfd_ies = NULL;
   NdWFDP2PSink *self = NULL;
-  GVariant *options = NULL;
-  NMSetting *general_setting;
-  NMSetting *p2p_setting;
-  NMSetting *ipv4_setting;
-  NMSetting *ipv6_setting;
   gboolean firewall_ok;
 
   g_debug ("NdWfdP2PSink: Got firewall information");
@@ -483,25 +813,95 @@ firewall_ready (GObject      *source_object,
   g_object_notify (G_OBJECT (self), "state");
   g_object_notify (G_OBJECT (self), "missing-firewall-zone");
 
+  start_p2p_connection (self, TRUE);
+}
+
+/* Connect to the peer. Reconnecting to a known sink activates the profile
+ * that was saved the first time, NetworkManager can then skip building the
+ * connection and reuse what it knows about the peer. */
+static void
+start_p2p_connection (NdWFDP2PSink *self,
+                      gboolean      use_saved)
+{
+  g_autoptr(GBytes) wfd_ies = NULL;
+  NMRemoteConnection *saved;
+
+  wfd_ies = g_bytes_new_static (WFD_SOURCE_IES, 9);
+
+  saved = find_saved_connection (self);
+  if (saved)
+    {
+      NMSettingWifiP2P *saved_p2p = nm_connection_get_setting_wifi_p2p (NM_CONNECTION (saved));
+      GBytes *saved_ies = nm_setting_wifi_p2p_get_wfd_ies (saved_p2p);
+
+      if (use_saved && saved_ies && g_bytes_equal (saved_ies, wfd_ies))
+        {
+          g_debug ("NdWfdP2PSink: nm_client_activate_connection with saved profile %s",
+                   nm_connection_get_id (NM_CONNECTION (saved)));
+          nm_client_activate_connection_async (self->nm_client,
+                                               NM_CONNECTION (saved),
+                                               self->nm_device,
+                                               nm_object_get_path (NM_OBJECT (self->nm_peer)),
+                                               self->cancellable,
+                                               p2p_saved_connection_activated,
+                                               self);
+          return;
+        }
+
+      /* Outdated or broken, replace it once it is gone, so that it is
+       * not found again instead of the new one. */
+      nm_remote_connection_delete_async (saved,
+                                         self->cancellable,
+                                         saved_connection_deleted,
+                                         self);
+      return;
+    }
+
+  add_p2p_connection (self);
+}
+
+static void
+add_p2p_connection (NdWFDP2PSink *self)
+{
+  g_autoptr(NMConnection) connection = NULL;
+  g_autoptr(GVariantBuilder) builder = NULL;
+  g_autoptr(GBytes) wfd_ies = NULL;
+  g_autofree gchar *id = NULL;
+  g_autofree gchar *uuid = NULL;
+  GVariant *options = NULL;
+  NMSetting *general_setting;
+  NMSetting *p2p_setting;
+  NMSetting *ipv4_setting;
+  NMSetting *ipv6_setting;
+
+  wfd_ies = g_bytes_new_static (WFD_SOURCE_IES, 9);
+
   builder = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
   g_variant_builder_add (builder, "{sv}", "bind-activation", g_variant_new_string ("dbus-client"));
-  g_variant_builder_add (builder, "{sv}", "persist", g_variant_new_string ("volatile"));
+  g_variant_builder_add (builder, "{sv}", "persist", g_variant_new_string ("disk"));
 
   options = g_variant_builder_end (builder);
 
-  /* Static WFD IEs describing a source with the RTSP server on port 7236. */
-  wfd_ies = g_bytes_new_static ("\x00\x00\x06\x00\x90\x1c\x44\x00\xc8", 9);
-  // 1c44 就是 7236
   connection = nm_simple_connection_new ();
 
+  id = g_strconcat (SAVED_CONNECTION_PREFIX, nm_wifi_p2p_peer_get_hw_address (self->nm_peer), NULL);
+  uuid = nm_utils_uuid_generate ();
   general_setting = nm_setting_connection_new ();
   nm_setting_connection_add_permission(general_setting, "user", g_get_user_name(), NULL);
   nm_connection_add_setting (connection, general_setting);
-  g_object_set (general_setting, NM_SETTING_CONNECTION_ZONE, ND_WFD_ZONE, NULL);
+  g_object_set (general_setting,
+                NM_SETTING_CONNECTION_ID, id,
+                NM_SETTING_CONNECTION_UUID, uuid,
+                NM_SETTING_CONNECTION_AUTOCONNECT, FALSE,
+                NM_SETTING_CONNECTION_ZONE, ND_WFD_ZONE,
+                NULL);
 
   p2p_setting = nm_setting_wifi_p2p_new ();
   nm_connection_add_setting (connection, p2p_setting);
-  g_object_set (p2p_setting, NM_SETTING_WIFI_P2P_WFD_IES, wfd_ies, NULL);
+  g_object_set (p2p_setting,
+                NM_SETTING_WIFI_P2P_PEER, nm_wifi_p2p_peer_get_hw_address (self->nm_peer),
+                NM_SETTING_WIFI_P2P_WFD_IES, wfd_ies,
+                NULL);
 
   /* We never want to route on IPv4 */
   ipv4_setting = nm_setting_ip4_config_new ();
@@ -583,29 +983,40 @@ nd_wfd_p2p_sink_sink_stop_stream_int (NdWFDP2PSink *self)
 
   self->cancellable = g_cancellable_new ();
 
-  /* Destroy the server that is streaming. */
-  if (self->server_source_id)
+  if (self->resume_timeout_id)
+    g_source_remove (self->resume_timeout_id);
+  self->resume_timeout_id = 0;
+  g_clear_object (&self->grace_client);
+
+  /* Start disconnecting our active connection first, it does not depend
+   * on the server going away and completes asynchronously.
+   * nm_ac will be unset if something else destroyed the connection already */
+  if (self->nm_ac)
     {
-      g_source_remove (self->server_source_id);
-      self->server_source_id = 0;
+      nm_device_disconnect (self->nm_device, NULL, NULL);
+      g_clear_object (&self->nm_ac);
     }
 
-  /* Needs to protect against recursion. */
+  /* Close our client and stop using the shared server.
+   * Needs to protect against recursion. */
   if (self->server)
     {
       g_autoptr(WfdServer) server = NULL;
 
       server = g_steal_pointer (&self->server);
       g_signal_handlers_disconnect_by_data (server, self);
-      wfd_server_purge (server);
-    }
 
-  /* And disconnect our active connection.
-   * nm_ac will be unset if something else destroyed the connection already */
-  if (self->nm_ac)
-    {
-      nm_device_disconnect (self->nm_device, NULL, NULL);
-      g_clear_object (&self->nm_ac);
+      if (self->client)
+        {
+          g_autoptr(WfdClient) client = NULL;
+
+          client = g_steal_pointer (&self->client);
+          g_signal_handlers_disconnect_by_data (client, self);
+          wfd_client_set_keep_media_on_close (client, FALSE);
+          gst_rtsp_client_close (GST_RTSP_CLIENT (client));
+        }
+
+      wfd_server_release_shared (server);
     }
 }
 
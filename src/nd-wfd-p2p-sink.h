@@ -34,5 +34,7 @@ NMClient *             nd_wfd_p2p_sink_get_client (NdWFDP2PSink * sink);
 NMDevice *             nd_wfd_p2p_sink_get_device (NdWFDP2PSink * sink);
 NMWifiP2PPeer *        nd_wfd_p2p_sink_get_peer (NdWFDP2PSink * sink);
 
+void                   nd_wfd_p2p_sink_prune_saved_connections (NMClient * client);
+
 
 G_END_DECLS
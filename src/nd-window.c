@@ -33,6 +33,7 @@
 
 #include "nd-screencast-portal.h"
 #include "nd-pulseaudio.h"
+#include "wfd/wfd-media-factory.h"
 
 struct _NdWindow
 {
@@ -81,7 +82,7 @@ static GstElement *
 sink_create_source_cb (NdWindow * self, NdSink * sink)
 {
   GstBin *bin;
-  GstElement *src, *dst, *res;
+  GstElement *src, *governor, *dst, *res;
 
   bin = GST_BIN (gst_bin_new ("screencast source bin"));
   g_debug ("use x11: %d", self->use_x11);
@@ -95,6 +96,10 @@ sink_create_source_cb (NdWindow * self, NdSink * sink)
 
   gst_bin_add (bin, src);
 
+  /* Only capture as many frames as we are going to send */
+  governor = wfd_source_governor_new (!self->use_x11);
+  gst_bin_add (bin, governor);
+
   dst = gst_element_factory_make ("intervideosink", "inter video sink");
   if (!dst)
     g_error ("Error creating intervideosink, missing dependency!");
@@ -105,7 +110,7 @@ sink_create_source_cb (NdWindow * self, NdSink * sink)
                 NULL);
   gst_bin_add (bin, dst);
 
-  gst_element_link_many (src, dst, NULL);
+  gst_element_link_many (src, governor, dst, NULL);
 
   res = gst_element_factory_make ("intervideosrc", "screencastsrc");
   g_object_set (res,
@@ -0,0 +1,334 @@
+/* wfd-capture-scheduler.c
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gst/app/app.h>
+#include "wfd-capture-scheduler.h"
+
+/* Wake up a little before the frame is needed to absorb scheduling jitter */
+#define SCHEDULER_MARGIN_US 2000
+
+/* Initial guess for the encoding time until we measured it */
+#define DEFAULT_ENCODE_TIME_US 10000
+
+/*
+ * Sits between the capture and the encoder of one rung. Captured frames
+ * land in a one-frame mailbox (an appsink that drops older frames), and a
+ * thread takes the newest frame out at a fixed cadence, just early enough
+ * that the encoder finishes it by the next frame slot. Compared to simply
+ * encoding whenever the encoder is idle this keeps the age of the frame at
+ * encode time minimal and steady, and the output evenly paced.
+ *
+ * When a slot comes without a frame, because the governor stopped the
+ * rung, the media is not PLAYING or the screen is idle, the thread parks
+ * until the next frame arrives instead of waking up every slot.
+ */
+struct _WfdCaptureScheduler
+{
+  GObject      parent_instance;
+
+  gchar       *name;
+  GstElement  *mailbox;
+  GstElement  *src;
+  GThread     *thread;
+
+  GMutex       lock;
+  GCond        cond;
+  gboolean     stop;
+  gboolean     parked;
+  gint         rate;
+  gint64       encode_time_us;
+
+  /* Measurement of the frame currently being encoded */
+  GstClockTime pushed_pts;
+  gint64       pushed_time_us;
+
+  /* Mailbox accounting, only used from the capture thread */
+  GstClockTime waiting_pts;
+  guint64      drops;
+  GstClockTime max_drop_age;
+};
+
+G_DEFINE_TYPE (WfdCaptureScheduler, wfd_capture_scheduler, G_TYPE_OBJECT)
+
+static GstClockTime
+get_running_time (GstElement *element)
+{
+  g_autoptr(GstClock) clock = NULL;
+
+  clock = gst_element_get_clock (element);
+  if (!clock)
+    return GST_CLOCK_TIME_NONE;
+
+  return gst_clock_get_time (clock) - gst_element_get_base_time (element);
+}
+
+static GstPadProbeReturn
+mailbox_probe_cb (GstPad          *pad,
+                  GstPadProbeInfo *info,
+                  gpointer         user_data)
+{
+  WfdCaptureScheduler *self = user_data;
+  GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime dropped_pts;
+
+  /* Latest frame wins: if the previous frame was not taken yet, the
+   * mailbox drops it in favour of this one. */
+  g_mutex_lock (&self->lock);
+  dropped_pts = self->waiting_pts;
+  self->waiting_pts = GST_BUFFER_PTS (buf);
+  if (self->parked && self->rate > 0)
+    g_cond_signal (&self->cond);
+  g_mutex_unlock (&self->lock);
+
+  if (GST_CLOCK_TIME_IS_VALID (dropped_pts))
+    {
+      GstClockTime now = get_running_time (self->mailbox);
+      GstClockTime age = 0;
+
+      if (GST_CLOCK_TIME_IS_VALID (now) && now > dropped_pts)
+        age = now - dropped_pts;
+
+      self->drops++;
+      self->max_drop_age = MAX (self->max_drop_age, age);
+
+      g_debug ("WfdCaptureScheduler %s: Dropped a frame that was %" G_GUINT64_FORMAT " ms old (%" G_GUINT64_FORMAT " drops, worst %" G_GUINT64_FORMAT " ms)",
+               self->name,
+               age / GST_MSECOND,
+               self->drops,
+               self->max_drop_age / GST_MSECOND);
+    }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+wfd_capture_scheduler_push_newest (WfdCaptureScheduler *self)
+{
+  g_autoptr(GstSample) sample = NULL;
+  GstBuffer *buf;
+
+  sample = gst_app_sink_try_pull_sample (GST_APP_SINK (self->mailbox), 0);
+  if (!sample)
+    return;
+
+  buf = gst_sample_get_buffer (sample);
+
+  g_mutex_lock (&self->lock);
+  if (self->waiting_pts == GST_BUFFER_PTS (buf))
+    self->waiting_pts = GST_CLOCK_TIME_NONE;
+  self->pushed_pts = GST_BUFFER_PTS (buf);
+  self->pushed_time_us = g_get_monotonic_time ();
+  g_mutex_unlock (&self->lock);
+
+  gst_app_src_push_sample (GST_APP_SRC (self->src), sample);
+}
+
+static gpointer
+wfd_capture_scheduler_thread (gpointer user_data)
+{
+  WfdCaptureScheduler *self = user_data;
+  gint64 next_slot = g_get_monotonic_time ();
+
+  g_mutex_lock (&self->lock);
+  while (!self->stop)
+    {
+      gint64 interval = G_USEC_PER_SEC / MAX (self->rate, 1);
+      gint64 now = g_get_monotonic_time ();
+      gint64 wakeup;
+
+      next_slot += interval;
+      /* We fell behind (or just started), resynchronize the cadence */
+      if (next_slot < now)
+        next_slot = now + interval;
+
+      wakeup = next_slot - MIN (self->encode_time_us, interval) - SCHEDULER_MARGIN_US;
+      while (!self->stop && g_get_monotonic_time () < wakeup)
+        g_cond_wait_until (&self->cond, &self->lock, wakeup);
+
+      if (self->stop)
+        break;
+
+      if (self->rate <= 0 || !GST_CLOCK_TIME_IS_VALID (self->waiting_pts))
+        {
+          self->parked = TRUE;
+          while (!self->stop && (self->rate <= 0 || !GST_CLOCK_TIME_IS_VALID (self->waiting_pts)))
+            g_cond_wait (&self->cond, &self->lock);
+          self->parked = FALSE;
+
+          if (self->stop)
+            break;
+
+          /* Restart the cadence with the frame that woke us up */
+          interval = G_USEC_PER_SEC / self->rate;
+          next_slot = g_get_monotonic_time () + MIN (self->encode_time_us, interval) + SCHEDULER_MARGIN_US;
+        }
+
+      g_mutex_unlock (&self->lock);
+      wfd_capture_scheduler_push_newest (self);
+      g_mutex_lock (&self->lock);
+    }
+  g_mutex_unlock (&self->lock);
+
+  return NULL;
+}
+
+/**
+ * wfd_capture_scheduler_encoded:
+ * @self: a #WfdCaptureScheduler
+ * @pts: the PTS of a frame that left the encoder
+ *
+ * Updates the running estimate of how long encoding takes.
+ */
+void
+wfd_capture_scheduler_encoded (WfdCaptureScheduler *self,
+                               GstClockTime         pts)
+{
+  gint64 encode_time_us;
+
+  g_mutex_lock (&self->lock);
+  if (pts == self->pushed_pts && self->pushed_time_us > 0)
+    {
+      encode_time_us = g_get_monotonic_time () - self->pushed_time_us;
+      /* Exponential moving average, but react quickly to slowdowns */
+      if (encode_time_us > self->encode_time_us)
+        self->encode_time_us = (self->encode_time_us + encode_time_us) / 2;
+      else
+        self->encode_time_us = (7 * self->encode_time_us + encode_time_us) / 8;
+      self->pushed_time_us = 0;
+    }
+  g_mutex_unlock (&self->lock);
+}
+
+/**
+ * wfd_capture_scheduler_set_rate:
+ * @self: a #WfdCaptureScheduler
+ * @rate: the framerate the encoder runs at, 0 parks the scheduler
+ */
+void
+wfd_capture_scheduler_set_rate (WfdCaptureScheduler *self,
+                                gint                 rate)
+{
+  g_mutex_lock (&self->lock);
+  self->rate = rate;
+  g_cond_signal (&self->cond);
+  g_mutex_unlock (&self->lock);
+}
+
+static void
+wfd_capture_scheduler_dispose (GObject *object)
+{
+  WfdCaptureScheduler *self = (WfdCaptureScheduler *) object;
+
+  if (self->thread)
+    {
+      g_mutex_lock (&self->lock);
+      self->stop = TRUE;
+      g_cond_signal (&self->cond);
+      g_mutex_unlock (&self->lock);
+
+      g_thread_join (self->thread);
+      self->thread = NULL;
+    }
+
+  g_clear_object (&self->mailbox);
+  g_clear_object (&self->src);
+
+  G_OBJECT_CLASS (wfd_capture_scheduler_parent_class)->dispose (object);
+}
+
+static void
+wfd_capture_scheduler_finalize (GObject *object)
+{
+  WfdCaptureScheduler *self = (WfdCaptureScheduler *) object;
+
+  g_debug ("WfdCaptureScheduler %s: Finalize, %" G_GUINT64_FORMAT " frames dropped", self->name, self->drops);
+
+  g_clear_pointer (&self->name, g_free);
+  g_mutex_clear (&self->lock);
+  g_cond_clear (&self->cond);
+
+  G_OBJECT_CLASS (wfd_capture_scheduler_parent_class)->finalize (object);
+}
+
+static void
+wfd_capture_scheduler_class_init (WfdCaptureSchedulerClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = wfd_capture_scheduler_dispose;
+  object_class->finalize = wfd_capture_scheduler_finalize;
+}
+
+static void
+wfd_capture_scheduler_init (WfdCaptureScheduler *self)
+{
+  g_mutex_init (&self->lock);
+  g_cond_init (&self->cond);
+
+  self->encode_time_us = DEFAULT_ENCODE_TIME_US;
+  self->pushed_pts = GST_CLOCK_TIME_NONE;
+  self->waiting_pts = GST_CLOCK_TIME_NONE;
+}
+
+/**
+ * wfd_capture_scheduler_new:
+ * @name: name used for debugging
+ * @mailbox: an appsink receiving the captured frames
+ * @src: the appsrc feeding the encoder
+ * @rate: the framerate the encoder runs at
+ *
+ * Returns: (transfer full): a new #WfdCaptureScheduler
+ */
+WfdCaptureScheduler *
+wfd_capture_scheduler_new (const gchar *name,
+                           GstElement  *mailbox,
+                           GstElement  *src,
+                           gint         rate)
+{
+  g_autoptr(GstPad) mailbox_sink = NULL;
+  WfdCaptureScheduler *self;
+
+  self = g_object_new (WFD_TYPE_CAPTURE_SCHEDULER, NULL);
+  self->name = g_strdup (name);
+  self->mailbox = g_object_ref (mailbox);
+  self->src = g_object_ref (src);
+  self->rate = rate;
+
+  g_object_set (mailbox,
+                "max-buffers", (guint) 1,
+                "drop", TRUE,
+                "sync", FALSE,
+                "async", FALSE,
+                "emit-signals", FALSE,
+                NULL);
+
+  g_object_set (src,
+                "is-live", TRUE,
+                "format", GST_FORMAT_TIME,
+                "do-timestamp", FALSE,
+                NULL);
+
+  mailbox_sink = gst_element_get_static_pad (mailbox, "sink");
+  gst_pad_add_probe (mailbox_sink,
+                     GST_PAD_PROBE_TYPE_BUFFER,
+                     mailbox_probe_cb,
+                     self,
+                     NULL);
+
+  self->thread = g_thread_new (name, wfd_capture_scheduler_thread, self);
+
+  return self;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define WFD_TYPE_CAPTURE_SCHEDULER (wfd_capture_scheduler_get_type ())
+
+G_DECLARE_FINAL_TYPE (WfdCaptureScheduler, wfd_capture_scheduler, WFD, CAPTURE_SCHEDULER, GObject)
+
+WfdCaptureScheduler *wfd_capture_scheduler_new (const gchar *name,
+                                                GstElement  *mailbox,
+                                                GstElement  *src,
+                                                gint         rate);
+
+void                 wfd_capture_scheduler_set_rate (WfdCaptureScheduler *self,
+                                                     gint                 rate);
+void                 wfd_capture_scheduler_encoded (WfdCaptureScheduler *self,
+                                                    GstClockTime         pts);
+
+G_END_DECLS
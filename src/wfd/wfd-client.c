@@ -5,6 +5,9 @@
 #include "wfd-media-factory.h"
 #include "wfd-media.h"
 #include "wfd-params.h"
+#include "wfd-qos.h"
+#include "wfd-server.h"
+#include "wfd-sink-cache.h"
 
 typedef enum {
   INIT_STATE_M0_INVALID = 0,
@@ -17,6 +20,9 @@ typedef enum {
   INIT_STATE_DONE = 9999,
 } WfdClientInitState;
 
+/* M1 to M5, then the time until the sink sends PLAY (M7) */
+#define N_INIT_TIMINGS 6
+
 typedef enum {
   CONNECTION_TYPE_WFD  = 0,
   CONNECTION_TYPE_RTSP = 1
@@ -27,13 +33,35 @@ struct _WfdClient
   GstRTSPClient      parent_instance;
 
   WfdConnectionType  connection_type;
-  guint              keep_alive_source_id;
+  GMainContext      *context;
+  GSource           *keep_alive_source;
+  gint               closed;
 
   WfdClientInitState init_state;
+  gchar             *sink_id;
+  guint              query_delay_ms;
+  gint64             connect_time;
+  gint64             state_time;
+  guint              init_timings[N_INIT_TIMINGS];
+  gboolean           timings_done;
+
+  /* What the sink announced last time and what we chose for it */
+  gchar             *cached_capabilities;
+  gchar             *cached_format;
+
   WfdMedia          *media;
   WfdParams         *params;
 
   WfdMediaQuirks     media_quirks;
+  gboolean           suspended;
+
+  /* Keeps the media prepared after the connection dropped, see
+   * wfd_client_set_keep_media_on_close() */
+  gint               keep_media_on_close;
+  GstRTSPMedia      *held_media;
+
+  /* Set from the main thread, see wfd_client_set_link_capacity() */
+  gint               link_capacity_kbit;
 };
 
 G_DEFINE_TYPE (WfdClient, wfd_client, GST_TYPE_RTSP_CLIENT)
@@ -57,6 +85,116 @@ wfd_client_new (void)
   return g_object_new (WFD_TYPE_CLIENT, NULL);
 }
 
+/* Remember the bitrate that ran well for the next session with the sink.
+ * If frames had to be dropped it was too much, and a lower one is stored.
+ * A session that kept up lets the next one start a little higher, but
+ * never above what the ladder and the link planned for. */
+static void
+wfd_client_save_operating_point (WfdClient *self, GstBin *element)
+{
+  g_autofree gchar *encoder = NULL;
+  guint bitrate_kbit;
+  guint planned_kbit;
+  gboolean congested;
+
+  if (self->connection_type != CONNECTION_TYPE_WFD || !self->sink_id)
+    return;
+
+  if (!wfd_media_element_get_operating_point (element, self->params, &encoder, &bitrate_kbit, &planned_kbit, &congested))
+    return;
+
+  if (congested)
+    bitrate_kbit = bitrate_kbit * 3 / 4;
+  else
+    bitrate_kbit = MIN (bitrate_kbit * 5 / 4, planned_kbit);
+
+  g_debug ("WfdClient: Sink %s will start at %u kbit/s next time", self->sink_id, bitrate_kbit);
+  wfd_sink_cache_set_operating_point (self->sink_id, encoder, bitrate_kbit);
+}
+
+static void
+wfd_client_release_media (WfdClient *self)
+{
+  g_autoptr(GstElement) element = NULL;
+
+  if (!self->media)
+    return;
+
+  element = gst_rtsp_media_get_element (GST_RTSP_MEDIA (self->media));
+  wfd_client_save_operating_point (self, GST_BIN (element));
+  if (self->suspended)
+    {
+      wfd_media_element_resume (GST_BIN (element), self->params);
+      self->suspended = FALSE;
+    }
+  wfd_media_element_release (GST_BIN (element), self->params);
+  wfd_media_update_latency (self->media);
+  g_clear_object (&self->media);
+}
+
+/* Stop encoding for this client while keeping everything configured. */
+static void
+wfd_client_suspend_media (WfdClient *self)
+{
+  g_autoptr(GstElement) element = NULL;
+
+  if (!self->media || self->suspended)
+    return;
+
+  g_debug ("WfdClient: Suspending stream");
+  element = gst_rtsp_media_get_element (GST_RTSP_MEDIA (self->media));
+  wfd_media_element_suspend (GST_BIN (element), self->params);
+  self->suspended = TRUE;
+}
+
+static void
+wfd_client_resume_media (WfdClient *self)
+{
+  g_autoptr(GstElement) element = NULL;
+
+  if (!self->media || !self->suspended)
+    return;
+
+  g_debug ("WfdClient: Resuming stream");
+  element = gst_rtsp_media_get_element (GST_RTSP_MEDIA (self->media));
+  wfd_media_element_resume (GST_BIN (element), self->params);
+  self->suspended = FALSE;
+}
+
+/* Run @func with a reference to @self from the context the client is
+ * served on, which is the server thread rather than the default one. */
+static void
+wfd_client_idle_add (WfdClient *self, GSourceFunc func)
+{
+  GSource *source;
+
+  source = g_idle_source_new ();
+  /* These advance the connection setup, which users are waiting for */
+  g_source_set_priority (source, G_PRIORITY_HIGH);
+  g_source_set_callback (source, func, g_object_ref (self), NULL);
+  g_source_attach (source, self->context);
+  g_source_unref (source);
+}
+
+/* Move on to @state and record how long the previous step took */
+static void
+wfd_client_set_init_state (WfdClient *self, WfdClientInitState state)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  if (self->init_state >= INIT_STATE_M1_SOURCE_QUERY_OPTIONS &&
+      self->init_state <= INIT_STATE_M5_SOURCE_TRIGGER_SETUP)
+    {
+      guint elapsed = (now - self->state_time) / 1000;
+
+      self->init_timings[self->init_state - INIT_STATE_M1_SOURCE_QUERY_OPTIONS] = elapsed;
+      g_debug ("WfdClient: M%d took %u ms", self->init_state, elapsed);
+    }
+
+  self->init_state = state;
+  self->state_time = now;
+}
+
 static void
 wfd_client_finalize (GObject *object)
 {
@@ -64,11 +202,22 @@ wfd_client_finalize (GObject *object)
 
   g_debug ("WfdClient: Finalize");
 
+  wfd_client_release_media (self);
+  if (self->held_media)
+    {
+      g_debug ("WfdClient: Releasing the media kept for a reconnect");
+      gst_rtsp_media_unprepare (self->held_media);
+      g_clear_object (&self->held_media);
+    }
   g_clear_pointer (&self->params, wfd_params_free);
+  g_clear_pointer (&self->sink_id, g_free);
+  g_clear_pointer (&self->cached_capabilities, g_free);
+  g_clear_pointer (&self->cached_format, g_free);
 
-  if (self->keep_alive_source_id)
-    g_source_remove (self->keep_alive_source_id);
-  self->keep_alive_source_id = 0;
+  if (self->keep_alive_source)
+    g_source_destroy (self->keep_alive_source);
+  g_clear_pointer (&self->keep_alive_source, g_source_unref);
+  g_clear_pointer (&self->context, g_main_context_unref);
 
   G_OBJECT_CLASS (wfd_client_parent_class)->finalize (object);
 }
@@ -138,39 +287,12 @@ wfd_client_select_codec_and_resolution (WfdClient *self, WfdH264ProfileFlags pro
   else
     g_warning ("No codec/resolution could be found, falling back to defaults!");
 
-#if 0
-  /* The native resolution reported by some devices is just useless */
-  if (codec->native)
-    {
-      self->params->selected_resolution = wfd_resolution_copy (codec->native);
-    }
-  else
-    {
-      /* Find a good resolution. */
-      g_autoptr(GList) resolutions = NULL;
-      GList *last;
-
-      resolutions = wfd_video_codec_get_resolutions (codec);
-      resolutions = g_list_sort (resolutions, compare_resolutions);
-      last = g_list_last (resolutions);
-      if (last)
-        {
-          self->params->selected_resolution = wfd_resolution_copy ((WfdResolution *) last->data);
-        }
-      else
-        {
-#endif
-  /* Create a standard full HD resolution if everything fails. */
-  g_warning ("WfdClient: No resolution found, falling back to standard FullHD resolution.");
-  self->params->selected_resolution = wfd_resolution_new ();
-  self->params->selected_resolution->width = 1920;
-  self->params->selected_resolution->height = 1080;
-  self->params->selected_resolution->refresh_rate = 30;
-  self->params->selected_resolution->interlaced = FALSE;
-#if 0
-}
-}
-#endif
+  if (self->params->bandwidth_kbit == 0)
+    self->params->bandwidth_kbit = g_atomic_int_get (&self->link_capacity_kbit);
+
+  /* Pick the best stream of the encoding ladder the sink can handle,
+   * other sinks might be watching a different one at the same time. */
+  self->params->selected_resolution = wfd_simulcast_pick_resolution (codec, self->params->bandwidth_kbit);
   g_debug ("selected resolution %i, %i @%i", self->params->selected_resolution->width, self->params->selected_resolution->height, self->params->selected_resolution->refresh_rate);
 
   /* We currently only support AAC with two channels  */
@@ -201,25 +323,218 @@ wfd_client_configure_client_media (GstRTSPClient * client,
   g_return_val_if_fail (self->params->selected_codec, FALSE);
   g_return_val_if_fail (self->params->selected_resolution, FALSE);
 
-  self->media = WFD_MEDIA (media);
+  wfd_client_release_media (self);
+  self->media = WFD_MEDIA (g_object_ref (media));
+  self->suspended = FALSE;
+
+  /* The capacity may only have become known after negotiating */
+  if (self->params->bandwidth_kbit == 0)
+    self->params->bandwidth_kbit = g_atomic_int_get (&self->link_capacity_kbit);
 
   element = gst_rtsp_media_get_element (media);
   self->media_quirks = wfd_configure_media_element (GST_BIN (element), self->params);
+  wfd_media_update_latency (self->media);
 
   res = GST_RTSP_CLIENT_CLASS (wfd_client_parent_class)->configure_client_media (client, media, stream, ctx);
 
   return res;
 }
 
+static gboolean
+wfd_client_configure_client_transport (GstRTSPClient    *client,
+                                       GstRTSPContext   *ctx,
+                                       GstRTSPTransport *ct)
+{
+  /* Sinks ask for unicast, but in multicast mode everyone receives the
+   * stream from the group. Drop the requested destination so that the
+   * address from the stream's pool is used. */
+  if (wfd_multicast_get_group () && ct->lower_transport == GST_RTSP_LOWER_TRANS_UDP)
+    {
+      g_debug ("WfdClient: Switching transport to multicast");
+      ct->lower_transport = GST_RTSP_LOWER_TRANS_UDP_MCAST;
+      g_clear_pointer (&ct->destination, g_free);
+      ct->ttl = 0;
+    }
+
+  return GST_RTSP_CLIENT_CLASS (wfd_client_parent_class)->configure_client_transport (client, ctx, ct);
+}
+
+static void
+mark_stream_sockets (GstRTSPStream *stream)
+{
+  GSocketFamily families[] = { G_SOCKET_FAMILY_IPV4, G_SOCKET_FAMILY_IPV6 };
+  guint i;
+
+  /* Audio and video are muxed into one MPEG-TS stream, so they share the
+   * sockets and cannot be marked separately. */
+  for (i = 0; i < G_N_ELEMENTS (families); i++)
+    {
+      g_autoptr(GSocket) rtp = NULL;
+      g_autoptr(GSocket) rtcp = NULL;
+      g_autoptr(GSocket) rtp_multicast = NULL;
+
+      rtp = gst_rtsp_stream_get_rtp_socket (stream, families[i]);
+      wfd_qos_mark_socket (rtp, WFD_TRAFFIC_CLASS_MEDIA);
+      rtcp = gst_rtsp_stream_get_rtcp_socket (stream, families[i]);
+      wfd_qos_mark_socket (rtcp, WFD_TRAFFIC_CLASS_MEDIA);
+      rtp_multicast = gst_rtsp_stream_get_rtp_multicast_socket (stream, families[i]);
+      wfd_qos_mark_socket (rtp_multicast, WFD_TRAFFIC_CLASS_MEDIA);
+    }
+}
+
+static GstRTSPStatusCode
+wfd_client_pre_play_request (GstRTSPClient *client, GstRTSPContext *ctx)
+{
+  WfdClient *self = WFD_CLIENT (client);
+  guint i;
+
+  /* The UDP sockets exist once the stream was set up. They are shared by
+   * all clients of the media, marking them again does no harm. */
+  if (self->media)
+    for (i = 0; i < gst_rtsp_media_n_streams (GST_RTSP_MEDIA (self->media)); i++)
+      mark_stream_sockets (gst_rtsp_media_get_stream (GST_RTSP_MEDIA (self->media), i));
+
+  /* The first PLAY (M7) completes the connection setup */
+  if (self->connection_type == CONNECTION_TYPE_WFD && !self->timings_done)
+    {
+      self->timings_done = TRUE;
+      self->init_timings[N_INIT_TIMINGS - 1] = (g_get_monotonic_time () - self->connect_time) / 1000;
+      g_debug ("WfdClient: Sink %s is playing %u ms after connecting",
+               wfd_client_get_sink_id (self), self->init_timings[N_INIT_TIMINGS - 1]);
+      wfd_sink_cache_set_timings (wfd_client_get_sink_id (self), self->init_timings, N_INIT_TIMINGS);
+    }
+
+  /* Coming back from PAUSE or standby */
+  wfd_client_resume_media (self);
+
+  return GST_RTSP_STS_OK;
+}
+
+static GstRTSPStatusCode
+wfd_client_pre_pause_request (GstRTSPClient *client, GstRTSPContext *ctx)
+{
+  wfd_client_suspend_media (WFD_CLIENT (client));
+
+  return GST_RTSP_STS_OK;
+}
+
+static GstRTSPFilterResult
+wfd_client_standby_media_filter_func (GstRTSPSession      *sess,
+                                      GstRTSPSessionMedia *session_media,
+                                      gpointer             user_data)
+{
+  /* Same as the sink sending PAUSE, which lets the media pause the whole
+   * pipeline once no sink is playing anymore. */
+  gst_rtsp_session_media_set_state (session_media, GST_STATE_PAUSED);
+  gst_rtsp_session_media_set_rtsp_state (session_media, GST_RTSP_STATE_READY);
+
+  return GST_RTSP_FILTER_KEEP;
+}
+
+static GstRTSPFilterResult
+wfd_client_standby_session_filter_func (GstRTSPClient  *client,
+                                        GstRTSPSession *sess,
+                                        gpointer        user_data)
+{
+  gst_rtsp_session_filter (sess, wfd_client_standby_media_filter_func, NULL);
+
+  return GST_RTSP_FILTER_KEEP;
+}
+
+static void
+wfd_client_trigger_setup (WfdClient *self)
+{
+  if (wfd_server_park_setup (self))
+    g_debug ("WfdClient: Holding SETUP until the sources are ready");
+  else
+    wfd_client_trigger_method (self, "SETUP");
+}
+
 static gboolean
 wfd_client_idle_trigger_setup (gpointer user_data)
 {
-  wfd_client_trigger_method (WFD_CLIENT (user_data), "SETUP");
+  wfd_client_trigger_setup (WFD_CLIENT (user_data));
   g_object_unref (user_data);
 
   return G_SOURCE_REMOVE;
 }
 
+static gchar *
+wfd_client_get_format (WfdClient *self)
+{
+  g_autofree gchar *video = NULL;
+  g_autofree gchar *audio = NULL;
+
+  video = wfd_video_codec_get_descriptor_for_resolution (self->params->selected_codec, self->params->selected_resolution);
+  audio = wfd_audio_get_descriptor (self->params->selected_audio_codec);
+
+  return g_strdup_printf ("%s; %s", video, audio);
+}
+
+/* Negotiate ahead of time with what the sink announced last time, its
+ * answer to GET_PARAMETER then usually just confirms it. */
+static void
+wfd_client_load_cache (WfdClient *self)
+{
+  const gchar *sink_id = wfd_client_get_sink_id (self);
+  g_autofree gchar *encoder = NULL;
+  guint bitrate_kbit;
+
+  self->cached_capabilities = wfd_sink_cache_get_capabilities (sink_id, &self->cached_format);
+  if (self->cached_capabilities)
+    {
+      wfd_params_from_sink (self->params,
+                            (const guint8 *) self->cached_capabilities,
+                            strlen (self->cached_capabilities));
+      /* XXX: Pick the better profile if we have an encoder that supports it! */
+      wfd_client_select_codec_and_resolution (self, WFD_H264_PROFILE_BASE);
+      g_debug ("WfdClient: Pre-selected the format of sink %s from the cache", sink_id);
+    }
+
+  if (wfd_sink_cache_get_operating_point (sink_id, &encoder, &bitrate_kbit))
+    {
+      self->params->initial_encoder = g_steal_pointer (&encoder);
+      self->params->initial_bitrate_kbit = bitrate_kbit;
+    }
+}
+
+static void
+wfd_client_update_capabilities (WfdClient *self, const guint8 *body, gsize body_size)
+{
+  const gchar *sink_id = wfd_client_get_sink_id (self);
+  g_autofree gchar *capabilities = NULL;
+  g_autofree gchar *format = NULL;
+
+  if (body == NULL)
+    return;
+
+  capabilities = g_strndup ((const gchar *) body, body_size);
+  if (g_strcmp0 (capabilities, self->cached_capabilities) == 0)
+    {
+      g_debug ("WfdClient: Sink %s is unchanged, using the cached negotiation", sink_id);
+      return;
+    }
+
+  wfd_params_from_sink (self->params, body, body_size);
+
+  /* XXX: Pick the better profile if we have an encoder that supports it! */
+  wfd_client_select_codec_and_resolution (self, WFD_H264_PROFILE_BASE);
+
+  /* A sink that ends up with a different format is not the one we know
+   * anymore (e.g. after a firmware update), forget everything about it.
+   * Other changes like different ports do not matter. */
+  format = wfd_client_get_format (self);
+  if (self->cached_format && !g_str_equal (format, self->cached_format))
+    {
+      g_debug ("WfdClient: Sink %s changed its capabilities, dropping the cached data", sink_id);
+      wfd_sink_cache_invalidate (sink_id);
+      self->params->initial_bitrate_kbit = 0;
+      g_clear_pointer (&self->params->initial_encoder, g_free);
+    }
+
+  wfd_sink_cache_set_capabilities (sink_id, capabilities, format);
+}
+
 static gchar *
 wfd_client_get_presentation_uri (WfdClient *self)
 {
@@ -238,7 +553,8 @@ wfd_client_get_presentation_uri (WfdClient *self)
   addr = g_inet_address_to_string (inet_addr);
   port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (sock_addr));
 
-  return g_strdup_printf ("rtsp://%s:%d/wfd1.0/streamid=0", addr, port);
+  return g_strdup_printf ("rtsp://%s:%d/wfd1.0/streamid=%u", addr, port,
+                          wfd_simulcast_get_stream_id (self->params->selected_resolution));
 }
 
 static void
@@ -249,8 +565,19 @@ wfd_client_set_params (WfdClient *self)
   g_autofree gchar * presentation_uri = NULL;
   g_autofree gchar * resolution_descr = NULL;
   g_autofree gchar * audio_descr = NULL;
+  const gchar *profile = "RTP/AVP/UDP;unicast";
+  guint rtp_port = self->params->primary_rtp_port;
+  guint multicast_port;
 
-  self->init_state = INIT_STATE_M4_SOURCE_SET_PARAMS;
+  wfd_client_set_init_state (self, INIT_STATE_M4_SOURCE_SET_PARAMS);
+
+  /* With multicast all sinks of a stream have to listen on the same port */
+  multicast_port = wfd_multicast_get_port (wfd_simulcast_get_stream_id (self->params->selected_resolution));
+  if (multicast_port)
+    {
+      profile = "RTP/AVP/UDP;multicast";
+      rtp_port = multicast_port;
+    }
 
   gst_rtsp_message_init_request (&msg, GST_RTSP_SET_PARAMETER, "rtsp://localhost/wfd1.0");
 
@@ -262,11 +589,11 @@ wfd_client_set_params (WfdClient *self)
     "wfd_video_formats: %s\r\n"
     "wfd_audio_codecs: %s\r\n"
     "wfd_presentation_URL: %s none\r\n"
-    "wfd_client_rtp_ports: RTP/AVP/UDP;unicast %u %u mode=play\r\n",
+    "wfd_client_rtp_ports: %s %u %u mode=play\r\n",
     resolution_descr,
     audio_descr,
     presentation_uri,
-    self->params->primary_rtp_port, self->params->secondary_rtp_port);
+    profile, rtp_port, self->params->secondary_rtp_port);
 
   gst_rtsp_message_add_header_by_name (&msg, "Content-Type", "text/parameters");
   gst_rtsp_message_set_body (&msg, (guint8 *) body, strlen (body));
@@ -276,15 +603,6 @@ wfd_client_set_params (WfdClient *self)
   gst_rtsp_message_unset (&msg);
 }
 
-static gboolean
-wfd_client_idle_set_params (gpointer user_data)
-{
-  wfd_client_set_params (WFD_CLIENT (user_data));
-  g_object_unref (user_data);
-
-  return G_SOURCE_REMOVE;
-}
-
 GstRTSPFilterResult
 wfd_client_touch_session_filter_func (GstRTSPClient  *client,
                                       GstRTSPSession *sess,
@@ -316,26 +634,27 @@ wfd_client_handle_response (GstRTSPClient * client, GstRTSPContext *ctx)
     {
     case INIT_STATE_M1_SOURCE_QUERY_OPTIONS:
       g_debug ("WfdClient: OPTIONS querying done");
-      self->init_state = INIT_STATE_M2_SINK_QUERY_OPTIONS;
+      wfd_sink_cache_query_done (wfd_client_get_sink_id (self), self->query_delay_ms,
+                                 ctx->response->type_data.response.code == GST_RTSP_STS_OK);
+      wfd_client_set_init_state (self, INIT_STATE_M2_SINK_QUERY_OPTIONS);
       break;
 
     case INIT_STATE_M3_SOURCE_GET_PARAMS:
       g_debug ("WfdClient: GET_PARAMS done");
-      wfd_params_from_sink (self->params, ctx->response->body, ctx->response->body_size);
+      wfd_client_update_capabilities (self, ctx->response->body, ctx->response->body_size);
 
-      /* XXX: Pick the better profile if we have an encoder that supports it! */
-      wfd_client_select_codec_and_resolution (self, WFD_H264_PROFILE_BASE);
-
-      g_idle_add (wfd_client_idle_set_params, g_object_ref (self));
+      /* Nothing else is pending on the connection, so there is no need
+       * to wait for the next main loop iteration. */
+      wfd_client_set_params (self);
       break;
 
     case INIT_STATE_M4_SOURCE_SET_PARAMS:
       g_debug ("WfdClient: SET_PARAMS done");
-      g_idle_add (wfd_client_idle_trigger_setup, g_object_ref (self));
+      wfd_client_trigger_setup (self);
       break;
 
     case INIT_STATE_M5_SOURCE_TRIGGER_SETUP:
-      self->init_state = INIT_STATE_DONE;
+      wfd_client_set_init_state (self, INIT_STATE_DONE);
       g_debug ("WfdClient: Initialization done!");
       break;
 
@@ -350,16 +669,19 @@ wfd_client_make_path_from_uri (GstRTSPClient * client, const GstRTSPUrl * uri)
 {
   GstRTSPContext *ctx = gst_rtsp_context_get_current ();
 
-  /* Strip /streamid=0.
+  /* Strip /streamid=N.
    * This is a bad hack, because gstreamer does not support playing/pausing
-   * a specific stream. We can do so safely because we only have one stream.
+   * a specific stream. We can do so safely because every client only sets
+   * up the one stream of its simulcast rung.
    */
   if (ctx->request &&
       (ctx->request->type_data.request.method == GST_RTSP_PLAY ||
        ctx->request->type_data.request.method == GST_RTSP_PAUSE))
     {
-      if (g_str_has_suffix (uri->abspath, "/streamid=0"))
-        return g_strndup (uri->abspath, strlen (uri->abspath) - 11);
+      const gchar *stream_id = g_strrstr (uri->abspath, "/streamid=");
+
+      if (stream_id)
+        return g_strndup (uri->abspath, stream_id - uri->abspath);
       else
         return g_strdup (uri->abspath);
     }
@@ -406,8 +728,12 @@ wfd_client_new_session (GstRTSPClient *client, GstRTSPSession *session)
   gst_rtsp_session_set_timeout (session, 30);
   g_object_set (session, "timeout-always-visible", FALSE, NULL);
 
-  if (self->connection_type == CONNECTION_TYPE_WFD && self->keep_alive_source_id == 0)
-    self->keep_alive_source_id = g_timeout_add_seconds (25, wfd_client_keep_alive_timeout, client);
+  if (self->connection_type == CONNECTION_TYPE_WFD && self->keep_alive_source == NULL)
+    {
+      self->keep_alive_source = g_timeout_source_new_seconds (25);
+      g_source_set_callback (self->keep_alive_source, wfd_client_keep_alive_timeout, client, NULL);
+      g_source_attach (self->keep_alive_source, self->context);
+    }
 }
 
 static GstRTSPResult
@@ -448,7 +774,15 @@ wfd_client_params_set (GstRTSPClient *client, GstRTSPContext *ctx)
       else
         value = NULL;
 
-      if (g_str_equal (option, "wfd_idr_request"))
+      if (g_str_equal (option, "wfd_standby"))
+        {
+          /* The sink is not showing us anymore (M12). It sends PLAY
+           * once it wakes up again. */
+          g_debug ("WfdClient: Sink entered standby");
+          wfd_client_suspend_media (self);
+          gst_rtsp_client_session_filter (client, wfd_client_standby_session_filter_func, NULL);
+        }
+      else if (g_str_equal (option, "wfd_idr_request"))
         {
           /* Force a key unit event. */
           if (self->media_quirks & WFD_QUIRK_NO_IDR)
@@ -457,19 +791,11 @@ wfd_client_params_set (GstRTSPClient *client, GstRTSPContext *ctx)
             }
           else if (self->media)
             {
-              GstRTSPStream *stream;
-              g_autoptr(GstPad) srcpad = NULL;
-              g_autoptr(GstEvent) event = NULL;
-
-              stream = gst_rtsp_media_get_stream (GST_RTSP_MEDIA (self->media), 0);
-              if (!stream)
-                return GST_RTSP_OK;
-
-              srcpad = gst_rtsp_stream_get_srcpad (stream);
+              g_autoptr(GstElement) element = NULL;
 
+              element = gst_rtsp_media_get_element (GST_RTSP_MEDIA (self->media));
               g_debug ("Forcing a keyframe!");
-              event = gst_video_event_new_upstream_force_key_unit (GST_CLOCK_TIME_NONE, TRUE, 0);
-              gst_pad_send_event (srcpad, g_steal_pointer (&event));
+              wfd_media_element_request_key_unit (GST_BIN (element), self->params);
             }
           else
             {
@@ -494,7 +820,7 @@ wfd_client_idle_wfd_query_params (gpointer user_data)
 
   g_debug ("WFD query params");
 
-  self->init_state = INIT_STATE_M3_SOURCE_GET_PARAMS;
+  wfd_client_set_init_state (self, INIT_STATE_M3_SOURCE_GET_PARAMS);
 
   gst_rtsp_message_init_request (&msg, GST_RTSP_GET_PARAMETER, "rtsp://localhost/wfd1.0");
   gst_rtsp_message_add_header_by_name (&msg, "Content-Type", "text/parameters");
@@ -532,11 +858,12 @@ wfd_client_pre_options_request (GstRTSPClient *client, GstRTSPContext *ctx)
           self->params->selected_audio_codec->type = WFD_AUDIO_AAC;
           self->params->selected_audio_codec->modes = G_GUINT64_CONSTANT (0x00000001);
 
-          self->init_state = INIT_STATE_DONE;
+          wfd_client_set_init_state (self, INIT_STATE_DONE);
         }
       else
         {
-          g_idle_add (wfd_client_idle_wfd_query_params, g_object_ref (client));
+          /* The GET_PARAMETER request (M3) has to follow our response */
+          wfd_client_idle_add (self, wfd_client_idle_wfd_query_params);
         }
     }
 
@@ -579,6 +906,29 @@ wfd_client_send_message (GstRTSPClient *client, GstRTSPContext *ctx, GstRTSPMess
     }
 }
 
+static void
+wfd_client_closed (GstRTSPClient *client)
+{
+  WfdClient *self = WFD_CLIENT (client);
+
+  g_atomic_int_set (&self->closed, TRUE);
+
+  /* The sink hung up on our OPTIONS, give it more time next time */
+  if (self->init_state == INIT_STATE_M1_SOURCE_QUERY_OPTIONS)
+    wfd_sink_cache_query_done (wfd_client_get_sink_id (self), self->query_delay_ms, FALSE);
+
+  /* Chaining up removes our session, which drops the last prepare count
+   * of the media if we were its only user. Take one more, so that the
+   * pipeline (and the encoders) survive until we are finalized. */
+  if (g_atomic_int_get (&self->keep_media_on_close) && self->media && !self->held_media &&
+      gst_rtsp_media_get_status (GST_RTSP_MEDIA (self->media)) == GST_RTSP_MEDIA_STATUS_PREPARED &&
+      gst_rtsp_media_prepare (GST_RTSP_MEDIA (self->media), NULL))
+    self->held_media = g_object_ref (GST_RTSP_MEDIA (self->media));
+
+  if (GST_RTSP_CLIENT_CLASS (wfd_client_parent_class)->closed)
+    GST_RTSP_CLIENT_CLASS (wfd_client_parent_class)->closed (client);
+}
+
 static void
 wfd_client_class_init (WfdClientClass *klass)
 {
@@ -588,12 +938,16 @@ wfd_client_class_init (WfdClientClass *klass)
   object_class->finalize = wfd_client_finalize;
 
   client_class->check_requirements = wfd_client_check_requirements;
+  client_class->closed = wfd_client_closed;
   client_class->configure_client_media = wfd_client_configure_client_media;
+  client_class->configure_client_transport = wfd_client_configure_client_transport;
   client_class->handle_response = wfd_client_handle_response;
   client_class->make_path_from_uri = wfd_client_make_path_from_uri;
   client_class->new_session = wfd_client_new_session;
   client_class->params_set = wfd_client_params_set;
   client_class->pre_options_request = wfd_client_pre_options_request;
+  client_class->pre_pause_request = wfd_client_pre_pause_request;
+  client_class->pre_play_request = wfd_client_pre_play_request;
   client_class->send_message = wfd_client_send_message;
 }
 
@@ -602,17 +956,112 @@ wfd_client_init (WfdClient *self)
 {
   self->init_state = INIT_STATE_M0_INVALID;
   self->params = wfd_params_new ();
+  self->connect_time = g_get_monotonic_time ();
+
+  /* Clients are created by the server from its own thread, all of our
+   * timeouts need to be dispatched there too. */
+  self->context = g_main_context_ref_thread_default ();
+}
+
+/**
+ * wfd_client_resume_setup
+ * @self: a #WfdClient
+ *
+ * Trigger SETUP for a client that was parked by wfd_server_park_setup().
+ * Safe to call from any thread.
+ */
+void
+wfd_client_resume_setup (WfdClient *self)
+{
+  wfd_client_idle_add (self, wfd_client_idle_trigger_setup);
+}
+
+/**
+ * wfd_client_set_keep_media_on_close
+ * @self: a #WfdClient
+ * @keep: whether to keep the media prepared
+ *
+ * If set, the media the client streamed stays prepared after the
+ * connection to the sink is lost, until the client is finalized. A sink
+ * that reconnects in the meantime is set up on the same, already running
+ * pipeline. Safe to call from any thread.
+ */
+void
+wfd_client_set_keep_media_on_close (WfdClient *self,
+                                    gboolean   keep)
+{
+  g_atomic_int_set (&self->keep_media_on_close, keep);
+}
+
+/**
+ * wfd_client_is_closed
+ * @self: a #WfdClient
+ *
+ * Whether the connection to the sink was closed already. This is safe to
+ * call from any thread, which lets handlers that run on another context
+ * detect that they missed the #GstRTSPClient::closed signal.
+ */
+gboolean
+wfd_client_is_closed (WfdClient *self)
+{
+  return g_atomic_int_get (&self->closed);
+}
+
+/**
+ * wfd_client_set_link_capacity
+ * @self: a #WfdClient
+ * @kbit: what the sink announced it can receive
+ *
+ * Seeds the estimated link capacity, which limits the stream chosen for
+ * the sink and its bitrate. It only has an effect if set before the
+ * sink's capabilities are negotiated. Safe to call from any thread.
+ */
+void
+wfd_client_set_link_capacity (WfdClient *self, guint32 kbit)
+{
+  g_atomic_int_set (&self->link_capacity_kbit, MIN (kbit, G_MAXINT));
+}
+
+/**
+ * wfd_client_get_sink_id
+ * @self: a #WfdClient
+ *
+ * Returns: the ID the sink is remembered under, see
+ * wfd_sink_cache_get_sink_id()
+ */
+const gchar *
+wfd_client_get_sink_id (WfdClient *self)
+{
+  GstRTSPConnection *connection;
+
+  if (self->sink_id)
+    return self->sink_id;
+
+  connection = gst_rtsp_client_get_connection (GST_RTSP_CLIENT (self));
+  self->sink_id = wfd_sink_cache_get_sink_id (connection ? gst_rtsp_connection_get_ip (connection) : NULL);
+
+  return self->sink_id;
 }
 
+/**
+ * wfd_client_query_support
+ * @self: a #WfdClient
+ * @delay_ms: how long the client waited after connecting
+ *
+ * Starts the connection setup by querying the sink for WFD support (M1).
+ * The sink's answer is used to adapt @delay_ms for its next connection.
+ */
 void
-wfd_client_query_support (WfdClient *self)
+wfd_client_query_support (WfdClient *self, guint delay_ms)
 {
   GstRTSPMessage msg = { 0 };
 
   if (self->init_state != INIT_STATE_M0_INVALID)
     return;
 
-  self->init_state = INIT_STATE_M1_SOURCE_QUERY_OPTIONS;
+  self->query_delay_ms = delay_ms;
+  wfd_client_load_cache (self);
+  wfd_client_set_init_state (self, INIT_STATE_M1_SOURCE_QUERY_OPTIONS);
   gst_rtsp_message_init_request (&msg, GST_RTSP_OPTIONS, "*");
   gst_rtsp_message_add_header_by_name (&msg, "Require", "org.wfa.wfd1.0");
 
@@ -621,6 +1070,14 @@ wfd_client_query_support (WfdClient *self)
   gst_rtsp_message_unset (&msg);
 }
 
+/**
+ * wfd_client_trigger_method
+ * @self: a #WfdClient
+ * @method: "SETUP", "PAUSE", "PLAY" or "TEARDOWN"
+ *
+ * Asks the sink to send the given request (M5). A triggered PAUSE or PLAY
+ * suspends and resumes the stream like a request the sink sent by itself.
+ */
 void
 wfd_client_trigger_method (WfdClient *self, const gchar *method)
 {
@@ -628,7 +1085,7 @@ wfd_client_trigger_method (WfdClient *self, const gchar *method)
   g_autofree gchar *body = NULL;
 
   if (g_str_equal (method, "SETUP") && self->init_state == INIT_STATE_M4_SOURCE_SET_PARAMS)
-    self->init_state = INIT_STATE_M5_SOURCE_TRIGGER_SETUP;
+    wfd_client_set_init_state (self, INIT_STATE_M5_SOURCE_TRIGGER_SETUP);
 
   gst_rtsp_message_init_request (&msg, GST_RTSP_SET_PARAMETER, "rtsp://localhost/wfd1.0");
   body = g_strdup_printf ("wfd_trigger_method: %s\r\n", method);
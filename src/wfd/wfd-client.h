@@ -13,7 +13,15 @@ G_BEGIN_DECLS
 G_DECLARE_FINAL_TYPE (WfdClient, wfd_client, WFD, CLIENT, GstRTSPClient)
 
 WfdClient * wfd_client_new (void);
-void wfd_client_query_support (WfdClient *self);
+void wfd_client_query_support (WfdClient *self,
+                               guint      delay_ms);
+const gchar * wfd_client_get_sink_id (WfdClient *self);
+void wfd_client_set_link_capacity (WfdClient *self,
+                                   guint32    kbit);
+void wfd_client_set_keep_media_on_close (WfdClient *self,
+                                         gboolean   keep);
+gboolean wfd_client_is_closed (WfdClient *self);
+void wfd_client_resume_setup (WfdClient *self);
 void wfd_client_trigger_method (WfdClient   *self,
                                 const gchar *method);
 
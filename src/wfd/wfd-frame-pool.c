@@ -0,0 +1,287 @@
+/* wfd-frame-pool.c
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <sys/mman.h>
+#include "wfd-frame-pool.h"
+
+/* Report the statistics every this many acquired frames */
+#define STATS_INTERVAL 300
+
+/* Transparent huge pages are 2 MiB on all architectures we care about */
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+struct _WfdFramePool
+{
+  GstVideoBufferPool parent_instance;
+
+  gboolean           hugepages;
+  gsize              frame_size;
+
+  /* The element whose source pad the pool serves, for the bus messages */
+  GWeakRef           owner;
+
+  /* Updated from the streaming threads */
+  GMutex             lock;
+  guint64            acquired;
+  guint64            allocated;
+  guint              outstanding;
+  guint              peak_outstanding;
+};
+
+G_DEFINE_TYPE (WfdFramePool, wfd_frame_pool, GST_TYPE_VIDEO_BUFFER_POOL)
+
+static void
+wfd_frame_pool_log_stats (WfdFramePool *self)
+{
+  WfdFramePoolStats stats;
+
+  wfd_frame_pool_get_stats (self, &stats);
+  g_debug ("WfdFramePool %s: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, peak %" G_GSIZE_FORMAT " kB in flight",
+           GST_OBJECT_NAME (self), stats.hits, stats.misses, stats.peak_bytes / 1024);
+}
+
+static void
+wfd_frame_pool_post_stats (WfdFramePool *self)
+{
+  g_autoptr(GstElement) owner = NULL;
+  GstStructure *s;
+
+  owner = g_weak_ref_get (&self->owner);
+  if (!owner)
+    return;
+
+  s = wfd_frame_pool_get_stats_structure (self);
+  gst_element_post_message (owner, gst_message_new_element (GST_OBJECT (owner), s));
+}
+
+static GstFlowReturn
+wfd_frame_pool_alloc_buffer (GstBufferPool             *pool,
+                             GstBuffer                **buffer,
+                             GstBufferPoolAcquireParams *params)
+{
+  WfdFramePool *self = WFD_FRAME_POOL (pool);
+  GstFlowReturn res;
+
+  res = GST_BUFFER_POOL_CLASS (wfd_frame_pool_parent_class)->alloc_buffer (pool, buffer, params);
+  if (res != GST_FLOW_OK)
+    return res;
+
+  g_mutex_lock (&self->lock);
+  self->allocated++;
+  g_mutex_unlock (&self->lock);
+
+#ifdef MADV_HUGEPAGE
+  if (self->hugepages)
+    {
+      GstMapInfo map;
+
+      /* The memory is aligned to the huge page size, so the kernel can
+       * back the whole frame with a handful of huge pages. */
+      if (gst_buffer_map (*buffer, &map, GST_MAP_READ))
+        {
+          if (madvise (map.data, map.size - map.size % HUGEPAGE_SIZE, MADV_HUGEPAGE) != 0)
+            g_debug ("WfdFramePool: madvise failed: %s", g_strerror (errno));
+          gst_buffer_unmap (*buffer, &map);
+        }
+    }
+#endif
+
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+wfd_frame_pool_acquire_buffer (GstBufferPool             *pool,
+                               GstBuffer                **buffer,
+                               GstBufferPoolAcquireParams *params)
+{
+  WfdFramePool *self = WFD_FRAME_POOL (pool);
+  GstFlowReturn res;
+  gboolean log_stats;
+
+  res = GST_BUFFER_POOL_CLASS (wfd_frame_pool_parent_class)->acquire_buffer (pool, buffer, params);
+  if (res != GST_FLOW_OK)
+    return res;
+
+  g_mutex_lock (&self->lock);
+  self->acquired++;
+  self->outstanding++;
+  self->peak_outstanding = MAX (self->peak_outstanding, self->outstanding);
+  log_stats = self->acquired % STATS_INTERVAL == 0;
+  g_mutex_unlock (&self->lock);
+
+  if (log_stats)
+    {
+      wfd_frame_pool_log_stats (self);
+      wfd_frame_pool_post_stats (self);
+    }
+
+  return GST_FLOW_OK;
+}
+
+static void
+wfd_frame_pool_release_buffer (GstBufferPool *pool,
+                               GstBuffer     *buffer)
+{
+  WfdFramePool *self = WFD_FRAME_POOL (pool);
+
+  g_mutex_lock (&self->lock);
+  if (self->outstanding > 0)
+    self->outstanding--;
+  g_mutex_unlock (&self->lock);
+
+  GST_BUFFER_POOL_CLASS (wfd_frame_pool_parent_class)->release_buffer (pool, buffer);
+}
+
+static void
+wfd_frame_pool_finalize (GObject *object)
+{
+  WfdFramePool *self = (WfdFramePool *) object;
+
+  wfd_frame_pool_log_stats (self);
+  g_weak_ref_clear (&self->owner);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (wfd_frame_pool_parent_class)->finalize (object);
+}
+
+static void
+wfd_frame_pool_class_init (WfdFramePoolClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GstBufferPoolClass *pool_class = GST_BUFFER_POOL_CLASS (klass);
+
+  object_class->finalize = wfd_frame_pool_finalize;
+
+  pool_class->alloc_buffer = wfd_frame_pool_alloc_buffer;
+  pool_class->acquire_buffer = wfd_frame_pool_acquire_buffer;
+  pool_class->release_buffer = wfd_frame_pool_release_buffer;
+}
+
+static void
+wfd_frame_pool_init (WfdFramePool *self)
+{
+  g_mutex_init (&self->lock);
+  g_weak_ref_init (&self->owner, NULL);
+
+  /* Opt-in, as it only helps if THP is set to "madvise" and costs up to
+   * 2 MiB of padding per frame. */
+  self->hugepages = g_getenv ("NETWORK_DISPLAYS_FRAME_POOL_HUGEPAGES") != NULL;
+}
+
+/**
+ * wfd_frame_pool_new:
+ * @name: the name of the pool
+ * @owner: (nullable): the element whose source pad the pool serves
+ *
+ * Every few hundred frames a "wfd-frame-pool" element message with the
+ * statistics is posted from @owner, see wfd_frame_pool_get_stats_structure().
+ *
+ * Returns: (transfer full): a new #WfdFramePool
+ */
+GstBufferPool *
+wfd_frame_pool_new (const gchar *name,
+                    GstElement  *owner)
+{
+  WfdFramePool *self;
+
+  self = g_object_new (WFD_TYPE_FRAME_POOL,
+                       "name", name,
+                       NULL);
+  g_weak_ref_set (&self->owner, owner);
+
+  return GST_BUFFER_POOL (self);
+}
+
+/**
+ * wfd_frame_pool_configure:
+ * @pool: a #WfdFramePool
+ * @caps: the raw video caps of the link
+ * @depth: the number of frames that can be in flight downstream
+ *
+ * Configures the pool to preallocate @depth frames. The pool is not
+ * capped, as encoders may hold on to more reference frames than they
+ * announce and a full pool would stall the capture. The queue depths
+ * bound the raw video in flight instead; misses show when they do not.
+ *
+ * Returns: #TRUE if the configuration was accepted
+ */
+gboolean
+wfd_frame_pool_configure (GstBufferPool *pool,
+                          GstCaps       *caps,
+                          guint          depth)
+{
+  WfdFramePool *self = WFD_FRAME_POOL (pool);
+  GstAllocationParams params;
+  GstStructure *config;
+  GstVideoInfo info;
+
+  if (!gst_video_info_from_caps (&info, caps))
+    return FALSE;
+
+  self->frame_size = GST_VIDEO_INFO_SIZE (&info);
+
+  gst_allocation_params_init (&params);
+  /* Cache line aligned for the SIMD code in videoscale and the encoders */
+  params.align = self->hugepages ? HUGEPAGE_SIZE - 1 : 63;
+
+  config = gst_buffer_pool_get_config (pool);
+  gst_buffer_pool_config_set_params (config, caps, self->frame_size, depth, 0);
+  gst_buffer_pool_config_set_allocator (config, NULL, &params);
+  gst_buffer_pool_config_add_option (config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+
+  return gst_buffer_pool_set_config (pool, config);
+}
+
+/**
+ * wfd_frame_pool_get_stats:
+ * @self: a #WfdFramePool
+ * @stats: (out): return location for the statistics
+ *
+ * A hit is a frame that was recycled, a miss one that had to be allocated.
+ */
+void
+wfd_frame_pool_get_stats (WfdFramePool      *self,
+                          WfdFramePoolStats *stats)
+{
+  g_mutex_lock (&self->lock);
+  stats->misses = self->allocated;
+  stats->hits = self->acquired - MIN (self->acquired, self->allocated);
+  stats->peak_bytes = self->peak_outstanding * self->frame_size;
+  g_mutex_unlock (&self->lock);
+}
+
+/**
+ * wfd_frame_pool_get_stats_structure:
+ * @self: a #WfdFramePool
+ *
+ * Returns: (transfer full): the statistics as a "wfd-frame-pool"
+ *   structure with the "name", "hits", "misses" and "peak-bytes" fields
+ */
+GstStructure *
+wfd_frame_pool_get_stats_structure (WfdFramePool *self)
+{
+  WfdFramePoolStats stats;
+
+  wfd_frame_pool_get_stats (self, &stats);
+
+  return gst_structure_new ("wfd-frame-pool",
+                            "name", G_TYPE_STRING, GST_OBJECT_NAME (self),
+                            "hits", G_TYPE_UINT64, stats.hits,
+                            "misses", G_TYPE_UINT64, stats.misses,
+                            "peak-bytes", G_TYPE_UINT64, (guint64) stats.peak_bytes,
+                            NULL);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <gst/video/video.h>
+
+G_BEGIN_DECLS
+
+#define WFD_TYPE_FRAME_POOL (wfd_frame_pool_get_type ())
+
+G_DECLARE_FINAL_TYPE (WfdFramePool, wfd_frame_pool, WFD, FRAME_POOL, GstVideoBufferPool)
+
+typedef struct
+{
+  guint64 hits;
+  guint64 misses;
+  gsize   peak_bytes;
+} WfdFramePoolStats;
+
+GstBufferPool *wfd_frame_pool_new (const gchar *name,
+                                   GstElement  *owner);
+
+gboolean       wfd_frame_pool_configure (GstBufferPool *pool,
+                                         GstCaps       *caps,
+                                         guint          depth);
+
+void           wfd_frame_pool_get_stats (WfdFramePool      *self,
+                                         WfdFramePoolStats *stats);
+GstStructure  *wfd_frame_pool_get_stats_structure (WfdFramePool *self);
+
+G_END_DECLS
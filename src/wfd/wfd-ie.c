@@ -0,0 +1,97 @@
+/* wfd-ie.c
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wfd-ie.h"
+
+/* Subelement IDs, see the Wi-Fi Display specification */
+#define WFD_SUBELEMENT_DEVICE_INFO 0
+
+#define WFD_DEVICE_INFO_TYPE_MASK          0x0003
+#define WFD_DEVICE_INFO_SESSION_MASK       0x0030
+#define WFD_DEVICE_INFO_SESSION_AVAILABLE  0x0010
+#define WFD_DEVICE_INFO_CONTENT_PROTECTION 0x0100
+#define WFD_DEVICE_INFO_NO_AUDIO           0x0400
+
+#define WFD_DEFAULT_RTSP_PORT 7236
+
+/**
+ * wfd_ie_parse:
+ * @data: the WFD subelements as announced by the peer
+ * @size: the length of @data
+ * @ie: (out caller-allocates): the decoded information
+ *
+ * Decodes the device information subelement. Unknown subelements are
+ * skipped, a truncated one ends parsing.
+ *
+ * Returns: %TRUE if the device information was found
+ */
+gboolean
+wfd_ie_parse (const guint8 *data,
+              gsize         size,
+              WfdIE        *ie)
+{
+  gboolean found = FALSE;
+  gsize pos = 0;
+
+  *ie = (WfdIE) {
+    .device_type = WFD_DEVICE_TYPE_PRIMARY_SINK,
+    .session_available = TRUE,
+    .rtsp_port = WFD_DEFAULT_RTSP_PORT,
+  };
+
+  /* Every subelement is a one byte ID and a two byte length */
+  while (data && pos + 3 <= size)
+    {
+      guint8 id = data[pos];
+      guint16 length = (data[pos + 1] << 8) | data[pos + 2];
+      const guint8 *body = data + pos + 3;
+
+      if (pos + 3 + length > size)
+        {
+          g_debug ("WfdIE: Subelement %u is truncated", id);
+          break;
+        }
+
+      if (id == WFD_SUBELEMENT_DEVICE_INFO && length >= 6)
+        {
+          guint16 info = (body[0] << 8) | body[1];
+
+          ie->device_type = info & WFD_DEVICE_INFO_TYPE_MASK;
+          ie->session_available = (info & WFD_DEVICE_INFO_SESSION_MASK) == WFD_DEVICE_INFO_SESSION_AVAILABLE;
+          ie->content_protection = !!(info & WFD_DEVICE_INFO_CONTENT_PROTECTION);
+          ie->audio_unsupported = !!(info & WFD_DEVICE_INFO_NO_AUDIO);
+          ie->rtsp_port = (body[2] << 8) | body[3];
+          ie->max_throughput_mbit = (body[4] << 8) | body[5];
+          found = TRUE;
+        }
+
+      pos += 3 + length;
+    }
+
+  return found;
+}
+
+/**
+ * wfd_ie_is_sink:
+ * @ie: a #WfdIE
+ *
+ * Returns: %TRUE if the device can receive a stream from us
+ */
+gboolean
+wfd_ie_is_sink (const WfdIE *ie)
+{
+  return ie->device_type != WFD_DEVICE_TYPE_SOURCE;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  WFD_DEVICE_TYPE_SOURCE         = 0,
+  WFD_DEVICE_TYPE_PRIMARY_SINK   = 1,
+  WFD_DEVICE_TYPE_SECONDARY_SINK = 2,
+  WFD_DEVICE_TYPE_DUAL_ROLE      = 3,
+} WfdDeviceType;
+
+/* What a peer announces about itself in its WFD information elements */
+typedef struct
+{
+  WfdDeviceType device_type;
+  gboolean      session_available;
+  gboolean      content_protection;
+  gboolean      audio_unsupported;
+  guint16       rtsp_port;
+  /* Maximum average throughput the device supports, 0 if unknown */
+  guint16       max_throughput_mbit;
+} WfdIE;
+
+gboolean wfd_ie_parse (const guint8 *data,
+                       gsize         size,
+                       WfdIE        *ie);
+gboolean wfd_ie_is_sink (const WfdIE *ie);
+
+G_END_DECLS
@@ -1,6 +1,11 @@
 #include "deepin-network-displays-config.h"
+#include "wfd-capture-scheduler.h"
+#include "wfd-frame-pool.h"
 #include "wfd-media-factory.h"
 #include "wfd-media.h"
+#include "wfd-pacer.h"
+#include <gst/base/gstaggregator.h>
+#include <gst/video/video.h>
 
 
 typedef enum {
@@ -46,6 +51,25 @@ typedef struct
   GstSegment *segment;
 } QOSData;
 
+/* Raw frames waiting in the mailbox in front of the encoder */
+#define PRE_ENCODER_QUEUE_DEPTH 1
+
+/* A static screen is still refreshed this often so the sink does not
+ * consider the stream stalled. */
+#define MAX_REPEAT_INTERVAL (500 * GST_MSECOND)
+
+/* Congestion watermarks of the encoded video in front of the mux */
+#define CONGESTION_HIGH_WATERMARK (150 * GST_MSECOND)
+#define CONGESTION_LOW_WATERMARK (50 * GST_MSECOND)
+
+/* How long the live mux waits for a stream before sending without it */
+#define MUX_LATENCY (20 * GST_MSECOND)
+
+/* Used until a client configured the media, and for encoders that need it */
+#define SAFE_LATENCY (500 * GST_MSECOND)
+/* What we aim for end to end with screen content */
+#define TARGET_END_TO_END_LATENCY (100 * GST_MSECOND)
+
 enum {
   SIGNAL_CREATE_SOURCE,
   SIGNAL_CREATE_AUDIO_SOURCE,
@@ -130,22 +154,796 @@ free_qos_data (QOSData *qos_data)
   g_free (qos_data);
 }
 
+typedef struct
+{
+  WfdResolution resolution;
+  guint32       bitrate_kbit;
+} WfdSimulcastRung;
+
+/* Ordered from best to worst, the first entry is what a single sink gets
+ * when simulcast is disabled. */
+static const WfdSimulcastRung simulcast_ladder[] = {
+  { { 1920, 1080, 30, FALSE }, 512 * 8 },
+  { { 1280, 720, 30, FALSE }, 256 * 8 },
+  { { 640, 480, 60, FALSE }, 128 * 8 },
+};
+
+typedef struct
+{
+  guint          index;
+  /* Number of clients receiving the rung, modified atomically */
+  gint           users;
+  /* Number of those clients that paused or are in standby */
+  gint           suspended;
+  gboolean       primed;
+  gboolean       configured;
+  gboolean       audio;
+  WfdMediaQuirks quirks;
+
+  /* Feeds the encoder with the newest frame at its cadence */
+  WfdCaptureScheduler *scheduler;
+
+  /* Smoothes the packets leaving the payloader */
+  WfdPacer      *pacer;
+
+  /* Mux queue congestion, only used from the encoder thread */
+  gboolean       congested;
+  gboolean       recovery_requested;
+
+  /* Buffers that went into and out of the mux queue. Everything up to
+   * trim_until was queued when congestion set in and is discarded as it
+   * leaves the queue. Shared with the queue thread. */
+  GMutex         trim_lock;
+  guint64        congestion_drops;
+  guint64        queued_in;
+  guint64        queued_out;
+  guint64        trim_until;
+  guint64        trimmed;
+
+  /* Decoding and rendering latency announced by the sink */
+  GstClockTime   sink_latency;
+
+  /* What the encoder was configured for, and what the ladder and the
+   * link would have allowed */
+  guint          bitrate_kbit;
+  guint          planned_kbit;
+} WfdRung;
+
+static guint
+wfd_get_n_rungs (void)
+{
+  /* Encoding more than one stream costs CPU (or GPU) time even if nobody
+   * watches the extra rungs, so only do it if requested. */
+  if (g_getenv ("NETWORK_DISPLAYS_SIMULCAST"))
+    return G_N_ELEMENTS (simulcast_ladder);
+
+  return 1;
+}
+
+/* Capture fast enough for the fastest rung, the others drop frames */
+static gint
+wfd_get_capture_rate (void)
+{
+  gint rate = 0;
+  guint i;
+
+  for (i = 0; i < wfd_get_n_rungs (); i++)
+    rate = MAX (rate, simulcast_ladder[i].resolution.refresh_rate);
+
+  return rate;
+}
+
+static guint
+wfd_get_rung_index (const WfdResolution *resolution)
+{
+  guint i;
+
+  for (i = 0; i < wfd_get_n_rungs (); i++)
+    {
+      const WfdResolution *rung = &simulcast_ladder[i].resolution;
+
+      if (rung->width == resolution->width &&
+          rung->height == resolution->height &&
+          rung->refresh_rate == resolution->refresh_rate)
+        return i;
+    }
+
+  return 0;
+}
+
+static WfdRung *
+wfd_media_element_get_rung (GstBin *bin, const WfdResolution *resolution)
+{
+  GPtrArray *rungs;
+  guint idx;
+
+  rungs = g_object_get_data (G_OBJECT (bin), "wfd-rungs");
+  if (!rungs)
+    return NULL;
+
+  idx = wfd_get_rung_index (resolution);
+  if (idx >= rungs->len)
+    return NULL;
+
+  return g_ptr_array_index (rungs, idx);
+}
+
+static GstElement *
+make_rung_element (const gchar *factory, const gchar *name, guint idx)
+{
+  g_autofree gchar *full_name = g_strdup_printf ("%s-%u", name, idx);
+
+  return gst_element_factory_make (factory, full_name);
+}
+
+/* Whether any client of the rung actually shows the stream */
+static gboolean
+wfd_rung_is_watched (WfdRung *rung)
+{
+  return g_atomic_int_get (&rung->users) > g_atomic_int_get (&rung->suspended);
+}
+
+static const gchar *
+wfd_encoder_get_name (GstElement *encoder)
+{
+  GstElementFactory *factory;
+
+  if (!encoder)
+    return NULL;
+
+  factory = gst_element_get_factory (encoder);
+  if (!factory)
+    return NULL;
+
+  return gst_plugin_feature_get_name (GST_PLUGIN_FEATURE (factory));
+}
+
+static GstElement *
+get_rung_element (GstBin *bin, const gchar *name, guint idx)
+{
+  g_autofree gchar *full_name = g_strdup_printf ("%s-%u", name, idx);
+
+  return gst_bin_get_by_name (bin, full_name);
+}
+
+/**
+ * wfd_simulcast_pick_resolution:
+ * @codec: the #WfdVideoCodec selected for the sink
+ * @bandwidth_kbit: the estimated link capacity, or 0 if unknown
+ *
+ * Picks the best rung of the simulcast ladder that the sink can decode and
+ * that fits into the available bandwidth. If nothing fits, the lowest rung
+ * is used.
+ *
+ * Returns: (transfer full): the resolution to stream to the sink
+ */
+WfdResolution *
+wfd_simulcast_pick_resolution (WfdVideoCodec *codec, guint32 bandwidth_kbit)
+{
+  const WfdSimulcastRung *rung = NULL;
+  guint n_rungs = wfd_get_n_rungs ();
+  guint i;
+
+  for (i = 0; i < n_rungs; i++)
+    {
+      if (codec && !wfd_video_codec_supports_resolution (codec, &simulcast_ladder[i].resolution))
+        continue;
+
+      if (bandwidth_kbit > 0 && simulcast_ladder[i].bitrate_kbit > bandwidth_kbit)
+        continue;
+
+      rung = &simulcast_ladder[i];
+      break;
+    }
+
+  /* Fall back to the cheapest stream we have */
+  if (!rung)
+    rung = &simulcast_ladder[n_rungs - 1];
+
+  return wfd_resolution_copy ((WfdResolution *) &rung->resolution);
+}
+
+/**
+ * wfd_simulcast_get_stream_id:
+ * @resolution: a resolution returned by wfd_simulcast_pick_resolution()
+ *
+ * Returns: the RTSP stream ID of the rung encoding @resolution
+ */
+guint
+wfd_simulcast_get_stream_id (const WfdResolution *resolution)
+{
+  return wfd_get_rung_index (resolution);
+}
+
+static gpointer
+parse_multicast_group (gpointer data)
+{
+  g_autoptr(GInetAddress) addr = NULL;
+  const gchar *group;
+
+  group = g_getenv ("NETWORK_DISPLAYS_MULTICAST_GROUP");
+  if (!group || *group == '\0')
+    return NULL;
+
+  addr = g_inet_address_new_from_string (group);
+  if (!addr || !g_inet_address_get_is_multicast (addr))
+    {
+      g_warning ("WfdMediaFactory: %s is not a multicast address, using unicast", group);
+      return NULL;
+    }
+
+  return g_strdup (group);
+}
+
+/**
+ * wfd_multicast_get_group:
+ *
+ * Multicast delivery is opt-in through NETWORK_DISPLAYS_MULTICAST_GROUP.
+ * The RTSP control connection stays per client, but the RTP packets of
+ * every stream are sent once to the group no matter how many sinks joined.
+ * The variable is only read on the first call.
+ *
+ * Returns: the multicast group, or %NULL if multicast is disabled
+ */
+const gchar *
+wfd_multicast_get_group (void)
+{
+  static GOnce group_once = G_ONCE_INIT;
+
+  return g_once (&group_once, parse_multicast_group, NULL);
+}
+
+/**
+ * wfd_multicast_get_port:
+ * @stream_id: the stream ID of the rung
+ *
+ * Every stream gets its own RTP/RTCP port pair, starting at
+ * NETWORK_DISPLAYS_MULTICAST_PORT (16384 by default).
+ *
+ * Returns: the RTP port of the stream, or 0 if multicast is disabled
+ */
+guint
+wfd_multicast_get_port (guint stream_id)
+{
+  const gchar *port_str;
+  guint port = 16384;
+
+  if (!wfd_multicast_get_group ())
+    return 0;
+
+  port_str = g_getenv ("NETWORK_DISPLAYS_MULTICAST_PORT");
+  if (port_str)
+    port = g_ascii_strtoull (port_str, NULL, 10);
+
+  /* RTP wants an even port with RTCP on the next one */
+  port &= ~1;
+  if (port == 0 || port + 2 * stream_id + 1 > G_MAXUINT16)
+    {
+      g_warning ("WfdMediaFactory: Invalid multicast port %s, using 16384", port_str);
+      port = 16384;
+    }
+
+  return port + 2 * stream_id;
+}
+
+static void
+wfd_media_factory_setup_multicast (GstRTSPStream *stream, guint stream_id)
+{
+  g_autoptr(GstRTSPAddressPool) pool = NULL;
+  const gchar *group = wfd_multicast_get_group ();
+  guint port = wfd_multicast_get_port (stream_id);
+
+  if (!group)
+    return;
+
+  /* A pool per stream with exactly one address, so that the port the
+   * sinks are told about during M4 is the one the stream really uses. */
+  pool = gst_rtsp_address_pool_new ();
+  if (!gst_rtsp_address_pool_add_range (pool, group, group, port, port + 1, 1))
+    {
+      g_warning ("WfdMediaFactory: Cannot use multicast group %s:%u", group, port);
+      return;
+    }
+
+  gst_rtsp_stream_set_address_pool (stream, pool);
+  gst_rtsp_stream_set_multicast_iface (stream, g_getenv ("NETWORK_DISPLAYS_MULTICAST_IFACE"));
+
+  g_debug ("WfdMediaFactory: Stream %u is sent to %s:%u", stream_id, group, port);
+}
+
+/* Every captured frame is numbered with a reference timestamp meta. It is
+ * copied along when intervideosrc repeats the frame, while a new frame
+ * gets a new number even if the source reused the memory of an old one. */
+static GstStaticCaps capture_sequence_caps = GST_STATIC_CAPS ("timestamp/x-wfd-capture-sequence");
+
+static GstPadProbeReturn
+capture_sequence_probe_cb (GstPad          *pad,
+                           GstPadProbeInfo *info,
+                           gpointer         user_data)
+{
+  guint64 *sequence = user_data;
+  g_autoptr(GstCaps) caps = gst_static_caps_get (&capture_sequence_caps);
+  GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+
+  buf = gst_buffer_make_writable (buf);
+  gst_buffer_add_reference_timestamp_meta (buf, caps, ++(*sequence), GST_CLOCK_TIME_NONE);
+  GST_PAD_PROBE_INFO_DATA (info) = buf;
+
+  return GST_PAD_PROBE_OK;
+}
+
+static guint64
+get_capture_sequence (GstBuffer *buf)
+{
+  g_autoptr(GstCaps) caps = gst_static_caps_get (&capture_sequence_caps);
+  GstReferenceTimestampMeta *meta;
+
+  meta = gst_buffer_get_reference_timestamp_meta (buf, caps);
+
+  return meta ? meta->timestamp : 0;
+}
+
+/**
+ * wfd_source_governor_new:
+ * @variable_framerate: whether the capture source only supports a maximum
+ *   framerate (pipewiresrc) instead of a fixed one (ximagesrc)
+ *
+ * Creates a capsfilter to be placed directly behind the capture element of
+ * the video source. The media factory pushes the framerate of the streams
+ * that are being watched into it, so that frames which would be dropped
+ * later are never captured or copied in the first place.
+ *
+ * Returns: (transfer floating): the governor element
+ */
 GstElement *
-wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl *url)
+wfd_source_governor_new (gboolean variable_framerate)
+{
+  g_autoptr(GstPad) src = NULL;
+  GstElement *governor;
+
+  governor = gst_element_factory_make ("capsfilter", "wfd-source-governor");
+  g_object_set_data (G_OBJECT (governor), "wfd-variable-framerate", GINT_TO_POINTER (variable_framerate));
+
+  src = gst_element_get_static_pad (governor, "src");
+  gst_pad_add_probe (src,
+                     GST_PAD_PROBE_TYPE_BUFFER,
+                     capture_sequence_probe_cb,
+                     g_new0 (guint64, 1),
+                     g_free);
+
+  return governor;
+}
+
+static void
+wfd_media_element_update_governor (GstBin *bin)
+{
+  g_autoptr(GstElement) governor = NULL;
+  g_autoptr(GstCaps) caps = NULL;
+  GPtrArray *rungs;
+  gint rate = 0;
+  gint rate_all = 0;
+  guint i;
+
+  governor = gst_bin_get_by_name (bin, "wfd-source-governor");
+  rungs = g_object_get_data (G_OBJECT (bin), "wfd-rungs");
+  if (!governor || !rungs)
+    return;
+
+  for (i = 0; i < rungs->len; i++)
+    {
+      WfdRung *rung = g_ptr_array_index (rungs, i);
+      gint refresh_rate = simulcast_ladder[rung->index].resolution.refresh_rate;
+
+      rate_all = MAX (rate_all, refresh_rate);
+      if (wfd_rung_is_watched (rung))
+        rate = MAX (rate, refresh_rate);
+    }
+
+  /* While nobody is watching, capture fast enough for any rung */
+  if (rate == 0)
+    rate = rate_all;
+
+  if (GPOINTER_TO_INT (g_object_get_data (G_OBJECT (governor), "wfd-governor-rate")) == rate)
+    return;
+
+  if (g_object_get_data (G_OBJECT (governor), "wfd-variable-framerate"))
+    caps = gst_caps_new_simple ("video/x-raw",
+                                "max-framerate", GST_TYPE_FRACTION_RANGE, 1, 1, rate, 1,
+                                NULL);
+  else
+    caps = gst_caps_new_simple ("video/x-raw",
+                                "framerate", GST_TYPE_FRACTION, rate, 1,
+                                NULL);
+
+  g_debug ("WfdMediaFactory: Limiting capture to %d fps", rate);
+  g_object_set (governor,
+                "caps", caps,
+                NULL);
+  g_object_set_data (G_OBJECT (governor), "wfd-governor-rate", GINT_TO_POINTER (rate));
+}
+
+static gboolean
+wfd_media_element_has_audio (GstBin *bin)
+{
+  GPtrArray *rungs;
+  guint i;
+
+  rungs = g_object_get_data (G_OBJECT (bin), "wfd-rungs");
+  for (i = 0; rungs && i < rungs->len; i++)
+    {
+      WfdRung *rung = g_ptr_array_index (rungs, i);
+
+      if (rung->audio)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static GstPadProbeReturn
+rung_idle_probe_cb (GstPad          *pad,
+                    GstPadProbeInfo *info,
+                    gpointer         user_data)
+{
+  WfdRung *rung = user_data;
+
+  /* Let the first frame through so that the stream can preroll, after
+   * that don't spend any time on a rung nobody is watching. */
+  if (!rung->primed)
+    {
+      rung->primed = TRUE;
+      return GST_PAD_PROBE_OK;
+    }
+
+  if (!wfd_rung_is_watched (rung))
+    return GST_PAD_PROBE_DROP;
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+rung_audio_probe_cb (GstPad          *pad,
+                     GstPadProbeInfo *info,
+                     gpointer         user_data)
+{
+  WfdRung *rung = user_data;
+
+  if (!rung->audio || !wfd_rung_is_watched (rung))
+    return GST_PAD_PROBE_DROP;
+
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean
+link_tee_to_rung (GstElement        *tee,
+                  GstElement        *sink,
+                  GstPadProbeCallback probe,
+                  WfdRung           *rung)
+{
+  g_autoptr(GstPad) tee_src = NULL;
+  g_autoptr(GstPad) sink_pad = NULL;
+
+  tee_src = gst_element_get_request_pad (tee, "src_%u");
+  sink_pad = gst_element_get_static_pad (sink, "sink");
+
+  gst_pad_add_probe (tee_src,
+                     GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+                     probe,
+                     rung,
+                     NULL);
+
+  return gst_pad_link (tee_src, sink_pad) == GST_PAD_LINK_OK;
+}
+
+static GstPadProbeReturn
+frame_pool_allocation_probe_cb (GstPad          *pad,
+                                GstPadProbeInfo *info,
+                                gpointer         user_data)
+{
+  g_autoptr(GstBufferPool) pool = NULL;
+  g_autofree gchar *name = NULL;
+  GstElement *element;
+  GstStructure *config;
+  GstQuery *query;
+  GstCaps *caps;
+  gboolean need_pool;
+  guint depth = GPOINTER_TO_UINT (user_data);
+  guint size, min_buffers, max_buffers;
+
+  /* Only look at the answer of downstream */
+  if (!(GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_PULL))
+    return GST_PAD_PROBE_OK;
+
+  query = GST_PAD_PROBE_INFO_QUERY (info);
+  if (GST_QUERY_TYPE (query) != GST_QUERY_ALLOCATION)
+    return GST_PAD_PROBE_OK;
+
+  gst_query_parse_allocation (query, &caps, &need_pool);
+  if (!caps)
+    return GST_PAD_PROBE_OK;
+
+  /* Keep whatever downstream proposed, e.g. VA surfaces for vaapipostproc */
+  if (gst_query_get_n_allocation_pools (query) > 0)
+    return GST_PAD_PROBE_OK;
+
+  element = GST_PAD_PARENT (pad);
+  name = g_strdup_printf ("%s-pool", GST_OBJECT_NAME (element));
+  pool = wfd_frame_pool_new (name, element);
+  if (!wfd_frame_pool_configure (pool, caps, depth))
+    return GST_PAD_PROBE_OK;
+
+  /* For wfd_media_element_get_stats() */
+  g_object_set_data_full (G_OBJECT (element), "wfd-frame-pool",
+                          gst_object_ref (pool), gst_object_unref);
+
+  config = gst_buffer_pool_get_config (pool);
+  gst_buffer_pool_config_get_params (config, NULL, &size, &min_buffers, &max_buffers);
+  gst_structure_free (config);
+
+  g_debug ("WfdMediaFactory: Providing %u-%u frame pool on %s", min_buffers, max_buffers, name);
+  gst_query_add_allocation_pool (query, pool, size, min_buffers, max_buffers);
+  if (!gst_query_find_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL))
+    gst_query_add_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Hands out preallocated frames on the raw video link leaving @element.
+ * The @depth is the number of frames that may be in flight downstream
+ * (queued, being processed and held as reference by the encoder). */
+static void
+wfd_media_element_add_frame_pool (GstElement *element, guint depth)
+{
+  g_autoptr(GstPad) srcpad = NULL;
+
+  srcpad = gst_element_get_static_pad (element, "src");
+  gst_pad_add_probe (srcpad,
+                     GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
+                     frame_pool_allocation_probe_cb,
+                     GUINT_TO_POINTER (depth),
+                     NULL);
+}
+
+static GstPadProbeReturn
+encoded_probe_cb (GstPad          *pad,
+                  GstPadProbeInfo *info,
+                  gpointer         user_data)
+{
+  WfdRung *rung = user_data;
+  GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+
+  wfd_capture_scheduler_encoded (rung->scheduler, GST_BUFFER_PTS (buf));
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+wfd_rung_free (WfdRung *rung)
+{
+  g_clear_object (&rung->scheduler);
+  g_clear_pointer (&rung->pacer, wfd_pacer_free);
+  g_mutex_clear (&rung->trim_lock);
+  g_free (rung);
+}
+
+static gboolean
+wfd_mpegtsmux_is_live (void)
+{
+  g_autoptr(GstElementFactory) factory = NULL;
+  g_autoptr(GstPluginFeature) loaded = NULL;
+  GType type;
+
+  factory = gst_element_factory_find ("mpegtsmux");
+  if (!factory)
+    return FALSE;
+
+  loaded = gst_plugin_feature_load (GST_PLUGIN_FEATURE (factory));
+  if (!loaded)
+    return FALSE;
+
+  type = gst_element_factory_get_element_type (GST_ELEMENT_FACTORY (loaded));
+
+  return g_type_is_a (type, GST_TYPE_AGGREGATOR);
+}
+
+typedef struct
+{
+  guint64      last_sequence;
+  GstClockTime last_pts;
+} RepeatFilter;
+
+static GstPadProbeReturn
+repeat_filter_probe_cb (GstPad          *pad,
+                        GstPadProbeInfo *info,
+                        gpointer         user_data)
+{
+  RepeatFilter *filter = user_data;
+  GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+  guint64 sequence;
+
+  /* intervideosrc repeats the last captured frame at its framerate, e.g.
+   * when pipewire does not deliver anything because the screen is static.
+   * The repeated frames carry the capture sequence number of the original
+   * (see wfd_source_governor_new()), don't convert and encode them again,
+   * except now and then to keep the sink happy. Frames that were not
+   * numbered (e.g. test sources) are never considered repeats. */
+  sequence = get_capture_sequence (buf);
+  if (sequence != 0 && sequence == filter->last_sequence &&
+      GST_CLOCK_TIME_IS_VALID (filter->last_pts) &&
+      GST_CLOCK_TIME_IS_VALID (GST_BUFFER_PTS (buf)) &&
+      GST_BUFFER_PTS (buf) < filter->last_pts + MAX_REPEAT_INTERVAL)
+    return GST_PAD_PROBE_DROP;
+
+  filter->last_sequence = sequence;
+  filter->last_pts = GST_BUFFER_PTS (buf);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Frames dropped on the way into the mux queue plus those trimmed from it */
+static guint64
+wfd_rung_get_drops (WfdRung *rung)
+{
+  guint64 drops;
+
+  g_mutex_lock (&rung->trim_lock);
+  drops = rung->congestion_drops + rung->trimmed;
+  g_mutex_unlock (&rung->trim_lock);
+
+  return drops;
+}
+
+static GstStructure *
+get_congestion_structure (GstElement *queue, WfdRung *rung)
+{
+  guint64 level_time;
+  guint level_buffers;
+
+  g_object_get (queue,
+                "current-level-time", &level_time,
+                "current-level-buffers", &level_buffers,
+                NULL);
+
+  return gst_structure_new ("wfd-congestion",
+                            "rung", G_TYPE_UINT, rung->index,
+                            "congested", G_TYPE_BOOLEAN, rung->congested,
+                            "level-time", G_TYPE_UINT64, level_time,
+                            "level-buffers", G_TYPE_UINT, level_buffers,
+                            "drops", G_TYPE_UINT64, wfd_rung_get_drops (rung),
+                            NULL);
+}
+
+static void
+post_congestion_message (GstElement *queue, WfdRung *rung)
+{
+  GstStructure *s = get_congestion_structure (queue, rung);
+
+  gst_element_post_message (queue, gst_message_new_element (GST_OBJECT (queue), s));
+}
+
+/* Discards the backlog that was queued when congestion set in. The queue
+ * is FIFO, so counting the buffers on both sides identifies them. */
+static GstPadProbeReturn
+congestion_trim_probe_cb (GstPad          *pad,
+                          GstPadProbeInfo *info,
+                          gpointer         user_data)
+{
+  WfdRung *rung = user_data;
+  gboolean drop;
+
+  g_mutex_lock (&rung->trim_lock);
+  rung->queued_out++;
+  drop = rung->queued_out <= rung->trim_until;
+  if (drop)
+    rung->trimmed++;
+  g_mutex_unlock (&rung->trim_lock);
+
+  return drop ? GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+congestion_probe_cb (GstPad          *pad,
+                     GstPadProbeInfo *info,
+                     gpointer         user_data)
+{
+  WfdRung *rung = user_data;
+  GstElement *queue = GST_PAD_PARENT (pad);
+  GstBuffer *buf;
+  gboolean keyframe;
+  guint64 level;
+
+  /* A flush empties the queue, start counting afresh */
+  if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_EVENT_FLUSH)
+    {
+      if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_FLUSH_STOP)
+        {
+          g_mutex_lock (&rung->trim_lock);
+          rung->queued_in = rung->queued_out = rung->trim_until = 0;
+          g_mutex_unlock (&rung->trim_lock);
+        }
+      return GST_PAD_PROBE_OK;
+    }
+
+  buf = GST_PAD_PROBE_INFO_BUFFER (info);
+  keyframe = !GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT);
+
+  g_object_get (queue, "current-level-time", &level, NULL);
+
+  if (!rung->congested && level > CONGESTION_HIGH_WATERMARK)
+    {
+      /* The network cannot keep up. The queued frames are stale by now,
+       * so throw away the whole backlog (oldest GOP first) rather than
+       * the new frames. Every frame depends on the previous one (no
+       * B-frames), so nothing new goes in either until a new keyframe
+       * restarts the stream. */
+      g_debug ("WfdMediaFactory: Rung %u is congested with %" G_GUINT64_FORMAT " ms queued, trimming the queue",
+               rung->index, level / GST_MSECOND);
+      g_mutex_lock (&rung->trim_lock);
+      rung->trim_until = rung->queued_in;
+      g_mutex_unlock (&rung->trim_lock);
+
+      rung->congested = TRUE;
+      rung->recovery_requested = FALSE;
+      post_congestion_message (queue, rung);
+    }
+
+  if (rung->congested)
+    {
+      if (keyframe && level < CONGESTION_LOW_WATERMARK)
+        {
+          g_debug ("WfdMediaFactory: Rung %u recovered after %" G_GUINT64_FORMAT " dropped frames",
+                   rung->index, wfd_rung_get_drops (rung));
+          rung->congested = FALSE;
+          post_congestion_message (queue, rung);
+        }
+      else
+        {
+          /* Without IDR support we wait for the next regular keyframe */
+          if (level < CONGESTION_LOW_WATERMARK &&
+              !rung->recovery_requested && !(rung->quirks & WFD_QUIRK_NO_IDR))
+            {
+              gst_pad_push_event (pad, gst_video_event_new_upstream_force_key_unit (GST_CLOCK_TIME_NONE, TRUE, 0));
+              rung->recovery_requested = TRUE;
+            }
+
+          g_mutex_lock (&rung->trim_lock);
+          rung->congestion_drops++;
+          g_mutex_unlock (&rung->trim_lock);
+
+          return GST_PAD_PROBE_DROP;
+        }
+    }
+
+  g_mutex_lock (&rung->trim_lock);
+  rung->queued_in++;
+  g_mutex_unlock (&rung->trim_lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean
+wfd_media_factory_create_rung (WfdMediaFactory *self,
+                               GstBin          *bin,
+                               GstElement      *tee,
+                               WfdRung         *rung)
 {
-  g_autoptr(GstBin) bin = NULL;
   g_autoptr(GstCaps) caps = NULL;
-  g_autoptr(GstBin) audio_pipeline = NULL;
   g_autoptr(GstPad) encoding_perf_sink = NULL;
-  WfdMediaFactory *self = WFD_MEDIA_FACTORY (factory);
+  g_autoptr(GstPad) encoding_perf_src = NULL;
+  g_autoptr(GstPad) congestion_sink = NULL;
+  g_autoptr(GstPad) congestion_src = NULL;
+  g_autoptr(GstPad) payloader_src = NULL;
+  g_autofree gchar *scheduler_name = NULL;
+  g_autofree gchar *payloader_name = NULL;
+  const WfdResolution *resolution = &simulcast_ladder[rung->index].resolution;
+  guint idx = rung->index;
   QOSData *qos_data;
 
-  g_autoptr(GstElement) source = NULL;
-  g_autoptr(GstElement) audio_source = NULL;
+  GstElement *mailbox;
+  GstElement *encoder_src;
   GstElement *scale;
+  GstElement *rate;
   GstElement *sizefilter;
-  GstElement *convert;
-  GstElement *queue_pre_encoder;
   GstElement *encoder;
   GstElement *encoder_elem;
   GstElement *encoding_perf;
@@ -157,48 +955,59 @@ wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl
   GstElement *payloader;
   gboolean success = TRUE;
 
-  bin = GST_BIN (gst_bin_new ("wfd-encoder-bin"));
-
-  /* Test input, will be replaced by real source */
-  g_signal_emit (self, signals[SIGNAL_CREATE_SOURCE], 0, &source);
-  g_assert (source);
-  success &= gst_bin_add (bin, source);
-
-  scale = gst_element_factory_make ("videoscale", "wfd-scale");
+  /* Latest frame wins: captured frames wait in a one frame mailbox and
+   * the scheduler hands the newest one to the encoder just in time for
+   * the next frame slot. Stale frames are dropped instead of blocking the
+   * capture, which keeps the latency low when the encoder stalls. */
+  mailbox = make_rung_element ("appsink", "wfd-pre-encoder-mailbox", idx);
+  success &= gst_bin_add (bin, mailbox);
+  encoder_src = make_rung_element ("appsrc", "wfd-pre-encoder-src", idx);
+  success &= gst_bin_add (bin, encoder_src);
+
+  scheduler_name = g_strdup_printf ("wfd-scheduler-%u", idx);
+  rung->scheduler = wfd_capture_scheduler_new (scheduler_name,
+                                               mailbox,
+                                               encoder_src,
+                                               resolution->refresh_rate);
+
+  scale = make_rung_element ("videoscale", "wfd-scale", idx);
   g_object_set (scale,
                 "qos", TRUE,
                 NULL);
   success &= gst_bin_add (bin, scale);
+  /* Scaled frames only go into the encoder */
+  wfd_media_element_add_frame_pool (scale, 2);
+
+  /* The rungs do not all run at the capture rate (480p60 next to 1080p30),
+   * so duplicate or drop frames to reach the rate of the rung. */
+  rate = make_rung_element ("videorate", "wfd-rate", idx);
+  g_object_set (rate,
+                "skip-to-first", TRUE,
+                NULL);
+  /* Don't fill a long idle period with duplicates once the screen
+   * changes again (variable framerate capture) */
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (rate), "max-duplication-time"))
+    g_object_set (rate,
+                  "max-duplication-time", (guint64) GST_SECOND,
+                  NULL);
+  success &= gst_bin_add (bin, rate);
 
   caps = gst_caps_new_simple ("video/x-raw",
-                              "framerate", GST_TYPE_FRACTION, 30, 1,
-                              "width", G_TYPE_INT, 1920,
-                              "height", G_TYPE_INT, 1080,
+                              "framerate", GST_TYPE_FRACTION, resolution->refresh_rate, 1,
+                              "width", G_TYPE_INT, resolution->width,
+                              "height", G_TYPE_INT, resolution->height,
                               NULL);
-  sizefilter = gst_element_factory_make ("capsfilter", "wfd-sizefilter");
+  sizefilter = make_rung_element ("capsfilter", "wfd-sizefilter", idx);
   success &= gst_bin_add (bin, sizefilter);
   g_object_set (sizefilter,
                 "caps", caps,
                 NULL);
   g_clear_pointer (&caps, gst_caps_unref);
 
-  convert = gst_element_factory_make ("videoconvert", "wfd-videoconvert");
-  g_object_set (convert,
-                "qos", TRUE,
-                NULL);
-  success &= gst_bin_add (bin, convert);
-
-  queue_pre_encoder = gst_element_factory_make ("queue", "wfd-pre-encoder-queue");
-  g_object_set (queue_pre_encoder,
-                "max-size-buffers", (guint) 1,
-                "leaky", 0,
-                NULL);
-  success &= gst_bin_add (bin, queue_pre_encoder);
-
   switch (self->encoder)
     {
     case ENCODER_OPENH264:
-      encoder = gst_element_factory_make ("openh264enc", "wfd-encoder");
+      encoder = make_rung_element ("openh264enc", "wfd-encoder", idx);
       encoder_elem = encoder;
       success &= gst_bin_add (bin, encoder);
       g_object_set (encoder,
@@ -225,7 +1034,7 @@ wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl
       break;
 
     case ENCODER_X264:
-      encoder = gst_element_factory_make ("x264enc", "wfd-encoder");
+      encoder = make_rung_element ("x264enc", "wfd-encoder", idx);
       encoder_elem = encoder;
       success &= gst_bin_add (bin, encoder);
 
@@ -234,15 +1043,17 @@ wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl
 
     case ENCODER_VAAPIH264:
       {
+        g_autofree gchar *name = NULL;
         GstElement *vaapi_encoder;
         GstElement *vaapi_convert;
 
-        encoder = gst_bin_new ("wfd-encoder-bin");
+        name = g_strdup_printf ("wfd-vaapi-bin-%u", idx);
+        encoder = gst_bin_new (name);
 
-        vaapi_convert = gst_element_factory_make ("vaapipostproc", "wfd-vaapi-convert");
+        vaapi_convert = make_rung_element ("vaapipostproc", "wfd-vaapi-convert", idx);
         success &= gst_bin_add (GST_BIN (encoder), vaapi_convert);
 
-        vaapi_encoder = gst_element_factory_make ("vaapih264enc", "wfd-encoder");
+        vaapi_encoder = make_rung_element ("vaapih264enc", "wfd-encoder", idx);
         encoder_elem = vaapi_encoder;
         success &= gst_bin_add (GST_BIN (encoder), vaapi_encoder);
 
@@ -279,7 +1090,7 @@ wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl
     }
   g_object_set_data (G_OBJECT (encoder_elem), "wfd-encoder-impl", GINT_TO_POINTER (self->encoder));
 
-  encoding_perf = gst_element_factory_make ("identity", "wfd-measure-encoder-realtime");
+  encoding_perf = make_rung_element ("identity", "wfd-measure-encoder-realtime", idx);
   success &= gst_bin_add (bin, encoding_perf);
   qos_data = g_new0 (QOSData, 1);
   g_object_set_data_full (G_OBJECT (encoding_perf), "wfd-qos-data", qos_data, (GDestroyNotify) free_qos_data);
@@ -290,9 +1101,15 @@ wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl
                      encoding_perf_probe_cb,
                      qos_data,
                      NULL);
+  encoding_perf_src = gst_element_get_static_pad (encoding_perf, "src");
+  gst_pad_add_probe (encoding_perf_src,
+                     GST_PAD_PROBE_TYPE_BUFFER,
+                     encoded_probe_cb,
+                     rung,
+                     NULL);
 
   /* Repack the H264 stream */
-  parse = gst_element_factory_make ("h264parse", "wfd-h264parse");
+  parse = make_rung_element ("h264parse", "wfd-h264parse", idx);
   success &= gst_bin_add (bin, parse);
   g_object_set (parse,
                 "config-interval", (gint) - 1,
@@ -302,44 +1119,65 @@ wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl
   caps = gst_caps_from_string ("video/x-h264,stream-format=byte-stream,profile=constrained-baseline");
   gst_caps_append (caps,
                    gst_caps_from_string ("video/x-h264,stream-format=byte-stream,profile=baseline"));
-  codecfilter = gst_element_factory_make ("capsfilter", "wfd-codecfilter");
+  codecfilter = make_rung_element ("capsfilter", "wfd-codecfilter", idx);
   g_object_set (codecfilter,
                 "caps", caps,
                 NULL);
   g_clear_pointer (&caps, gst_caps_unref);
   success &= gst_bin_add (bin, codecfilter);
 
-  queue_mpegmux_video = gst_element_factory_make ("queue", "wfd-mpegmux-video-queue");
+  queue_mpegmux_video = make_rung_element ("queue", "wfd-mpegmux-video-queue", idx);
   success &= gst_bin_add (bin, queue_mpegmux_video);
   g_object_set (queue_mpegmux_video,
                 "max-size-buffers", (guint) 1000,
                 "max-size-time", 500 * GST_MSECOND,
                 NULL);
+  /* The limits above are only a last resort, congestion is dealt with by
+   * trimming the video backlog well before. The audio queue is never
+   * touched. */
+  congestion_sink = gst_element_get_static_pad (queue_mpegmux_video, "sink");
+  gst_pad_add_probe (congestion_sink,
+                     GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_FLUSH,
+                     congestion_probe_cb,
+                     rung,
+                     NULL);
+  congestion_src = gst_element_get_static_pad (queue_mpegmux_video, "src");
+  gst_pad_add_probe (congestion_src,
+                     GST_PAD_PROBE_TYPE_BUFFER,
+                     congestion_trim_probe_cb,
+                     rung,
+                     NULL);
 
-  /* TODO: With gstreamer 1.17 we should be able to set things up so
-   *       that audio frames are still send even if there are no new
-   *       video frames. At that point, some semantics should be
-   *       changed like doing proper variable framerate and such.
-   *       This is possible as mpegtsmux was being ported to GstAggregator.
-   */
-  mpegmux = gst_element_factory_make ("mpegtsmux", "wfd-mpegtsmux");
+  mpegmux = make_rung_element ("mpegtsmux", "wfd-mpegtsmux", idx);
   success &= gst_bin_add (bin, mpegmux);
   g_object_set (mpegmux,
                 "alignment", (gint) 7, /* Force the correct alignment for UDP */
                 NULL);
 
+  /* Since gstreamer 1.18 mpegtsmux is a live GstAggregator, so it sends
+   * audio and PCR after a timeout even if no new video frame arrived. That
+   * makes variable framerate video safe, see repeat_filter_probe_cb().
+   * Older versions wait for all pads, there the source keeps repeating
+   * frames at the full rate. */
+  if (GST_IS_AGGREGATOR (mpegmux))
+    g_object_set (mpegmux,
+                  "latency", (guint64) MUX_LATENCY,
+                  NULL);
 
-  queue_pre_payloader = gst_element_factory_make ("queue", "wfd-pre-payloader-queue");
+
+  queue_pre_payloader = make_rung_element ("queue", "wfd-pre-payloader-queue", idx);
   success &= gst_bin_add (bin, queue_pre_payloader);
   g_object_set (queue_pre_payloader,
                 "max-size-buffers", (guint) 1,
                 "leaky", 0,
                 NULL);
 
-  payloader = gst_element_factory_make ("rtpmp2tpay", "pay0");
+  /* Every rung is a separate stream of the media */
+  payloader_name = g_strdup_printf ("pay%u", idx);
+  payloader = gst_element_factory_make ("rtpmp2tpay", payloader_name);
   success &= gst_bin_add (bin, payloader);
   g_object_set (payloader,
-                "ssrc", 1,
+                "ssrc", 1 + idx,
                 /* Perfect is in relation to the input buffers, but we want the
                  * proper clock from when the packet was sent. */
                 "perfect-rtptime", FALSE,
@@ -347,11 +1185,17 @@ wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl
                 "seqnum-offset", (gint) 0,
                 NULL);
 
-  success &= gst_element_link_many (source,
+  /* Spread the packets of large frames instead of bursting them out, the
+   * rate is set once the encoder bitrate is known. */
+  rung->pacer = wfd_pacer_new (payloader_name);
+  payloader_src = gst_element_get_static_pad (payloader, "src");
+  wfd_pacer_attach (rung->pacer, payloader_src);
+
+  success &= link_tee_to_rung (tee, mailbox, rung_idle_probe_cb, rung);
+  success &= gst_element_link_many (encoder_src,
                                     scale,
+                                    rate,
                                     sizefilter,
-                                    convert,
-                                    queue_pre_encoder,
                                     encoder,
                                     encoding_perf,
                                     parse,
@@ -366,6 +1210,100 @@ wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl
                                     payloader,
                                     NULL);
 
+  return success;
+}
+
+GstElement *
+wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl *url)
+{
+  g_autoptr(GstBin) bin = NULL;
+  g_autoptr(GstCaps) caps = NULL;
+  g_autoptr(GstBin) audio_pipeline = NULL;
+  WfdMediaFactory *self = WFD_MEDIA_FACTORY (factory);
+  GPtrArray *rungs;
+
+  g_autoptr(GstElement) source = NULL;
+  g_autoptr(GstElement) audio_source = NULL;
+  g_autoptr(GstCaps) capture_caps = NULL;
+  GstElement *capturefilter;
+  GstElement *convert;
+  GstElement *tee;
+  gboolean success = TRUE;
+  guint i;
+
+  bin = GST_BIN (gst_bin_new ("wfd-encoder-bin"));
+
+  /* Test input, will be replaced by real source */
+  g_signal_emit (self, signals[SIGNAL_CREATE_SOURCE], 0, &source);
+  g_assert (source);
+  success &= gst_bin_add (bin, source);
+
+  /* intervideosrc would otherwise settle on 30 fps, which starves the
+   * 60 fps rung */
+  capture_caps = gst_caps_new_simple ("video/x-raw",
+                                      "framerate", GST_TYPE_FRACTION, wfd_get_capture_rate (), 1,
+                                      NULL);
+  capturefilter = gst_element_factory_make ("capsfilter", "wfd-capturefilter");
+  g_object_set (capturefilter,
+                "caps", capture_caps,
+                NULL);
+  success &= gst_bin_add (bin, capturefilter);
+
+  /* Capture and convert once, every rung then scales and encodes
+   * the converted frames in its own thread. */
+  convert = gst_element_factory_make ("videoconvert", "wfd-videoconvert");
+  g_object_set (convert,
+                "qos", TRUE,
+                NULL);
+  success &= gst_bin_add (bin, convert);
+
+  tee = gst_element_factory_make ("tee", "wfd-video-tee");
+  g_object_set (tee,
+                "allow-not-linked", TRUE,
+                NULL);
+  success &= gst_bin_add (bin, tee);
+
+  success &= gst_element_link_many (source,
+                                    capturefilter,
+                                    convert,
+                                    tee,
+                                    NULL);
+
+  /* Only drop repeated frames if the mux does not need them to keep going */
+  if (wfd_mpegtsmux_is_live ())
+    {
+      g_autoptr(GstPad) convert_sink = NULL;
+      RepeatFilter *filter = g_new0 (RepeatFilter, 1);
+
+      filter->last_pts = GST_CLOCK_TIME_NONE;
+      g_object_set_data_full (G_OBJECT (convert), "wfd-repeat-filter", filter, g_free);
+      convert_sink = gst_element_get_static_pad (convert, "sink");
+      gst_pad_add_probe (convert_sink,
+                         GST_PAD_PROBE_TYPE_BUFFER,
+                         repeat_filter_probe_cb,
+                         filter,
+                         NULL);
+    }
+
+  /* The converted frame is shared by the pre-encoder mailbox of every rung,
+   * plus one being scaled and one in the encoder. */
+  wfd_media_element_add_frame_pool (convert, PRE_ENCODER_QUEUE_DEPTH + 2);
+
+  rungs = g_ptr_array_new_with_free_func ((GDestroyNotify) wfd_rung_free);
+  g_object_set_data_full (G_OBJECT (bin), "wfd-rungs", rungs, (GDestroyNotify) g_ptr_array_unref);
+
+  for (i = 0; i < wfd_get_n_rungs (); i++)
+    {
+      WfdRung *rung = g_new0 (WfdRung, 1);
+
+      rung->index = i;
+      g_mutex_init (&rung->trim_lock);
+      g_ptr_array_add (rungs, rung);
+
+      success &= wfd_media_factory_create_rung (self, bin, tee, rung);
+    }
+
+  wfd_media_element_update_governor (bin);
 
   /* Add audio elements */
   if (self->aac_encoder != ENCODER_AAC_NONE)
@@ -377,6 +1315,7 @@ wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl
       GstElement *audioresample;
       GstElement *audioconvert;
       GstElement *queue_mpegmux_audio;
+      GstElement *audio_tee;
 
       audio_pipeline = GST_BIN (gst_bin_new ("wfd-audio"));
       success &= gst_bin_add (bin, GST_ELEMENT (g_object_ref (audio_pipeline)));
@@ -419,6 +1358,13 @@ wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl
                     NULL);
       success &= gst_bin_add (audio_pipeline, queue_mpegmux_audio);
 
+      /* Audio is encoded once and then muxed into every rung */
+      audio_tee = gst_element_factory_make ("tee", "wfd-audio-tee");
+      g_object_set (audio_tee,
+                    "allow-not-linked", TRUE,
+                    NULL);
+      success &= gst_bin_add (audio_pipeline, audio_tee);
+
       caps = gst_caps_new_simple ("audio/mpeg",
                                   "channels", G_TYPE_INT, 2,
                                   "rate", G_TYPE_INT, 48000,
@@ -427,12 +1373,25 @@ wfd_media_factory_create_element (GstRTSPMediaFactory *factory, const GstRTSPUrl
       success &= gst_element_link_many (audio_source, audioresample, audioconvert, NULL);
       success &= gst_element_link (audioconvert, audioencoder);
       success &= gst_element_link_filtered (audioencoder, queue_mpegmux_audio, caps);
+      success &= gst_element_link (queue_mpegmux_audio, audio_tee);
       g_clear_pointer (&caps, gst_caps_unref);
 
-      gst_element_add_pad (GST_ELEMENT (audio_pipeline),
-                           gst_ghost_pad_new ("src",
-                                              gst_element_get_static_pad (queue_mpegmux_audio,
-                                                                          "src")));
+      for (i = 0; i < rungs->len; i++)
+        {
+          WfdRung *rung = g_ptr_array_index (rungs, i);
+          g_autofree gchar *pad_name = NULL;
+          GstElement *queue_rung_audio;
+
+          queue_rung_audio = make_rung_element ("queue", "wfd-mpegmux-audio-queue", i);
+          success &= gst_bin_add (audio_pipeline, queue_rung_audio);
+          success &= link_tee_to_rung (audio_tee, queue_rung_audio, rung_audio_probe_cb, rung);
+
+          pad_name = g_strdup_printf ("src_%u", i);
+          gst_element_add_pad (GST_ELEMENT (audio_pipeline),
+                               gst_ghost_pad_new (pad_name,
+                                                  gst_element_get_static_pad (queue_rung_audio,
+                                                                              "src")));
+        }
     }
 
   GST_DEBUG_BIN_TO_DOT_FILE (bin,
@@ -454,10 +1413,9 @@ wfd_media_factory_create_pipeline (GstRTSPMediaFactory *factory, GstRTSPMedia *m
 
   pipeline = GST_RTSP_MEDIA_FACTORY_CLASS (wfd_media_factory_parent_class)->create_pipeline (factory, media);
 
-  /* We need a high latency for the openh264 encoder at least when the
-   * usage-type is set to "screen". After e.g. scene changes the latency will
-   * be very high for short periods of time, and this prevents further issues. */
-  gst_pipeline_set_latency (GST_PIPELINE (pipeline), 500 * GST_MSECOND);
+  /* Start out safe, the latency is lowered once a client configured the
+   * encoder, see wfd_media_element_get_latency(). */
+  gst_pipeline_set_latency (GST_PIPELINE (pipeline), SAFE_LATENCY);
 
   return pipeline;
 }
@@ -477,20 +1435,54 @@ wfd_configure_media_element (GstBin *bin, WfdParams *params)
   WfdResolution *resolution = params->selected_resolution;
   WfdH264Encoder encoder_impl;
   WfdH264ProfileFlags profile;
+  WfdRung *rung;
   guint gop_size = resolution->refresh_rate;
   guint bitrate_kbit = wfd_video_codec_get_max_bitrate_kbit (codec);
 
-  /* Limit initial video bitrate to 512kBit/s to ensure we don't
-   * saturate the wifi link.
+  rung = wfd_media_element_get_rung (bin, resolution);
+  g_return_val_if_fail (rung != NULL, 0);
+
+  /* The media is shared between all clients. Only the first client of a
+   * rung configures its encoder, anyone joining later receives the running
+   * stream and just needs a keyframe to start decoding. */
+  if (rung->configured)
+    {
+      g_debug ("WfdMediaFactory: Rung %u is already configured, sharing it with another client", rung->index);
+      g_atomic_int_inc (&rung->users);
+      wfd_media_element_update_governor (bin);
+      if (!(rung->quirks & WFD_QUIRK_NO_IDR))
+        wfd_media_element_request_key_unit (bin, params);
+
+      return rung->quirks;
+    }
+
+  /* Limit initial video bitrate to what the rung was planned for, by
+   * default 512kBit/s to ensure we don't saturate the wifi link.
    * This is a rather bad method, but it kind of works. */
-  bitrate_kbit = MIN (bitrate_kbit, 512 * 8);
+  bitrate_kbit = MIN (bitrate_kbit, simulcast_ladder[rung->index].bitrate_kbit);
 
   if (resolution->interlaced)
     g_warning ("Resolution should never be set to interlaced as that is not supported with all codecs.");
 
-  encoder = gst_bin_get_by_name (bin, "wfd-encoder");
+  encoder = get_rung_element (bin, "wfd-encoder", rung->index);
   encoder_impl = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (encoder), "wfd-encoder-impl"));
 
+  /* Never more than the sink said it can take */
+  if (params->bandwidth_kbit > 0)
+    bitrate_kbit = MIN (bitrate_kbit, params->bandwidth_kbit);
+  rung->planned_kbit = bitrate_kbit;
+
+  /* Start at the bitrate that ran well in the last session with this
+   * sink, unless that was reached with a different encoder. It can only
+   * lower the plan of the rung, never raise it. */
+  if (params->initial_bitrate_kbit > 0 &&
+      params->initial_bitrate_kbit < bitrate_kbit &&
+      g_strcmp0 (params->initial_encoder, wfd_encoder_get_name (encoder)) == 0)
+    {
+      bitrate_kbit = params->initial_bitrate_kbit;
+      g_debug ("WfdMediaFactory: Starting rung %u at the previous bitrate of %u kbit/s", rung->index, bitrate_kbit);
+    }
+
   if (encoder_impl == ENCODER_VAAPIH264)
     quirks = WFD_QUIRK_NO_IDR;
 
@@ -506,7 +1498,7 @@ wfd_configure_media_element (GstBin *bin, WfdParams *params)
                                          "height", G_TYPE_INT, resolution->height,
                                          NULL);
 
-  sizefilter = gst_bin_get_by_name (bin, "wfd-sizefilter");
+  sizefilter = get_rung_element (bin, "wfd-sizefilter", rung->index);
   g_object_set (sizefilter,
                 "caps", caps_sizefilter,
                 NULL);
@@ -589,7 +1581,7 @@ wfd_configure_media_element (GstBin *bin, WfdParams *params)
                        gst_caps_from_string ("video/x-h264,stream-format=byte-stream,profile=baseline"));
     }
 
-  codecfilter = gst_bin_get_by_name (bin, "wfd-codecfilter");
+  codecfilter = get_rung_element (bin, "wfd-codecfilter", rung->index);
   g_object_set (codecfilter,
                 "caps", caps_codecfilter,
                 NULL);
@@ -597,10 +1589,13 @@ wfd_configure_media_element (GstBin *bin, WfdParams *params)
 
   g_debug ("An audiocodec has been selected: %s", params->selected_audio_codec ? "yes" : "no");
   audio_pipeline = gst_bin_get_by_name (bin, "wfd-audio");
-  mpegmux = gst_bin_get_by_name (bin, "wfd-mpegtsmux");
+  mpegmux = get_rung_element (bin, "wfd-mpegtsmux", rung->index);
   if (audio_pipeline)
     {
-      gst_element_unlink (audio_pipeline, mpegmux);
+      g_autofree gchar *pad_name = g_strdup_printf ("src_%u", rung->index);
+
+      gst_element_unlink_pads (audio_pipeline, pad_name, mpegmux, "sink_4352");
+      rung->audio = FALSE;
 
       if (params->selected_audio_codec)
         {
@@ -611,9 +1606,10 @@ wfd_configure_media_element (GstBin *bin, WfdParams *params)
           gst_element_set_locked_state (GST_ELEMENT (audio_pipeline), FALSE);
 
           /* Hook up the audio channel */
-          gst_element_link_pads (audio_pipeline, "src", mpegmux, "sink_4352");
+          gst_element_link_pads (audio_pipeline, pad_name, mpegmux, "sink_4352");
+          rung->audio = TRUE;
         }
-      else
+      else if (!wfd_media_element_has_audio (bin))
         {
           gst_element_set_locked_state (GST_ELEMENT (audio_pipeline), TRUE);
           gst_element_set_state (GST_ELEMENT (audio_pipeline), GST_STATE_NULL);
@@ -624,19 +1620,331 @@ wfd_configure_media_element (GstBin *bin, WfdParams *params)
                              GST_DEBUG_GRAPH_SHOW_ALL,
                              "wfd-encoder-bin-configured");
 
+  /* The sink reports its latency in units of 5ms */
+  rung->sink_latency = codec->latency * 5 * GST_MSECOND;
+  if (params->selected_audio_codec)
+    rung->sink_latency = MAX (rung->sink_latency,
+                              params->selected_audio_codec->latency_ms * GST_MSECOND);
+
+  wfd_pacer_set_target (rung->pacer, bitrate_kbit, resolution->refresh_rate);
+
+  rung->quirks = quirks;
+  rung->bitrate_kbit = bitrate_kbit;
+  g_mutex_lock (&rung->trim_lock);
+  rung->congestion_drops = 0;
+  rung->trimmed = 0;
+  g_mutex_unlock (&rung->trim_lock);
+  rung->configured = TRUE;
+  g_atomic_int_inc (&rung->users);
+  wfd_media_element_update_governor (bin);
+
+  /* The rung may have been idle, so make sure the stream starts cleanly */
+  if (!(quirks & WFD_QUIRK_NO_IDR))
+    wfd_media_element_request_key_unit (bin, params);
+
   return quirks;
 }
 
+void
+wfd_media_element_request_key_unit (GstBin *bin, WfdParams *params)
+{
+  g_autoptr(GstElement) codecfilter = NULL;
+  WfdRung *rung;
+
+  rung = wfd_media_element_get_rung (bin, params->selected_resolution);
+  if (!rung)
+    return;
+
+  codecfilter = get_rung_element (bin, "wfd-codecfilter", rung->index);
+  if (!codecfilter)
+    return;
+
+  g_debug ("WfdMediaFactory: Requesting a keyframe on rung %u", rung->index);
+  gst_element_send_event (codecfilter,
+                          gst_video_event_new_upstream_force_key_unit (GST_CLOCK_TIME_NONE, TRUE, 0));
+}
+
+void
+wfd_media_element_release (GstBin *bin, WfdParams *params)
+{
+  WfdRung *rung;
+
+  if (!params->selected_resolution)
+    return;
+
+  rung = wfd_media_element_get_rung (bin, params->selected_resolution);
+  if (!rung || !rung->configured)
+    return;
+
+  /* The last client of the rung is gone, stop encoding it and let the
+   * next client configure it again. */
+  if (g_atomic_int_dec_and_test (&rung->users))
+    {
+      g_debug ("WfdMediaFactory: Rung %u is idle now", rung->index);
+      rung->configured = FALSE;
+      rung->audio = FALSE;
+      rung->congested = FALSE;
+      g_atomic_int_set (&rung->suspended, 0);
+      wfd_media_element_update_governor (bin);
+    }
+}
+
+/**
+ * wfd_media_element_get_operating_point:
+ * @bin: the media element
+ * @params: the parameters of the client
+ * @encoder: (out) (transfer full): the name of the encoder
+ * @bitrate_kbit: (out): the configured bitrate
+ * @planned_kbit: (out): the bitrate the ladder and the link allow
+ * @congested: (out): whether frames had to be dropped
+ *
+ * Returns: %FALSE if the rung of the client is not configured
+ */
+gboolean
+wfd_media_element_get_operating_point (GstBin    *bin,
+                                       WfdParams *params,
+                                       gchar    **encoder,
+                                       guint     *bitrate_kbit,
+                                       guint     *planned_kbit,
+                                       gboolean  *congested)
+{
+  g_autoptr(GstElement) encoder_element = NULL;
+  WfdRung *rung;
+
+  if (!params->selected_resolution)
+    return FALSE;
+
+  rung = wfd_media_element_get_rung (bin, params->selected_resolution);
+  if (!rung || !rung->configured)
+    return FALSE;
+
+  encoder_element = get_rung_element (bin, "wfd-encoder", rung->index);
+  *encoder = g_strdup (wfd_encoder_get_name (encoder_element));
+  *bitrate_kbit = rung->bitrate_kbit;
+  *planned_kbit = rung->planned_kbit;
+  *congested = wfd_rung_get_drops (rung) > 0;
+
+  return TRUE;
+}
+
+/**
+ * wfd_media_element_suspend:
+ * @bin: the media element
+ * @params: the parameters of the client
+ *
+ * A client paused the stream or its sink went into standby. The rung stays
+ * configured, but is not encoded anymore unless another client watches it.
+ */
+void
+wfd_media_element_suspend (GstBin *bin, WfdParams *params)
+{
+  WfdRung *rung;
+
+  rung = wfd_media_element_get_rung (bin, params->selected_resolution);
+  if (!rung || !rung->configured)
+    return;
+
+  g_atomic_int_inc (&rung->suspended);
+  if (!wfd_rung_is_watched (rung))
+    g_debug ("WfdMediaFactory: Rung %u is suspended", rung->index);
+  wfd_media_element_update_governor (bin);
+}
+
+/**
+ * wfd_media_element_resume:
+ * @bin: the media element
+ * @params: the parameters of the client
+ *
+ * Undoes wfd_media_element_suspend(). The encoder is still configured, so
+ * the stream continues with the next captured frame, which is forced to
+ * be a keyframe.
+ */
+void
+wfd_media_element_resume (GstBin *bin, WfdParams *params)
+{
+  WfdRung *rung;
+
+  rung = wfd_media_element_get_rung (bin, params->selected_resolution);
+  if (!rung || !rung->configured)
+    return;
+
+  g_atomic_int_add (&rung->suspended, -1);
+  g_debug ("WfdMediaFactory: Resuming rung %u", rung->index);
+  wfd_media_element_update_governor (bin);
+
+  if (!(rung->quirks & WFD_QUIRK_NO_IDR))
+    wfd_media_element_request_key_unit (bin, params);
+}
+
+static GstClockTime
+wfd_encoder_get_latency (WfdH264Encoder encoder_impl)
+{
+  switch (encoder_impl)
+    {
+    case ENCODER_OPENH264:
+      /* We need a high latency for the openh264 encoder at least when the
+       * usage-type is set to "screen". After e.g. scene changes the latency
+       * will be very high for short periods of time, and this prevents
+       * further issues. */
+      return SAFE_LATENCY;
+
+    case ENCODER_X264:
+      /* Zero latency tuning, encoding a frame is well below a frame interval */
+      return 20 * GST_MSECOND;
+
+    case ENCODER_VAAPIH264:
+      return 30 * GST_MSECOND;
+
+    default:
+      return SAFE_LATENCY;
+    }
+}
+
+static void
+add_frame_pool_stats (GstStructure *stats, GstElement *element)
+{
+  WfdFramePool *pool;
+  GstStructure *s;
+
+  if (!element)
+    return;
+
+  pool = g_object_get_data (G_OBJECT (element), "wfd-frame-pool");
+  if (pool)
+    {
+      s = wfd_frame_pool_get_stats_structure (pool);
+      gst_structure_set (stats, GST_OBJECT_NAME (pool), GST_TYPE_STRUCTURE, s, NULL);
+      gst_structure_free (s);
+    }
+
+  gst_object_unref (element);
+}
+
+static void
+add_congestion_stats (GstStructure *stats, GstBin *bin, WfdRung *rung)
+{
+  g_autoptr(GstElement) queue = NULL;
+  GstStructure *s;
+
+  queue = get_rung_element (bin, "wfd-mpegmux-video-queue", rung->index);
+  if (!queue)
+    return;
+
+  s = get_congestion_structure (queue, rung);
+  gst_structure_set (stats, GST_OBJECT_NAME (queue), GST_TYPE_STRUCTURE, s, NULL);
+  gst_structure_free (s);
+}
+
+/**
+ * wfd_media_element_get_stats:
+ * @bin: the media element
+ *
+ * Collects the statistics of the raw frame pools and the fill level and
+ * drop count of the mux queues. They are also posted as "wfd-frame-pool"
+ * and "wfd-congestion" element messages, but only every few hundred
+ * frames and on congestion changes respectively.
+ *
+ * Returns: (transfer full): a "wfd-media-stats" structure with one
+ *   "wfd-frame-pool" structure per pool, keyed by the pool name, and one
+ *   "wfd-congestion" structure per rung, keyed by the queue name
+ */
+GstStructure *
+wfd_media_element_get_stats (GstBin *bin)
+{
+  GstStructure *stats;
+  GPtrArray *rungs;
+  guint i;
+
+  stats = gst_structure_new_empty ("wfd-media-stats");
+
+  add_frame_pool_stats (stats, gst_bin_get_by_name (bin, "wfd-videoconvert"));
+  for (i = 0; i < wfd_get_n_rungs (); i++)
+    add_frame_pool_stats (stats, get_rung_element (bin, "wfd-scale", i));
+
+  rungs = g_object_get_data (G_OBJECT (bin), "wfd-rungs");
+  for (i = 0; rungs && i < rungs->len; i++)
+    add_congestion_stats (stats, bin, g_ptr_array_index (rungs, i));
+
+  return stats;
+}
+
+/**
+ * wfd_media_element_get_latency:
+ * @bin: the media element
+ *
+ * Computes the latency the pipeline needs from the configuration of the
+ * rungs being watched: one frame interval for capturing, the headroom the
+ * encoder needs, one frame interval for pacing and a little for muxing and
+ * payloading. Setting
+ * NETWORK_DISPLAYS_LATENCY_MS overrides the computed value.
+ *
+ * Returns: the pipeline latency to use
+ */
+GstClockTime
+wfd_media_element_get_latency (GstBin *bin)
+{
+  const gchar *latency_str;
+  GstClockTime latency = 0;
+  GstClockTime sink_latency = 0;
+  GPtrArray *rungs;
+  guint i;
+
+  latency_str = g_getenv ("NETWORK_DISPLAYS_LATENCY_MS");
+  if (latency_str)
+    return g_ascii_strtoull (latency_str, NULL, 10) * GST_MSECOND;
+
+  rungs = g_object_get_data (G_OBJECT (bin), "wfd-rungs");
+  for (i = 0; rungs && i < rungs->len; i++)
+    {
+      g_autoptr(GstElement) encoder = NULL;
+      WfdRung *rung = g_ptr_array_index (rungs, i);
+      WfdH264Encoder encoder_impl;
+      GstClockTime rung_latency;
+
+      if (!rung->configured)
+        continue;
+
+      encoder = get_rung_element (bin, "wfd-encoder", rung->index);
+      encoder_impl = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (encoder), "wfd-encoder-impl"));
+
+      /* Capturing and pacing each take up to a frame interval */
+      rung_latency = wfd_encoder_get_latency (encoder_impl);
+      if (rung_latency < SAFE_LATENCY)
+        rung_latency += 2 * GST_SECOND / simulcast_ladder[rung->index].resolution.refresh_rate +
+                        10 * GST_MSECOND;
+
+      latency = MAX (latency, rung_latency);
+      sink_latency = MAX (sink_latency, rung->sink_latency);
+    }
+
+  if (latency == 0)
+    return SAFE_LATENCY;
+
+  if (latency + sink_latency > TARGET_END_TO_END_LATENCY)
+    g_debug ("WfdMediaFactory: Expecting %" G_GUINT64_FORMAT " ms end to end latency (sink %" G_GUINT64_FORMAT " ms)",
+             (latency + sink_latency) / GST_MSECOND, sink_latency / GST_MSECOND);
+
+  return latency;
+}
+
 GstRTSPMedia *
 wfd_media_factory_construct (GstRTSPMediaFactory *factory, const GstRTSPUrl *url)
 {
   GstRTSPMedia *res;
   GstRTSPStream *stream;
+  guint i;
 
   res = GST_RTSP_MEDIA_FACTORY_CLASS (wfd_media_factory_parent_class)->construct (factory, url);
 
-  stream = gst_rtsp_media_get_stream (res, 0);
-  gst_rtsp_stream_set_control (stream, "streamid=0");
+  /* Every rung of the simulcast ladder is a separate stream */
+  for (i = 0; i < gst_rtsp_media_n_streams (res); i++)
+    {
+      g_autofree gchar *control = g_strdup_printf ("streamid=%u", i);
+
+      stream = gst_rtsp_media_get_stream (res, i);
+      gst_rtsp_stream_set_control (stream, control);
+      wfd_media_factory_setup_multicast (stream, i);
+    }
   g_debug ("WfdMedia init: Got %d streams", gst_rtsp_media_n_streams (res));
 
   return res;
@@ -762,8 +2070,77 @@ wfd_media_factory_init (WfdMediaFactory *self)
   g_assert (wfd_media_factory_lookup_encoders (self, NULL, NULL));
 
   gst_rtsp_media_factory_set_media_gtype (media_factory, WFD_TYPE_MEDIA);
-  gst_rtsp_media_factory_set_suspend_mode (media_factory, GST_RTSP_SUSPEND_MODE_RESET);
+  /* One capture and encode pipeline feeds every connected sink, each
+   * client only adds its own RTP transport to the shared media. */
+  gst_rtsp_media_factory_set_shared (media_factory, TRUE);
+  /* Keep the configured pipeline around while paused, resuming then only
+   * needs a keyframe instead of building and prerolling everything again. */
+  gst_rtsp_media_factory_set_suspend_mode (media_factory, GST_RTSP_SUSPEND_MODE_NONE);
   gst_rtsp_media_factory_set_buffer_size (media_factory, 65536);
+
+  if (wfd_multicast_get_group ())
+    gst_rtsp_media_factory_set_protocols (media_factory,
+                                          GST_RTSP_LOWER_TRANS_UDP | GST_RTSP_LOWER_TRANS_UDP_MCAST);
+}
+
+static gpointer
+wfd_media_factory_preload_thread (gpointer user_data)
+{
+  g_autoptr(WfdMediaFactory) factory = NULL;
+  const gchar *elements[] = {
+    "videoconvert", "videoscale", "audioconvert", "audioresample",
+    "mpegtsmux", "rtpmp2tpay",
+  };
+  guint i;
+
+  factory = wfd_media_factory_new ();
+
+  for (i = 0; i < G_N_ELEMENTS (elements) + 2; i++)
+    {
+      g_autoptr(GstElementFactory) element_factory = NULL;
+      g_autoptr(GstPluginFeature) loaded = NULL;
+      const gchar *name;
+
+      if (i == G_N_ELEMENTS (elements))
+        name = h264_encoders[factory->encoder];
+      else if (i == G_N_ELEMENTS (elements) + 1)
+        name = aac_encoders[factory->aac_encoder];
+      else
+        name = elements[i];
+
+      if (!name)
+        continue;
+
+      element_factory = gst_element_factory_find (name);
+      if (element_factory)
+        loaded = gst_plugin_feature_load (GST_PLUGIN_FEATURE (element_factory));
+    }
+
+  g_debug ("WfdMediaFactory: Preloaded the encoding plugins");
+
+  return NULL;
+}
+
+/**
+ * wfd_media_factory_preload:
+ *
+ * Loads the plugins for the encoding pipeline in the background, so that
+ * they are ready once a sink connects. Loading the encoder can take a
+ * while, e.g. when it has to initialize hardware. Only does something the
+ * first time it is called.
+ */
+void
+wfd_media_factory_preload (void)
+{
+  static gsize preloaded = 0;
+
+  if (!g_once_init_enter (&preloaded))
+    return;
+
+  if (wfd_media_factory_lookup_encoders (NULL, NULL, NULL))
+    g_thread_unref (g_thread_new ("wfd-preload", wfd_media_factory_preload_thread, NULL));
+
+  g_once_init_leave (&preloaded, 1);
 }
 
 gboolean
@@ -16,6 +16,16 @@ typedef enum {
 } WfdMediaQuirks;
 
 WfdMediaFactory * wfd_media_factory_new (void);
+void              wfd_media_factory_preload (void);
+
+WfdResolution   * wfd_simulcast_pick_resolution (WfdVideoCodec *codec,
+                                                 guint32        bandwidth_kbit);
+guint             wfd_simulcast_get_stream_id (const WfdResolution *resolution);
+
+GstElement      * wfd_source_governor_new (gboolean variable_framerate);
+
+const gchar     * wfd_multicast_get_group (void);
+guint             wfd_multicast_get_port (guint stream_id);
 
 gboolean          wfd_get_missing_codecs (GStrv *video,
                                           GStrv *audio);
@@ -23,5 +33,21 @@ gboolean          wfd_get_missing_codecs (GStrv *video,
 /* Just because it is convenient to have next to the pipeline creation code */
 WfdMediaQuirks wfd_configure_media_element (GstBin    *bin,
                                             WfdParams *params);
+void           wfd_media_element_request_key_unit (GstBin    *bin,
+                                                   WfdParams *params);
+void           wfd_media_element_release (GstBin    *bin,
+                                          WfdParams *params);
+gboolean       wfd_media_element_get_operating_point (GstBin    *bin,
+                                                      WfdParams *params,
+                                                      gchar    **encoder,
+                                                      guint     *bitrate_kbit,
+                                                      guint     *planned_kbit,
+                                                      gboolean  *congested);
+void           wfd_media_element_suspend (GstBin    *bin,
+                                          WfdParams *params);
+void           wfd_media_element_resume (GstBin    *bin,
+                                         WfdParams *params);
+GstClockTime   wfd_media_element_get_latency (GstBin *bin);
+GstStructure * wfd_media_element_get_stats (GstBin *bin);
 
 G_END_DECLS
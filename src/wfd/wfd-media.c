@@ -3,6 +3,7 @@
 #include "gst/rtsp-server/rtsp-media.h"
 #pragma GCC diagnostic pop
 #include "wfd-media.h"
+#include "wfd-media-factory.h"
 
 struct _WfdMedia
 {
@@ -25,6 +26,53 @@ wfd_media_finalize (GObject *object)
   G_OBJECT_CLASS (wfd_media_parent_class)->finalize (object);
 }
 
+/**
+ * wfd_media_update_latency:
+ * @self: a #WfdMedia
+ *
+ * Sets the pipeline latency to what the current encoder configuration
+ * needs, but never below what the elements themselves report.
+ */
+void
+wfd_media_update_latency (WfdMedia *self)
+{
+  g_autoptr(GstElement) element = NULL;
+  g_autoptr(GstObject) pipeline = NULL;
+  g_autoptr(GstQuery) query = NULL;
+  GstClockTime latency;
+  GstClockTime min_latency = 0;
+
+  element = gst_rtsp_media_get_element (GST_RTSP_MEDIA (self));
+  pipeline = gst_object_get_parent (GST_OBJECT (element));
+  if (!pipeline || !GST_IS_PIPELINE (pipeline))
+    return;
+
+  latency = wfd_media_element_get_latency (GST_BIN (element));
+
+  query = gst_query_new_latency ();
+  if (gst_element_query (GST_ELEMENT (pipeline), query))
+    gst_query_parse_latency (query, NULL, &min_latency, NULL);
+
+  latency = MAX (latency, min_latency);
+  if (gst_pipeline_get_latency (GST_PIPELINE (pipeline)) == latency)
+    return;
+
+  g_debug ("WfdMedia: Setting pipeline latency to %" G_GUINT64_FORMAT " ms", latency / GST_MSECOND);
+  gst_pipeline_set_latency (GST_PIPELINE (pipeline), latency);
+  gst_bin_recalculate_latency (GST_BIN (pipeline));
+}
+
+static gboolean
+wfd_media_handle_message (GstRTSPMedia *media, GstMessage *message)
+{
+  /* Some element changed its latency (e.g. the encoder after a
+   * reconfiguration), the parent recalculates it afterwards. */
+  if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_LATENCY)
+    wfd_media_update_latency (WFD_MEDIA (media));
+
+  return GST_RTSP_MEDIA_CLASS (wfd_media_parent_class)->handle_message (media, message);
+}
+
 static gboolean
 wfd_media_setup_rtpbin (GstRTSPMedia *media, GstElement *rtpbin)
 {
@@ -49,6 +97,7 @@ wfd_media_class_init (WfdMediaClass *klass)
   object_class->finalize = wfd_media_finalize;
 
   media_class->setup_rtpbin = wfd_media_setup_rtpbin;
+  media_class->handle_message = wfd_media_handle_message;
 }
 
 static void
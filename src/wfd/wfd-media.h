@@ -10,4 +10,6 @@ G_DECLARE_FINAL_TYPE (WfdMedia, wfd_media, WFD, MEDIA, GstRTSPMedia)
 
 WfdMedia * wfd_media_new (void);
 
+void       wfd_media_update_latency (WfdMedia *self);
+
 G_END_DECLS
@@ -0,0 +1,301 @@
+/* wfd-pacer.c
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wfd-pacer.h"
+
+/* Send at up to this many percent of the target bitrate, so that normal
+ * frames leave quickly while bursts are still spread out. */
+#define RATE_HEADROOM_PERCENT 150
+
+/* A burst may be sent at line rate for this long */
+#define BUCKET_DURATION_US 2000
+
+/* A large frame (e.g. an IDR) may take this many frame intervals to send,
+ * everything beyond is sent without further delay. */
+#define MAX_FRAME_SPREAD 2
+
+/* Waits are split into slices of this length, so that a pad that gets
+ * deactivated (which does not tell us) is noticed soon enough. */
+#define WAIT_SLICE (5 * GST_MSECOND)
+
+/* Log the histogram every this many packets */
+#define STATS_INTERVAL 5000
+
+/* Upper bounds of the histogram buckets in microseconds, the last bucket
+ * collects everything above. */
+static const gint64 histogram_bounds[] = { 0, 500, 1000, 2000, 5000, 10000, 20000, 50000 };
+#define N_BUCKETS (G_N_ELEMENTS (histogram_bounds) + 1)
+
+/*
+ * A token bucket between the payloader and the network. Encoded frames
+ * leave the payloader as a burst of packets, which overflows the queues of
+ * WiFi drivers and access points even if the average rate is fine.
+ */
+struct _WfdPacer
+{
+  gchar       *name;
+  gboolean     enabled;
+
+  GMutex       lock;
+  gint64       rate;         /* bytes per second, 0 disables pacing */
+  gint64       bucket_size;  /* bytes */
+  gint64       frame_interval_us;
+
+  gdouble      tokens;
+  gint64       last_update_us;
+
+  GstClockTime frame_pts;
+  gint64       frame_start_us;
+
+  GstClock    *clock;
+  GstClockID   wait_id;      /* the wait in progress, unscheduled on flush */
+  gboolean     flushing;
+
+  guint64      packets;
+  guint64      histogram[N_BUCKETS];
+};
+
+static void
+wfd_pacer_record_delay (WfdPacer *self, gint64 delay_us)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (histogram_bounds); i++)
+    if (delay_us <= histogram_bounds[i])
+      break;
+
+  self->histogram[i]++;
+  self->packets++;
+
+  if (self->packets % STATS_INTERVAL == 0)
+    {
+      g_autoptr(GString) str = g_string_new (NULL);
+
+      for (i = 0; i < N_BUCKETS; i++)
+        {
+          if (i < G_N_ELEMENTS (histogram_bounds))
+            g_string_append_printf (str, " <=%" G_GINT64_FORMAT "us: %" G_GUINT64_FORMAT,
+                                    histogram_bounds[i], self->histogram[i]);
+          else
+            g_string_append_printf (str, " more: %" G_GUINT64_FORMAT, self->histogram[i]);
+        }
+
+      g_debug ("WfdPacer %s: Pacing delay of %" G_GUINT64_FORMAT " packets:%s",
+               self->name, self->packets, str->str);
+    }
+}
+
+static gint64
+wfd_pacer_get_delay (WfdPacer *self, GstBuffer *buf)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 delay_us = 0;
+  gsize size = gst_buffer_get_size (buf);
+
+  g_mutex_lock (&self->lock);
+
+  if (self->rate == 0)
+    goto out;
+
+  /* Refill the bucket */
+  self->tokens += (gdouble) (now - self->last_update_us) * self->rate / G_USEC_PER_SEC;
+  self->tokens = MIN (self->tokens, self->bucket_size);
+  self->last_update_us = now;
+
+  if (GST_BUFFER_PTS (buf) != self->frame_pts)
+    {
+      self->frame_pts = GST_BUFFER_PTS (buf);
+      self->frame_start_us = now;
+    }
+
+  /* Don't let a huge frame fall further and further behind */
+  if (now - self->frame_start_us > MAX_FRAME_SPREAD * self->frame_interval_us)
+    {
+      self->tokens = 0;
+      goto out;
+    }
+
+  self->tokens -= size;
+  if (self->tokens < 0)
+    delay_us = -self->tokens * G_USEC_PER_SEC / self->rate;
+
+out:
+  wfd_pacer_record_delay (self, delay_us);
+  g_mutex_unlock (&self->lock);
+
+  return delay_us;
+}
+
+/* Block the streaming thread until @delay_us passed, or until the pad
+ * starts flushing. */
+static void
+wfd_pacer_wait (WfdPacer *self, GstPad *pad, gint64 delay_us)
+{
+  GstClockTime target = gst_clock_get_time (self->clock) + delay_us * GST_USECOND;
+
+  while (TRUE)
+    {
+      GstClockTime now;
+      GstClockID id;
+
+      g_mutex_lock (&self->lock);
+      now = gst_clock_get_time (self->clock);
+      if (self->flushing || GST_PAD_IS_FLUSHING (pad) || now >= target)
+        {
+          g_mutex_unlock (&self->lock);
+          return;
+        }
+
+      id = gst_clock_new_single_shot_id (self->clock, MIN (target, now + WAIT_SLICE));
+      self->wait_id = id;
+      g_mutex_unlock (&self->lock);
+
+      gst_clock_id_wait (id, NULL);
+
+      g_mutex_lock (&self->lock);
+      self->wait_id = NULL;
+      g_mutex_unlock (&self->lock);
+      gst_clock_id_unref (id);
+    }
+}
+
+static GstPadProbeReturn
+wfd_pacer_probe_cb (GstPad          *pad,
+                    GstPadProbeInfo *info,
+                    gpointer         user_data)
+{
+  WfdPacer *self = user_data;
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+    {
+      gint64 delay_us = wfd_pacer_get_delay (self, GST_PAD_PROBE_INFO_BUFFER (info));
+
+      /* The queue in front of the payloader decouples us from the mux */
+      if (delay_us > 0)
+        wfd_pacer_wait (self, pad, delay_us);
+    }
+  else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+    {
+      GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+      GstFlowReturn ret = GST_FLOW_OK;
+      guint i;
+
+      /* A list would leave back to back, push the packets one by one
+       * instead. Each of them passes this probe again and gets paced. */
+      for (i = 0; i < gst_buffer_list_length (list) && ret == GST_FLOW_OK; i++)
+        ret = gst_pad_push (pad, gst_buffer_ref (gst_buffer_list_get (list, i)));
+
+      gst_buffer_list_unref (list);
+      GST_PAD_PROBE_INFO_DATA (info) = NULL;
+      GST_PAD_PROBE_INFO_FLOW_RETURN (info) = ret;
+
+      return GST_PAD_PROBE_HANDLED;
+    }
+  else if (info->type & GST_PAD_PROBE_TYPE_EVENT_FLUSH)
+    {
+      GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+
+      g_mutex_lock (&self->lock);
+      if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_START)
+        {
+          self->flushing = TRUE;
+          if (self->wait_id)
+            gst_clock_id_unschedule (self->wait_id);
+        }
+      else if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP)
+        {
+          self->flushing = FALSE;
+          self->tokens = self->bucket_size;
+          self->last_update_us = g_get_monotonic_time ();
+        }
+      g_mutex_unlock (&self->lock);
+    }
+
+  return GST_PAD_PROBE_OK;
+}
+
+/**
+ * wfd_pacer_set_target:
+ * @self: a #WfdPacer
+ * @bitrate_kbit: the bitrate the encoder is configured for
+ * @framerate: the framerate of the stream
+ *
+ * Sets the rate the packets are paced at, 0 disables pacing.
+ */
+void
+wfd_pacer_set_target (WfdPacer *self,
+                      guint32   bitrate_kbit,
+                      gint      framerate)
+{
+  g_mutex_lock (&self->lock);
+
+  if (self->enabled)
+    self->rate = (gint64) bitrate_kbit * 1024 / 8 * RATE_HEADROOM_PERCENT / 100;
+  else
+    self->rate = 0;
+
+  self->bucket_size = MAX (self->rate * BUCKET_DURATION_US / G_USEC_PER_SEC, 1500);
+  self->frame_interval_us = G_USEC_PER_SEC / MAX (framerate, 1);
+  self->tokens = self->bucket_size;
+  self->last_update_us = g_get_monotonic_time ();
+
+  g_debug ("WfdPacer %s: Pacing at %" G_GINT64_FORMAT " kbit/s", self->name, self->rate * 8 / 1024);
+
+  g_mutex_unlock (&self->lock);
+}
+
+/**
+ * wfd_pacer_attach:
+ * @self: a #WfdPacer
+ * @pad: the source pad of the payloader
+ *
+ * Paces the packets leaving @pad. Waiting is interrupted when the pad
+ * flushes or is deactivated. The pacer must outlive the pad.
+ */
+void
+wfd_pacer_attach (WfdPacer *self,
+                  GstPad   *pad)
+{
+  gst_pad_add_probe (pad,
+                     GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST |
+                     GST_PAD_PROBE_TYPE_EVENT_FLUSH,
+                     wfd_pacer_probe_cb,
+                     self,
+                     NULL);
+}
+
+WfdPacer *
+wfd_pacer_new (const gchar *name)
+{
+  WfdPacer *self = g_new0 (WfdPacer, 1);
+
+  self->name = g_strdup (name);
+  self->enabled = !g_getenv ("NETWORK_DISPLAYS_NO_PACING");
+  self->frame_pts = GST_CLOCK_TIME_NONE;
+  self->clock = gst_system_clock_obtain ();
+  g_mutex_init (&self->lock);
+
+  return self;
+}
+
+void
+wfd_pacer_free (WfdPacer *self)
+{
+  g_mutex_clear (&self->lock);
+  gst_object_unref (self->clock);
+  g_free (self->name);
+  g_free (self);
+}
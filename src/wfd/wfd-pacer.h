@@ -0,0 +1,20 @@
+#pragma once
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _WfdPacer WfdPacer;
+
+WfdPacer *wfd_pacer_new (const gchar *name);
+void      wfd_pacer_free (WfdPacer *self);
+
+void      wfd_pacer_set_target (WfdPacer *self,
+                                guint32   bitrate_kbit,
+                                gint      framerate);
+void      wfd_pacer_attach (WfdPacer *self,
+                            GstPad   *pad);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (WfdPacer, wfd_pacer_free)
+
+G_END_DECLS
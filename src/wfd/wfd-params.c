@@ -86,6 +86,9 @@ wfd_params_copy (WfdParams *self)
 
   copy->primary_rtp_port = self->primary_rtp_port;
   copy->secondary_rtp_port = self->secondary_rtp_port;
+  copy->bandwidth_kbit = self->bandwidth_kbit;
+  copy->initial_bitrate_kbit = self->initial_bitrate_kbit;
+  copy->initial_encoder = g_strdup (self->initial_encoder);
   if (self->edid)
     {
       copy->edid = g_byte_array_new ();
@@ -140,6 +143,7 @@ wfd_params_free (WfdParams *self)
   g_clear_pointer (&self->audio_codecs, g_ptr_array_unref);
   g_clear_pointer (&self->edid, g_byte_array_unref);
   g_clear_pointer (&self->profile, g_free);
+  g_clear_pointer (&self->initial_encoder, g_free);
 
   g_slice_free (WfdParams, self);
 }
@@ -208,7 +212,8 @@ wfd_params_from_sink (WfdParams *self, const guint8 *body, gsize body_size)
               continue;
             }
 
-          if (!g_str_equal (split_value[0], "RTP/AVP/UDP;unicast"))
+          if (!g_str_equal (split_value[0], "RTP/AVP/UDP;unicast") &&
+              !g_str_equal (split_value[0], "RTP/AVP/UDP;multicast"))
             {
               g_warning ("WfdParams: Ivalid profile: %s", split_value[0]);
               continue;
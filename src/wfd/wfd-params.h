@@ -22,6 +22,13 @@ struct _WfdParams
   guint16        ms_cursor_height;
   guint16        ms_cursor_port;
 
+  /* Estimated capacity of the link to the sink, 0 if unknown */
+  guint32        bandwidth_kbit;
+
+  /* Where the last session with the sink ended up, 0/NULL if unknown */
+  guint32        initial_bitrate_kbit;
+  gchar         *initial_encoder;
+
   WfdVideoCodec *selected_codec;
   WfdResolution *selected_resolution;
   WfdAudioCodec *selected_audio_codec;
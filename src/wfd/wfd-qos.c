@@ -0,0 +1,98 @@
+/* wfd-qos.c
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "wfd-qos.h"
+
+/* AF41, mapped to the WMM video access category */
+#define DEFAULT_DSCP_MEDIA 34
+/* CS3, the RTSP connection is signalling and should not get stuck
+ * behind bulk traffic either */
+#define DEFAULT_DSCP_CONTROL 24
+
+static gint
+get_dscp (WfdTrafficClass traffic_class)
+{
+  const gchar *env;
+  gint dscp;
+
+  switch (traffic_class)
+    {
+    case WFD_TRAFFIC_CLASS_MEDIA:
+      env = "NETWORK_DISPLAYS_DSCP_MEDIA";
+      dscp = DEFAULT_DSCP_MEDIA;
+      break;
+
+    case WFD_TRAFFIC_CLASS_CONTROL:
+      env = "NETWORK_DISPLAYS_DSCP_CONTROL";
+      dscp = DEFAULT_DSCP_CONTROL;
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  if (g_getenv (env))
+    dscp = g_ascii_strtoll (g_getenv (env), NULL, 10);
+
+  if (dscp < 0 || dscp > 63)
+    {
+      g_warning ("WfdQos: Invalid DSCP value %d in %s", dscp, env);
+      dscp = 0;
+    }
+
+  return dscp;
+}
+
+/**
+ * wfd_qos_mark_socket:
+ * @socket: the socket to mark
+ * @traffic_class: what is sent over the socket
+ *
+ * Sets the DSCP (and on Linux the matching socket priority) so that WiFi
+ * drivers put the packets into a higher WMM access category than bulk
+ * traffic. A DSCP of 0 leaves the socket untouched.
+ */
+void
+wfd_qos_mark_socket (GSocket        *socket,
+                     WfdTrafficClass traffic_class)
+{
+  g_autoptr(GError) error = NULL;
+  gint dscp = get_dscp (traffic_class);
+  gboolean res;
+
+  if (!socket || dscp == 0)
+    return;
+
+  if (g_socket_get_family (socket) == G_SOCKET_FAMILY_IPV6)
+    res = g_socket_set_option (socket, IPPROTO_IPV6, IPV6_TCLASS, dscp << 2, &error);
+  else
+    res = g_socket_set_option (socket, IPPROTO_IP, IP_TOS, dscp << 2, &error);
+
+  if (!res)
+    {
+      g_warning ("WfdQos: Could not set DSCP %d: %s", dscp, error->message);
+      g_clear_error (&error);
+    }
+
+#ifdef SO_PRIORITY
+  /* The priority selects the queue (and WMM access category) locally,
+   * the precedence bits of the DSCP map to it 1:1. */
+  if (!g_socket_set_option (socket, SOL_SOCKET, SO_PRIORITY, dscp >> 3, &error))
+    g_warning ("WfdQos: Could not set socket priority: %s", error->message);
+#endif
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  WFD_TRAFFIC_CLASS_MEDIA,
+  WFD_TRAFFIC_CLASS_CONTROL,
+} WfdTrafficClass;
+
+void wfd_qos_mark_socket (GSocket        *socket,
+                          WfdTrafficClass traffic_class);
+
+G_END_DECLS
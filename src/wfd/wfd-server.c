@@ -1,15 +1,40 @@
 #include "wfd-server.h"
 #include "wfd-client.h"
 #include "wfd-media-factory.h"
+#include "wfd-qos.h"
 #include "wfd-session-pool.h"
+#include "wfd-sink-cache.h"
 
 struct _WfdServer
 {
   GstRTSPServer parent_instance;
 
-  guint         clean_pool_source_id;
+  GMainContext *context;
+  GMainLoop    *loop;
+  GThread      *thread;
+
+  GSource      *clean_pool_source;
+
+  guint         source_id;
+  guint         users;
+
+  /* Protects stopping and the pending source requests. */
+  GMutex        lock;
+  GCond         cond;
+  gboolean      stopping;
 };
 
+/* A request for a source element that needs to be answered from the
+ * default main context, the sinks create their sources there. */
+typedef struct
+{
+  gint        ref_count;
+  WfdServer  *server;
+  guint       signal_id;
+  GstElement *result;
+  gboolean    done;
+} WfdSourceRequest;
+
 G_DEFINE_TYPE (WfdServer, wfd_server, GST_TYPE_RTSP_SERVER)
 
 enum {
@@ -20,6 +45,17 @@ enum {
 
 static guint signals[NR_SIGNALS];
 
+/* Every sink expects to find us on port 7236, so there can only be one
+ * server. It is shared between all sinks that are streaming, which also
+ * means that all of them share the same media (and encoder). */
+static WfdServer *shared_server = NULL;
+
+/* Clients wait with triggering SETUP while the capture source of their sink
+ * is still being brought up, the media is constructed on SETUP and needs
+ * the sources. Holds are counted per sink key. */
+static GMutex setup_gate_lock;
+static GHashTable *setup_holds = NULL;
+static GPtrArray *parked_clients = NULL;
 
 WfdServer *
 wfd_server_new (void)
@@ -39,8 +75,14 @@ wfd_server_finalize (GObject *object)
 
   g_debug ("WfdServer: Finalize");
 
-  g_source_remove (self->clean_pool_source_id);
-  self->clean_pool_source_id = 0;
+  g_source_destroy (self->clean_pool_source);
+  g_clear_pointer (&self->clean_pool_source, g_source_unref);
+
+  g_clear_pointer (&self->loop, g_main_loop_unref);
+  g_clear_pointer (&self->context, g_main_context_unref);
+
+  g_mutex_clear (&self->lock);
+  g_cond_clear (&self->cond);
 
   G_OBJECT_CLASS (wfd_server_parent_class)->finalize (object);
 }
@@ -75,38 +117,59 @@ static gboolean
 timeout_query_wfd_support (gpointer user_data)
 {
   WfdClient *client = WFD_CLIENT (user_data);
+  guint delay_ms = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (client), "wfd-query-support-delay"));
 
   g_object_set_data (G_OBJECT (client),
                      "wfd-query-support-timeout",
                      NULL);
 
-  wfd_client_query_support (client);
+  wfd_client_query_support (client, delay_ms);
 
   return G_SOURCE_REMOVE;
 }
 
 static void
-wfd_server_client_closed (GstRTSPServer *server, GstRTSPClient *client)
+destroy_source (gpointer data)
 {
-  guint query_support_id;
-
-  query_support_id = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (client),
-                                                          "wfd-query-support-timeout"));
-
-  if (query_support_id)
-    g_source_remove (query_support_id);
+  g_source_destroy (data);
+  g_source_unref (data);
 }
 
 static void
-wfd_server_client_connected (GstRTSPServer *server, GstRTSPClient *client)
+wfd_server_client_closed (GstRTSPServer *server, GstRTSPClient *client)
 {
-  guint query_support_id;
-
-  query_support_id = g_timeout_add (500, timeout_query_wfd_support, client);
-
   g_object_set_data (G_OBJECT (client),
                      "wfd-query-support-timeout",
-                     GUINT_TO_POINTER (query_support_id));
+                     NULL);
+}
+
+static void
+wfd_server_client_connected (GstRTSPServer *server, GstRTSPClient *client)
+{
+  WfdServer *self = WFD_SERVER (server);
+  GstRTSPConnection *connection;
+  GSource *query_support;
+  guint delay_ms;
+
+  connection = gst_rtsp_client_get_connection (client);
+  if (connection)
+    wfd_qos_mark_socket (gst_rtsp_connection_get_read_socket (connection),
+                         WFD_TRAFFIC_CLASS_CONTROL);
+
+  /* Sinks differ in how soon they accept our first request, the delay
+   * is learned per sink. */
+  delay_ms = wfd_sink_cache_get_query_delay (wfd_client_get_sink_id (WFD_CLIENT (client)));
+  g_debug ("WfdServer: Querying sink %s in %u ms", wfd_client_get_sink_id (WFD_CLIENT (client)), delay_ms);
+  g_object_set_data (G_OBJECT (client), "wfd-query-support-delay", GUINT_TO_POINTER (delay_ms));
+
+  query_support = g_timeout_source_new (delay_ms);
+  g_source_set_callback (query_support, timeout_query_wfd_support, client, NULL);
+  g_source_attach (query_support, self->context);
+
+  g_object_set_data_full (G_OBJECT (client),
+                          "wfd-query-support-timeout",
+                          query_support,
+                          destroy_source);
 
   g_signal_connect_object (client,
                            "closed",
@@ -154,34 +217,116 @@ clean_pool (gpointer user_data)
   return G_SOURCE_CONTINUE;
 }
 
-static GstElement *
-factory_source_create_cb (WfdMediaFactory *factory, WfdServer *self)
+static void
+source_request_unref (gpointer data)
 {
-  GstElement *res;
+  WfdSourceRequest *request = data;
 
-  g_signal_emit (self, signals[SIGNAL_CREATE_SOURCE], 0, &res);
+  if (!g_atomic_int_dec_and_test (&request->ref_count))
+    return;
 
-  return res;
+  /* Answered after the server thread gave up waiting. */
+  if (request->result)
+    {
+      gst_object_ref_sink (request->result);
+      gst_object_unref (request->result);
+    }
+
+  g_object_unref (request->server);
+  g_free (request);
+}
+
+static gboolean
+source_request_dispatch (gpointer data)
+{
+  WfdSourceRequest *request = data;
+  WfdServer *self = request->server;
+  GstElement *res = NULL;
+
+  if (!g_atomic_int_get (&self->stopping))
+    g_signal_emit (self, signals[request->signal_id], 0, &res);
+
+  g_mutex_lock (&self->lock);
+  request->result = res;
+  request->done = TRUE;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->lock);
+
+  return G_SOURCE_REMOVE;
 }
 
+/* The media is constructed from the server thread, but the sinks (and the
+ * capture code behind them) live on the default main context. Hop over and
+ * wait for the answer, unless the server is being shut down meanwhile. */
 static GstElement *
-factory_audio_source_create_cb (WfdMediaFactory *factory, WfdServer *self)
+wfd_server_emit_create_source (WfdServer *self, guint signal_id)
 {
-  GstElement *res;
+  WfdSourceRequest *request;
+  GstElement *res = NULL;
+
+  if (g_main_context_is_owner (g_main_context_default ()))
+    {
+      g_signal_emit (self, signals[signal_id], 0, &res);
+      return res;
+    }
+
+  request = g_new0 (WfdSourceRequest, 1);
+  request->ref_count = 2;
+  request->server = g_object_ref (self);
+  request->signal_id = signal_id;
 
-  g_signal_emit (self, signals[SIGNAL_CREATE_AUDIO_SOURCE], 0, &res);
+  g_main_context_invoke_full (NULL,
+                              G_PRIORITY_DEFAULT,
+                              source_request_dispatch,
+                              request,
+                              source_request_unref);
+
+  g_mutex_lock (&self->lock);
+  while (!request->done && !self->stopping)
+    g_cond_wait (&self->cond, &self->lock);
+  res = g_steal_pointer (&request->result);
+  g_mutex_unlock (&self->lock);
+
+  if (!res)
+    g_debug ("WfdServer: No source was created");
+
+  source_request_unref (request);
 
   return res;
 }
 
+static GstElement *
+factory_source_create_cb (WfdMediaFactory *factory, WfdServer *self)
+{
+  return wfd_server_emit_create_source (self, SIGNAL_CREATE_SOURCE);
+}
+
+static GstElement *
+factory_audio_source_create_cb (WfdMediaFactory *factory, WfdServer *self)
+{
+  return wfd_server_emit_create_source (self, SIGNAL_CREATE_AUDIO_SOURCE);
+}
+
 static void
 wfd_server_init (WfdServer *self)
 {
   g_autoptr(WfdMediaFactory) factory = NULL;
   g_autoptr(GstRTSPMountPoints) mount_points = NULL;
+
+  g_mutex_init (&self->lock);
+  g_cond_init (&self->cond);
+
+  /* The RTSP control plane runs on its own context and thread so that
+   * keep-alives, IDR requests and PLAY handling do not have to wait for
+   * DBus, PulseAudio or NetworkManager work on the default context. */
+  self->context = g_main_context_new ();
+  self->loop = g_main_loop_new (self->context, FALSE);
+
   /* We need to clean up the pool regularly as it does not happen
    * automatically. */
-  self->clean_pool_source_id = g_timeout_add_seconds (2, clean_pool, self);
+  self->clean_pool_source = g_timeout_source_new_seconds (2);
+  g_source_set_callback (self->clean_pool_source, clean_pool, self, NULL);
+  g_source_attach (self->clean_pool_source, self->context);
 
   factory = wfd_media_factory_new ();
   g_signal_connect_object (factory,
@@ -235,3 +380,377 @@ wfd_server_purge (WfdServer *self)
   thread_pool = gst_rtsp_server_get_thread_pool (server);
   gst_rtsp_session_pool_filter (session_pool, pool_filter_remove_cb, NULL);
 }
+
+static gpointer
+wfd_server_thread_func (gpointer user_data)
+{
+  WfdServer *self = WFD_SERVER (user_data);
+
+  g_debug ("WfdServer: Control thread started");
+
+  /* Clients pick up the thread default context for their own timeouts. */
+  g_main_context_push_thread_default (self->context);
+  g_main_loop_run (self->loop);
+  g_main_context_pop_thread_default (self->context);
+
+  g_debug ("WfdServer: Control thread stopped");
+
+  return NULL;
+}
+
+static gboolean
+wfd_server_stop_in_thread (gpointer user_data)
+{
+  WfdServer *self = WFD_SERVER (user_data);
+  GSource *source;
+
+  source = g_main_context_find_source_by_id (self->context, self->source_id);
+  if (source)
+    g_source_destroy (source);
+  self->source_id = 0;
+
+  wfd_server_purge (self);
+  g_main_loop_quit (self->loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * wfd_server_acquire_shared
+ *
+ * Get the server shared by all streaming sinks, creating it and starting
+ * its control thread if no one is using it yet. The server, its clients and
+ * the media are driven from that thread; the create-source signals are
+ * still emitted on the default main context. Every successful
+ * call must be balanced with wfd_server_release_shared().
+ *
+ * Returns: (transfer full) (nullable): The shared #WfdServer, or %NULL if
+ * the server could not be attached.
+ */
+WfdServer *
+wfd_server_acquire_shared (void)
+{
+  if (shared_server == NULL)
+    {
+      g_autoptr(WfdServer) server = NULL;
+
+      server = wfd_server_new ();
+      server->source_id = gst_rtsp_server_attach (GST_RTSP_SERVER (server), server->context);
+      if (server->source_id == 0)
+        return NULL;
+
+      server->thread = g_thread_new ("wfd-server", wfd_server_thread_func, server);
+
+      shared_server = g_steal_pointer (&server);
+    }
+
+  shared_server->users++;
+  g_debug ("WfdServer: Shared server now has %u users", shared_server->users);
+
+  return g_object_ref (shared_server);
+}
+
+/**
+ * wfd_server_release_shared
+ * @self: the shared #WfdServer
+ *
+ * Drop a usage of the shared server. When the last user is gone, the
+ * server is detached, all remaining clients and sessions are purged and
+ * the control thread is joined.
+ * This does not drop the reference returned by wfd_server_acquire_shared().
+ */
+void
+wfd_server_release_shared (WfdServer *self)
+{
+  g_return_if_fail (self == shared_server);
+  g_return_if_fail (self->users > 0);
+
+  self->users--;
+  g_debug ("WfdServer: Shared server now has %u users", self->users);
+
+  if (self->users > 0)
+    return;
+
+  /* Unblock the control thread if it is waiting for a source. */
+  g_mutex_lock (&self->lock);
+  self->stopping = TRUE;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->lock);
+
+  g_main_context_invoke (self->context, wfd_server_stop_in_thread, self);
+  g_thread_join (g_steal_pointer (&self->thread));
+
+  g_clear_object (&shared_server);
+}
+
+typedef struct
+{
+  GClosure  closure;
+  GClosure *target;
+  gpointer  instance;
+  gulong    handler_id;
+} WfdMainContextClosure;
+
+typedef struct
+{
+  WfdMainContextClosure *closure;
+  GValue                *values;
+  guint                  n_values;
+} WfdMainContextEmission;
+
+static void
+main_context_emission_free (gpointer data)
+{
+  WfdMainContextEmission *emission = data;
+  guint i;
+
+  for (i = 0; i < emission->n_values; i++)
+    g_value_unset (&emission->values[i]);
+  g_free (emission->values);
+  g_closure_unref ((GClosure *) emission->closure);
+  g_free (emission);
+}
+
+static gboolean
+main_context_emission_dispatch (gpointer data)
+{
+  WfdMainContextEmission *emission = data;
+  WfdMainContextClosure *closure = emission->closure;
+
+  /* The handler may have been disconnected while we were queued. */
+  if (!g_signal_handler_is_connected (closure->instance, closure->handler_id))
+    return G_SOURCE_REMOVE;
+
+  g_closure_invoke (closure->target, NULL, emission->n_values, emission->values, NULL);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+main_context_closure_marshal (GClosure     *gclosure,
+                              GValue       *return_value,
+                              guint         n_param_values,
+                              const GValue *param_values,
+                              gpointer      invocation_hint,
+                              gpointer      marshal_data)
+{
+  WfdMainContextClosure *closure = (WfdMainContextClosure *) gclosure;
+  WfdMainContextEmission *emission;
+  guint i;
+
+  if (g_main_context_is_owner (g_main_context_default ()))
+    {
+      g_closure_invoke (closure->target, NULL, n_param_values, param_values, invocation_hint);
+      return;
+    }
+
+  emission = g_new0 (WfdMainContextEmission, 1);
+  emission->closure = (WfdMainContextClosure *) g_closure_ref (gclosure);
+  emission->n_values = n_param_values;
+  emission->values = g_new0 (GValue, n_param_values);
+  for (i = 0; i < n_param_values; i++)
+    {
+      g_value_init (&emission->values[i], G_VALUE_TYPE (&param_values[i]));
+      g_value_copy (&param_values[i], &emission->values[i]);
+    }
+
+  g_main_context_invoke_full (NULL,
+                              G_PRIORITY_DEFAULT,
+                              main_context_emission_dispatch,
+                              emission,
+                              main_context_emission_free);
+}
+
+static void
+main_context_closure_finalize (gpointer notify_data, GClosure *gclosure)
+{
+  WfdMainContextClosure *closure = (WfdMainContextClosure *) gclosure;
+
+  g_closure_unref (closure->target);
+}
+
+/**
+ * wfd_signal_connect_main_context
+ * @instance: the #WfdServer or #WfdClient to connect to
+ * @detailed_signal: the signal to connect to
+ * @c_handler: the handler, called with @gobject as the first argument
+ * @gobject: the object the handler belongs to
+ *
+ * Like g_signal_connect_object() with %G_CONNECT_SWAPPED, but emissions
+ * from the server thread are delivered on the default main context. The
+ * arguments are copied, so pointer arguments (e.g. a #GstRTSPContext) must
+ * not be dereferenced by the handler. Only signals without a return value
+ * can be connected this way. The handler can be disconnected with
+ * g_signal_handlers_disconnect_by_data() on @gobject.
+ *
+ * Returns: the handler ID
+ */
+gulong
+wfd_signal_connect_main_context (gpointer     instance,
+                                 const gchar *detailed_signal,
+                                 GCallback    c_handler,
+                                 gpointer     gobject)
+{
+  WfdMainContextClosure *closure;
+
+  closure = (WfdMainContextClosure *) g_closure_new_simple (sizeof (WfdMainContextClosure), gobject);
+  closure->target = g_cclosure_new_object_swap (c_handler, gobject);
+  g_closure_ref (closure->target);
+  g_closure_sink (closure->target);
+  g_closure_set_marshal (closure->target, g_cclosure_marshal_generic);
+  closure->instance = instance;
+
+  g_closure_set_marshal ((GClosure *) closure, main_context_closure_marshal);
+  g_closure_add_finalize_notifier ((GClosure *) closure, NULL, main_context_closure_finalize);
+  g_object_watch_closure (G_OBJECT (gobject), (GClosure *) closure);
+
+  closure->handler_id = g_signal_connect_closure (instance, detailed_signal, (GClosure *) closure, FALSE);
+
+  return closure->handler_id;
+}
+
+/* Whether the SETUP of @client is held back, with setup_gate_lock held.
+ * Clients that no sink claimed yet might belong to any sink that is being
+ * brought up. */
+static gboolean
+setup_is_held_locked (WfdClient *client)
+{
+  gpointer key = g_object_get_data (G_OBJECT (client), "wfd-setup-key");
+
+  if (!setup_holds)
+    return FALSE;
+
+  if (!key)
+    return g_hash_table_size (setup_holds) > 0;
+
+  return g_hash_table_contains (setup_holds, key);
+}
+
+/* Resume the parked clients that are not held anymore */
+static void
+resume_parked_clients (void)
+{
+  g_autoptr(GPtrArray) clients = NULL;
+  guint i;
+
+  g_mutex_lock (&setup_gate_lock);
+  for (i = 0; parked_clients && i < parked_clients->len;)
+    {
+      WfdClient *client = g_ptr_array_index (parked_clients, i);
+
+      if (setup_is_held_locked (client))
+        {
+          i++;
+          continue;
+        }
+
+      if (!clients)
+        clients = g_ptr_array_new_with_free_func (g_object_unref);
+      g_ptr_array_add (clients, g_object_ref (client));
+      g_ptr_array_remove_index (parked_clients, i);
+    }
+  g_mutex_unlock (&setup_gate_lock);
+
+  if (!clients)
+    return;
+
+  g_debug ("WfdServer: Releasing %u clients waiting for SETUP", clients->len);
+  for (i = 0; i < clients->len; i++)
+    wfd_client_resume_setup (g_ptr_array_index (clients, i));
+}
+
+/**
+ * wfd_server_hold_setup
+ * @key: identifies the sink that is being brought up
+ *
+ * Hold back the SETUP trigger of the clients assigned to @key (see
+ * wfd_server_assign_setup()) until the matching wfd_server_release_setup().
+ * Used while the capture sources are started in parallel with the
+ * connection to the sink. Clients of other sinks are not affected.
+ */
+void
+wfd_server_hold_setup (gpointer key)
+{
+  guint holds;
+
+  g_mutex_lock (&setup_gate_lock);
+  if (!setup_holds)
+    setup_holds = g_hash_table_new (NULL, NULL);
+  holds = GPOINTER_TO_UINT (g_hash_table_lookup (setup_holds, key));
+  g_hash_table_insert (setup_holds, key, GUINT_TO_POINTER (holds + 1));
+  g_mutex_unlock (&setup_gate_lock);
+}
+
+/**
+ * wfd_server_release_setup
+ * @key: the key passed to wfd_server_hold_setup()
+ *
+ * Drop a hold taken with wfd_server_hold_setup(). Once no holds are left
+ * for @key, the clients parked for it continue with their SETUP trigger.
+ */
+void
+wfd_server_release_setup (gpointer key)
+{
+  guint holds;
+
+  g_mutex_lock (&setup_gate_lock);
+  holds = setup_holds ? GPOINTER_TO_UINT (g_hash_table_lookup (setup_holds, key)) : 0;
+  if (holds == 0)
+    {
+      g_mutex_unlock (&setup_gate_lock);
+      g_return_if_reached ();
+    }
+
+  if (holds > 1)
+    g_hash_table_insert (setup_holds, key, GUINT_TO_POINTER (holds - 1));
+  else
+    g_hash_table_remove (setup_holds, key);
+  g_mutex_unlock (&setup_gate_lock);
+
+  resume_parked_clients ();
+}
+
+/**
+ * wfd_server_assign_setup
+ * @client: a #WfdClient
+ * @key: the key of the sink that claimed @client
+ *
+ * Tell the SETUP gate which sink @client belongs to. Until then the
+ * client is held back by the holds of all sinks. Safe to call from any
+ * thread.
+ */
+void
+wfd_server_assign_setup (WfdClient *client,
+                         gpointer   key)
+{
+  g_mutex_lock (&setup_gate_lock);
+  g_object_set_data (G_OBJECT (client), "wfd-setup-key", key);
+  g_mutex_unlock (&setup_gate_lock);
+
+  resume_parked_clients ();
+}
+
+/**
+ * wfd_server_park_setup
+ * @client: the #WfdClient that is about to trigger SETUP
+ *
+ * Returns: %TRUE if SETUP is held, @client will be resumed with
+ * wfd_client_resume_setup() once it is released.
+ */
+gboolean
+wfd_server_park_setup (WfdClient *client)
+{
+  g_mutex_lock (&setup_gate_lock);
+  if (!setup_is_held_locked (client))
+    {
+      g_mutex_unlock (&setup_gate_lock);
+      return FALSE;
+    }
+
+  if (!parked_clients)
+    parked_clients = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_add (parked_clients, g_object_ref (client));
+  g_mutex_unlock (&setup_gate_lock);
+
+  return TRUE;
+}
@@ -5,6 +5,8 @@
 #include <gst/rtsp-server/rtsp-server.h>
 #pragma GCC diagnostic pop
 
+#include "wfd-client.h"
+
 G_BEGIN_DECLS
 
 #define WFD_TYPE_SERVER (wfd_server_get_type ())
@@ -14,4 +16,18 @@ G_DECLARE_FINAL_TYPE (WfdServer, wfd_server, WFD, SERVER, GstRTSPServer)
 WfdServer * wfd_server_new (void);
 void wfd_server_purge (WfdServer *self);
 
+WfdServer * wfd_server_acquire_shared (void);
+void wfd_server_release_shared (WfdServer *self);
+
+void wfd_server_hold_setup (gpointer key);
+void wfd_server_release_setup (gpointer key);
+void wfd_server_assign_setup (WfdClient *client,
+                              gpointer   key);
+gboolean wfd_server_park_setup (WfdClient *client);
+
+gulong wfd_signal_connect_main_context (gpointer     instance,
+                                        const gchar *detailed_signal,
+                                        GCallback    c_handler,
+                                        gpointer     gobject);
+
 G_END_DECLS
@@ -0,0 +1,319 @@
+/* wfd-sink-cache.c
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "wfd-sink-cache.h"
+
+/* Many sinks are not ready to answer our OPTIONS right after connecting,
+ * so an unknown sink gets this much time. */
+#define DEFAULT_QUERY_DELAY_MS 500
+#define MAX_QUERY_DELAY_MS 2000
+/* Below this we just send the request right away */
+#define MIN_QUERY_DELAY_MS 50
+/* Don't bother shortening the delay by less than this */
+#define MIN_QUERY_DELAY_STEP_MS 25
+
+/* Everything we learn about sinks, grouped by sink ID. Only ever touched
+ * with the lock held, clients of different sinks may run concurrently. */
+static GMutex cache_lock;
+static GKeyFile *cache = NULL;
+
+static gchar *
+get_cache_path (void)
+{
+  return g_build_filename (g_get_user_cache_dir (), "deepin-network-displays", "sinks.ini", NULL);
+}
+
+static GKeyFile *
+get_cache (void)
+{
+  g_autofree gchar *path = NULL;
+
+  if (cache)
+    return cache;
+
+  cache = g_key_file_new ();
+  path = get_cache_path ();
+  g_key_file_load_from_file (cache, path, G_KEY_FILE_NONE, NULL);
+
+  return cache;
+}
+
+static void
+save_cache (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *path = get_cache_path ();
+  g_autofree gchar *dir = g_path_get_dirname (path);
+
+  g_mkdir_with_parents (dir, 0700);
+  if (!g_key_file_save_to_file (cache, path, &error))
+    g_warning ("WfdSinkCache: Could not save %s: %s", path, error->message);
+}
+
+/**
+ * wfd_sink_cache_get_sink_id:
+ * @address: the IP address of the sink
+ *
+ * Sinks get a new IP address from us on every connection, so they are
+ * remembered by their hardware address, which is looked up in the
+ * neighbour table. If that fails (e.g. for local test connections), the
+ * IP address itself is used.
+ *
+ * Returns: (transfer full): the ID to store the sink's data under
+ */
+gchar *
+wfd_sink_cache_get_sink_id (const gchar *address)
+{
+  g_autofree gchar *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  gchar **line;
+
+  if (!address)
+    return g_strdup ("unknown");
+
+  if (!g_file_get_contents ("/proc/net/arp", &contents, NULL, NULL))
+    return g_strdup (address);
+
+  lines = g_strsplit (contents, "\n", 0);
+  /* Skip the header line */
+  for (line = lines[0] ? lines + 1 : lines; *line; line++)
+    {
+      g_auto(GStrv) fields = g_strsplit_set (*line, " \t", 0);
+      gchar *ip = NULL;
+      gchar *hw_address = NULL;
+      gchar **field;
+
+      for (field = fields; *field; field++)
+        {
+          if (**field == '\0')
+            continue;
+
+          if (!ip)
+            {
+              ip = *field;
+            }
+          else if (strlen (*field) == 17 && (*field)[2] == ':')
+            {
+              hw_address = *field;
+              break;
+            }
+        }
+
+      if (ip && hw_address && g_str_equal (ip, address) &&
+          !g_str_equal (hw_address, "00:00:00:00:00:00"))
+        return g_ascii_strdown (hw_address, -1);
+    }
+
+  return g_strdup (address);
+}
+
+/**
+ * wfd_sink_cache_get_query_delay:
+ * @sink_id: the sink
+ *
+ * Returns: how long to wait after the sink connected before querying its
+ * WFD support in ms
+ */
+guint
+wfd_sink_cache_get_query_delay (const gchar *sink_id)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&cache_lock);
+  GKeyFile *keyfile = get_cache ();
+
+  if (!g_key_file_has_key (keyfile, sink_id, "QueryDelay", NULL))
+    return DEFAULT_QUERY_DELAY_MS;
+
+  return MIN (g_key_file_get_integer (keyfile, sink_id, "QueryDelay", NULL), MAX_QUERY_DELAY_MS);
+}
+
+/**
+ * wfd_sink_cache_query_done:
+ * @sink_id: the sink
+ * @delay_ms: the delay that was used
+ * @success: whether the sink answered the query
+ *
+ * Adapts the delay for the next connection of the sink. A sink that
+ * answered gets less time next time, but never as little as a delay it
+ * failed with before: the delay only goes halfway towards the last
+ * failing one and stays put once that step gets small. A sink that did
+ * not answer goes back to the last delay that worked, so every sink
+ * settles slightly above the shortest delay it copes with.
+ */
+void
+wfd_sink_cache_query_done (const gchar *sink_id,
+                           guint        delay_ms,
+                           gboolean     success)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&cache_lock);
+  GKeyFile *keyfile = get_cache ();
+  guint next;
+
+  if (success)
+    {
+      g_key_file_set_integer (keyfile, sink_id, "QueryDelayGood", delay_ms);
+
+      if (g_key_file_has_key (keyfile, sink_id, "QueryDelayFailed", NULL))
+        {
+          guint failed = g_key_file_get_integer (keyfile, sink_id, "QueryDelayFailed", NULL);
+
+          next = failed < delay_ms ? (failed + delay_ms) / 2 : delay_ms;
+          if (delay_ms - next < MIN_QUERY_DELAY_STEP_MS)
+            next = delay_ms;
+        }
+      else
+        {
+          next = delay_ms / 2 < MIN_QUERY_DELAY_MS ? 0 : delay_ms / 2;
+        }
+    }
+  else
+    {
+      guint good = DEFAULT_QUERY_DELAY_MS;
+
+      if (g_key_file_has_key (keyfile, sink_id, "QueryDelayGood", NULL))
+        good = g_key_file_get_integer (keyfile, sink_id, "QueryDelayGood", NULL);
+
+      g_key_file_set_integer (keyfile, sink_id, "QueryDelayFailed", delay_ms);
+      /* If even the delay that used to work failed, the sink got slower */
+      next = good > delay_ms ? good : MAX (delay_ms * 2, MIN_QUERY_DELAY_MS);
+      next = MIN (next, MAX_QUERY_DELAY_MS);
+    }
+
+  if (!g_key_file_has_key (keyfile, sink_id, "QueryDelay", NULL) ||
+      g_key_file_get_integer (keyfile, sink_id, "QueryDelay", NULL) != (gint) next)
+    g_debug ("WfdSinkCache: Using a query delay of %u ms for sink %s from now on", next, sink_id);
+  g_key_file_set_integer (keyfile, sink_id, "QueryDelay", next);
+  save_cache ();
+}
+
+/**
+ * wfd_sink_cache_set_timings:
+ * @sink_id: the sink
+ * @timings_ms: the duration of each step of the connection setup
+ * @n_timings: the number of steps
+ *
+ * Remembers how long the last connection setup with the sink took, so
+ * that regressions can be spotted by comparing with earlier runs.
+ */
+void
+wfd_sink_cache_set_timings (const gchar *sink_id,
+                            const guint *timings_ms,
+                            gsize        n_timings)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&cache_lock);
+  GKeyFile *keyfile = get_cache ();
+  g_autofree gint *values = g_new (gint, n_timings);
+  gsize i;
+
+  for (i = 0; i < n_timings; i++)
+    values[i] = timings_ms[i];
+
+  g_key_file_set_integer_list (keyfile, sink_id, "Timings", values, n_timings);
+  save_cache ();
+}
+
+/**
+ * wfd_sink_cache_get_capabilities:
+ * @sink_id: the sink
+ * @format: (out) (optional): the video and audio format chosen for them
+ *
+ * Returns: (transfer full) (nullable): the GET_PARAMETER (M3) response the
+ * sink sent last time
+ */
+gchar *
+wfd_sink_cache_get_capabilities (const gchar *sink_id,
+                                 gchar      **format)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&cache_lock);
+  GKeyFile *keyfile = get_cache ();
+
+  if (format)
+    *format = g_key_file_get_string (keyfile, sink_id, "Format", NULL);
+
+  return g_key_file_get_string (keyfile, sink_id, "Capabilities", NULL);
+}
+
+void
+wfd_sink_cache_set_capabilities (const gchar *sink_id,
+                                 const gchar *capabilities,
+                                 const gchar *format)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&cache_lock);
+  GKeyFile *keyfile = get_cache ();
+
+  g_key_file_set_string (keyfile, sink_id, "Capabilities", capabilities);
+  g_key_file_set_string (keyfile, sink_id, "Format", format);
+  save_cache ();
+}
+
+/**
+ * wfd_sink_cache_get_operating_point:
+ * @sink_id: the sink
+ * @encoder: (out): the encoder that was used
+ * @bitrate_kbit: (out): the bitrate to start with
+ *
+ * Returns: %TRUE if a previous session with the sink left a bitrate
+ */
+gboolean
+wfd_sink_cache_get_operating_point (const gchar *sink_id,
+                                    gchar      **encoder,
+                                    guint       *bitrate_kbit)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&cache_lock);
+  GKeyFile *keyfile = get_cache ();
+
+  if (!g_key_file_has_key (keyfile, sink_id, "Bitrate", NULL))
+    return FALSE;
+
+  *encoder = g_key_file_get_string (keyfile, sink_id, "Encoder", NULL);
+  *bitrate_kbit = g_key_file_get_integer (keyfile, sink_id, "Bitrate", NULL);
+
+  return *bitrate_kbit > 0;
+}
+
+void
+wfd_sink_cache_set_operating_point (const gchar *sink_id,
+                                    const gchar *encoder,
+                                    guint        bitrate_kbit)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&cache_lock);
+  GKeyFile *keyfile = get_cache ();
+
+  g_key_file_set_string (keyfile, sink_id, "Encoder", encoder);
+  g_key_file_set_integer (keyfile, sink_id, "Bitrate", bitrate_kbit);
+  save_cache ();
+}
+
+/**
+ * wfd_sink_cache_invalidate:
+ * @sink_id: the sink
+ *
+ * Forgets the capabilities and operating point of the sink, e.g. because
+ * it announced something different than last time. What was learned about
+ * the connection setup is kept.
+ */
+void
+wfd_sink_cache_invalidate (const gchar *sink_id)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&cache_lock);
+  GKeyFile *keyfile = get_cache ();
+  const gchar *keys[] = { "Capabilities", "Format", "Encoder", "Bitrate" };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (keys); i++)
+    g_key_file_remove_key (keyfile, sink_id, keys[i], NULL);
+  save_cache ();
+}
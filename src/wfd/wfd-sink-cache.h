@@ -0,0 +1,30 @@
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gchar * wfd_sink_cache_get_sink_id (const gchar *address);
+
+guint   wfd_sink_cache_get_query_delay (const gchar *sink_id);
+void    wfd_sink_cache_query_done (const gchar *sink_id,
+                                   guint        delay_ms,
+                                   gboolean     success);
+void    wfd_sink_cache_set_timings (const gchar *sink_id,
+                                    const guint *timings_ms,
+                                    gsize        n_timings);
+
+gchar * wfd_sink_cache_get_capabilities (const gchar *sink_id,
+                                         gchar      **format);
+void    wfd_sink_cache_set_capabilities (const gchar *sink_id,
+                                         const gchar *capabilities,
+                                         const gchar *format);
+gboolean wfd_sink_cache_get_operating_point (const gchar *sink_id,
+                                             gchar      **encoder,
+                                             guint       *bitrate_kbit);
+void    wfd_sink_cache_set_operating_point (const gchar *sink_id,
+                                            const gchar *encoder,
+                                            guint        bitrate_kbit);
+void    wfd_sink_cache_invalidate (const gchar *sink_id);
+
+G_END_DECLS
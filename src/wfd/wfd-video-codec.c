@@ -366,6 +366,31 @@ wfd_video_codec_get_max_bitrate_kbit (WfdVideoCodec *self)
   return bitrate;
 }
 
+/**
+ * wfd_video_codec_supports_resolution:
+ * @self: a #WfdVideoCodec
+ * @resolution: the #WfdResolution
+ *
+ * Checks whether the sink announced support for @resolution in any of the
+ * CEA, VESA or handheld resolution tables.
+ *
+ * Returns: #TRUE if the resolution is supported
+ */
+gboolean
+wfd_video_codec_supports_resolution (WfdVideoCodec *self, const WfdResolution *resolution)
+{
+  if (self->cea_sup & sup_for_resolution (RESOLUTION_TABLE_CEA, resolution))
+    return TRUE;
+
+  if (self->vesa_sup & sup_for_resolution (RESOLUTION_TABLE_VESA, resolution))
+    return TRUE;
+
+  if (self->hh_sup & sup_for_resolution (RESOLUTION_TABLE_HH, resolution))
+    return TRUE;
+
+  return FALSE;
+}
+
 /**
  * wfd_video_codec_get_resolutions:
  * @self: a #WfdVideoCodec
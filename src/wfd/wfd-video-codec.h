@@ -49,6 +49,8 @@ WfdVideoCodec     *wfd_video_codec_new_from_desc (gint         native,
 
 guint32            wfd_video_codec_get_max_bitrate_kbit (WfdVideoCodec *self);
 
+gboolean           wfd_video_codec_supports_resolution (WfdVideoCodec       *self,
+                                                        const WfdResolution *resolution);
 GList             *wfd_video_codec_get_resolutions (WfdVideoCodec *self);
 gchar             *wfd_video_codec_get_descriptor_for_resolution (WfdVideoCodec       *self,
                                                                   const WfdResolution *resolution);